@@ -0,0 +1,349 @@
+#include "colorconverter.h"
+#include "mmal/mmal_encodings.h"
+
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COLOR_CONVERTER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define COLOR_CONVERTER_SSE2
+#endif
+
+#define COLOR_FIXED_POINT_SHIFT 6
+#define COLOR_FIXED_POINT_ROUND (1 << (COLOR_FIXED_POINT_SHIFT - 1))
+
+/** Coefficients of the conversion, in 6 bit fixed point.
+ * 6 bits keep the intermediate sums inside 16 bits, which is what the SIMD kernels use.
+ */
+static ColorConverter::COEFFICIENTS makeCoefficients(COLOR_MATRIX_T matrix, COLOR_RANGE_T range)
+{
+    // Kr and Kb of the matrix
+    double kr = matrix == COLOR_MATRIX_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == COLOR_MATRIX_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double y_scale = range == COLOR_RANGE_LIMITED ? 255.0/219.0 : 1.0;
+    double c_scale = range == COLOR_RANGE_LIMITED ? 255.0/224.0 : 1.0;
+    double one = 1 << COLOR_FIXED_POINT_SHIFT;
+
+    ColorConverter::COEFFICIENTS c;
+    c.y_offset = range == COLOR_RANGE_LIMITED ? 16 : 0;
+    c.y = (int16_t) (y_scale*one + 0.5);
+    c.vr = (int16_t) (2.0*(1.0 - kr)*c_scale*one + 0.5);
+    c.ug = (int16_t) (2.0*(1.0 - kb)*kb/kg*c_scale*one + 0.5);
+    c.vg = (int16_t) (2.0*(1.0 - kr)*kr/kg*c_scale*one + 0.5);
+    c.ub = (int16_t) (2.0*(1.0 - kb)*c_scale*one + 0.5);
+    return c;
+}
+
+static inline unsigned char clampPixel(int value)
+{
+    value = (value + COLOR_FIXED_POINT_ROUND) >> COLOR_FIXED_POINT_SHIFT;
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int saturate16(int value)
+{
+    return value < -32768 ? -32768 : (value > 32767 ? 32767 : value);
+}
+
+/**
+ * @brief convertLineScalar
+ * Reference conversion of the pixels [from, width) of a line. Sums saturate on 16 bits
+ * like the SIMD kernels.
+ */
+static void convertLineScalar(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                              unsigned char *dst, unsigned int from, unsigned int width,
+                              const ColorConverter::COEFFICIENTS &c, unsigned int channels, bool bgr)
+{
+    unsigned char *out = dst + from*channels;
+    for (unsigned int x = from; x < width; x++, out += channels) {
+        int luma = (y[x] - c.y_offset)*c.y;
+        int cb = u[x/2] - 128;
+        int cr = v[x/2] - 128;
+        unsigned char r = clampPixel(saturate16(luma + c.vr*cr));
+        unsigned char g = clampPixel(saturate16(saturate16(luma - c.ug*cb) - c.vg*cr));
+        unsigned char b = clampPixel(saturate16(luma + c.ub*cb));
+        out[0] = bgr ? b : r;
+        out[1] = g;
+        out[2] = bgr ? r : b;
+        if (channels == 4) out[3] = 255;
+    }
+}
+
+#if defined(COLOR_CONVERTER_NEON)
+
+/**
+ * @brief convertLineSimd
+ * NEON kernel, 16 pixels per iteration. The chroma is duplicated with vzip and the
+ * rounding, shift and clamp are done by vqrshrun.
+ * @return the number of pixels converted
+ */
+static unsigned int convertLineSimd(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                                    unsigned char *dst, unsigned int width,
+                                    const ColorConverter::COEFFICIENTS &c, unsigned int channels, bool bgr)
+{
+    const int16x8_t k128 = vdupq_n_s16(128);
+    const int16x8_t y_offset = vdupq_n_s16(c.y_offset);
+    const uint8x16_t alpha = vdupq_n_u8(255);
+
+    unsigned int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t y8 = vld1q_u8(y + x);
+        int16x8_t cb = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x/2))), k128);
+        int16x8_t cr = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x/2))), k128);
+        int16x8x2_t cb2 = vzipq_s16(cb, cb);
+        int16x8x2_t cr2 = vzipq_s16(cr, cr);
+
+        int16x8_t luma[2];
+        luma[0] = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y8))), y_offset), c.y);
+        luma[1] = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y8))), y_offset), c.y);
+
+        uint8x8_t r[2], g[2], b[2];
+        for (int h = 0; h < 2; h++) {
+            int16x8_t r16 = vqaddq_s16(luma[h], vmulq_n_s16(cr2.val[h], c.vr));
+            int16x8_t g16 = vqsubq_s16(vqsubq_s16(luma[h], vmulq_n_s16(cb2.val[h], c.ug)), vmulq_n_s16(cr2.val[h], c.vg));
+            int16x8_t b16 = vqaddq_s16(luma[h], vmulq_n_s16(cb2.val[h], c.ub));
+            r[h] = vqrshrun_n_s16(r16, COLOR_FIXED_POINT_SHIFT);
+            g[h] = vqrshrun_n_s16(g16, COLOR_FIXED_POINT_SHIFT);
+            b[h] = vqrshrun_n_s16(b16, COLOR_FIXED_POINT_SHIFT);
+        }
+        uint8x16_t red = vcombine_u8(r[0], r[1]);
+        uint8x16_t green = vcombine_u8(g[0], g[1]);
+        uint8x16_t blue = vcombine_u8(b[0], b[1]);
+
+        if (channels == 4) {
+            uint8x16x4_t pixels;
+            pixels.val[0] = bgr ? blue : red;
+            pixels.val[1] = green;
+            pixels.val[2] = bgr ? red : blue;
+            pixels.val[3] = alpha;
+            vst4q_u8(dst + x*4, pixels);
+        }
+        else {
+            uint8x16x3_t pixels;
+            pixels.val[0] = bgr ? blue : red;
+            pixels.val[1] = green;
+            pixels.val[2] = bgr ? red : blue;
+            vst3q_u8(dst + x*3, pixels);
+        }
+    }
+    return x;
+}
+
+#elif defined(COLOR_CONVERTER_SSE2)
+
+/**
+ * @brief convertLineSimd
+ * SSE2 kernel, 16 pixels per iteration. 4 channel pixels are interleaved with unpacks,
+ * 3 channel pixels go through a small buffer since SSE2 has no 3 way interleave.
+ * @return the number of pixels converted
+ */
+static unsigned int convertLineSimd(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                                    unsigned char *dst, unsigned int width,
+                                    const ColorConverter::COEFFICIENTS &c, unsigned int channels, bool bgr)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k128 = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi16(COLOR_FIXED_POINT_ROUND);
+    const __m128i y_offset = _mm_set1_epi16(c.y_offset);
+    const __m128i ky = _mm_set1_epi16(c.y);
+    const __m128i kvr = _mm_set1_epi16(c.vr);
+    const __m128i kug = _mm_set1_epi16(c.ug);
+    const __m128i kvg = _mm_set1_epi16(c.vg);
+    const __m128i kub = _mm_set1_epi16(c.ub);
+    const __m128i alpha = _mm_set1_epi8((char) 0xFF);
+
+    unsigned int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i y8 = _mm_loadu_si128((const __m128i *) (y + x));
+        __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (u + x/2)), zero), k128);
+        __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (v + x/2)), zero), k128);
+        __m128i cb2[2] = { _mm_unpacklo_epi16(cb, cb), _mm_unpackhi_epi16(cb, cb) };
+        __m128i cr2[2] = { _mm_unpacklo_epi16(cr, cr), _mm_unpackhi_epi16(cr, cr) };
+        __m128i luma[2] = { _mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y8, zero), y_offset), ky),
+                            _mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y8, zero), y_offset), ky) };
+
+        __m128i r[2], g[2], b[2];
+        for (int h = 0; h < 2; h++) {
+            r[h] = _mm_adds_epi16(luma[h], _mm_mullo_epi16(cr2[h], kvr));
+            g[h] = _mm_subs_epi16(_mm_subs_epi16(luma[h], _mm_mullo_epi16(cb2[h], kug)), _mm_mullo_epi16(cr2[h], kvg));
+            b[h] = _mm_adds_epi16(luma[h], _mm_mullo_epi16(cb2[h], kub));
+            r[h] = _mm_srai_epi16(_mm_adds_epi16(r[h], round), COLOR_FIXED_POINT_SHIFT);
+            g[h] = _mm_srai_epi16(_mm_adds_epi16(g[h], round), COLOR_FIXED_POINT_SHIFT);
+            b[h] = _mm_srai_epi16(_mm_adds_epi16(b[h], round), COLOR_FIXED_POINT_SHIFT);
+        }
+        __m128i red = _mm_packus_epi16(r[0], r[1]);
+        __m128i green = _mm_packus_epi16(g[0], g[1]);
+        __m128i blue = _mm_packus_epi16(b[0], b[1]);
+        __m128i first = bgr ? blue : red;
+        __m128i third = bgr ? red : blue;
+
+        if (channels == 4) {
+            __m128i fg_lo = _mm_unpacklo_epi8(first, green);
+            __m128i fg_hi = _mm_unpackhi_epi8(first, green);
+            __m128i ta_lo = _mm_unpacklo_epi8(third, alpha);
+            __m128i ta_hi = _mm_unpackhi_epi8(third, alpha);
+            __m128i *out = (__m128i *) (dst + x*4);
+            _mm_storeu_si128(out, _mm_unpacklo_epi16(fg_lo, ta_lo));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(fg_lo, ta_lo));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(fg_hi, ta_hi));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(fg_hi, ta_hi));
+        }
+        else {
+            unsigned char planes[3][16] __attribute__((aligned(16)));
+            _mm_store_si128((__m128i *) planes[0], first);
+            _mm_store_si128((__m128i *) planes[1], green);
+            _mm_store_si128((__m128i *) planes[2], third);
+            unsigned char *out = dst + x*3;
+            for (int i = 0; i < 16; i++, out += 3) {
+                out[0] = planes[0][i];
+                out[1] = planes[1][i];
+                out[2] = planes[2][i];
+            }
+        }
+    }
+    return x;
+}
+
+#else
+
+static unsigned int convertLineSimd(const unsigned char *, const unsigned char *, const unsigned char *,
+                                    unsigned char *, unsigned int,
+                                    const ColorConverter::COEFFICIENTS &, unsigned int, bool)
+{
+    return 0;
+}
+
+#endif
+
+/**
+ * @brief outputChannels
+ * @param dst_format : MMAL encoding of the converted frame
+ * @param bgr : set to true if blue comes first
+ * @return the number of bytes per pixel, 0 if the format isn't supported
+ */
+static unsigned int outputChannels(int dst_format, bool *bgr)
+{
+    *bgr = (dst_format == MMAL_ENCODING_BGR24 || dst_format == MMAL_ENCODING_BGRA);
+    if (dst_format == MMAL_ENCODING_RGB24 || dst_format == MMAL_ENCODING_BGR24) return 3;
+    if (dst_format == MMAL_ENCODING_RGBA || dst_format == MMAL_ENCODING_BGRA) return 4;
+    if (dst_format == MMAL_ENCODING_GREY) return 1;
+    return 0;
+}
+
+
+/**
+ * @brief ColorConverter::ColorConverter
+ * @param matrix : matrix of the YUV frames
+ * @param range : range of the YUV frames
+ */
+ColorConverter::ColorConverter(COLOR_MATRIX_T matrix, COLOR_RANGE_T range)
+{
+    setMatrix(matrix, range);
+}
+
+/**
+ * @brief ColorConverter::setMatrix
+ * Select the matrix and range of the frames to convert.
+ * @param matrix : COLOR_MATRIX_BT601 or COLOR_MATRIX_BT709
+ * @param range : COLOR_RANGE_LIMITED or COLOR_RANGE_FULL
+ */
+void ColorConverter::setMatrix(COLOR_MATRIX_T matrix, COLOR_RANGE_T range)
+{
+    m_matrix = matrix;
+    m_range = range;
+    m_coefficients = makeCoefficients(matrix, range);
+}
+
+/**
+ * @brief ColorConverter::getColorSpace
+ * @return the MMAL color space the producing port must be set to, so that the frames
+ * match the matrix and range of the converter
+ */
+MMAL_FOURCC_T ColorConverter::getColorSpace() const
+{
+    if (m_matrix == COLOR_MATRIX_BT709) return MMAL_COLOR_SPACE_ITUR_BT709;
+    if (m_range == COLOR_RANGE_FULL) return MMAL_COLOR_SPACE_JPEG_JFIF;
+    return MMAL_COLOR_SPACE_ITUR_BT601;
+}
+
+/**
+ * @brief ColorConverter::isSupported
+ * @param dst_format : MMAL encoding of the converted frame
+ * @return true if I420 frames can be converted to dst_format
+ */
+bool ColorConverter::isSupported(int dst_format)
+{
+    bool bgr;
+    return outputChannels(dst_format, &bgr) != 0;
+}
+
+/**
+ * @brief ColorConverter::getKernelName
+ * @return the name of the kernel selected at compile time
+ */
+const char *ColorConverter::getKernelName()
+{
+#if defined(COLOR_CONVERTER_NEON)
+    return "neon";
+#elif defined(COLOR_CONVERTER_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+/**
+ * @brief ColorConverter::convert
+ * Convert an I420 frame. The lines are processed by the SIMD kernel, the remaining pixels
+ * of each line by the scalar one.
+ * @param src : start of the frame
+ * @param layout : layout of the I420 frame
+ * @param dst : destination of the converted frame
+ * @param dst_format : RGB24, BGR24, RGBA, BGRA or GREY
+ * @param dst_stride : line stride of the destination in bytes, 0 for lines without padding
+ * @return false if the frame isn't I420 or the format isn't supported
+ */
+bool ColorConverter::convert(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                             int dst_format, unsigned int dst_stride) const
+{
+    return convertFrame(src, layout, dst, dst_format, dst_stride, true);
+}
+
+/**
+ * @brief ColorConverter::convertReference
+ * Same as convert() with the scalar kernel only, to check the SIMD kernels.
+ */
+bool ColorConverter::convertReference(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                                      int dst_format, unsigned int dst_stride) const
+{
+    return convertFrame(src, layout, dst, dst_format, dst_stride, false);
+}
+
+bool ColorConverter::convertFrame(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                                  int dst_format, unsigned int dst_stride, bool simd) const
+{
+    bool bgr;
+    unsigned int channels = outputChannels(dst_format, &bgr);
+    if (!channels || layout.format != MMAL_ENCODING_I420 || layout.planes != 3) return false;
+    if (!dst_stride) dst_stride = layout.width*channels;
+
+    if (channels == 1) {
+        FRAME_LAYOUT luma = layout;
+        luma.planes = 1;
+        copyFrame(src, luma, dst, dst_stride);
+        return true;
+    }
+
+    for (unsigned int line = 0; line < layout.height; line++) {
+        const unsigned char *y = src + layout.offset[0] + (size_t) line*layout.pitch[0];
+        const unsigned char *u = src + layout.offset[1] + (size_t) (line/2)*layout.pitch[1];
+        const unsigned char *v = src + layout.offset[2] + (size_t) (line/2)*layout.pitch[2];
+        unsigned char *out = dst + (size_t) line*dst_stride;
+        unsigned int done = simd ? convertLineSimd(y, u, v, out, layout.width, m_coefficients, channels, bgr) : 0;
+        convertLineScalar(y, u, v, out, done, layout.width, m_coefficients, channels, bgr);
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef COLORCONVERTER_H
+#define COLORCONVERTER_H
+
+#include "mmal/mmal.h"
+#include "framelease.h"
+
+#include <stdint.h>
+
+/** Matrix used to convert YUV to RGB
+*/
+enum COLOR_MATRIX_T
+{
+    COLOR_MATRIX_BT601,    /// SD matrix, default of the camera
+    COLOR_MATRIX_BT709     /// HD matrix
+};
+
+/** Range of the YUV samples
+*/
+enum COLOR_RANGE_T
+{
+    COLOR_RANGE_LIMITED,   /// Y in [16,235], UV in [16,240]
+    COLOR_RANGE_FULL       /// Y and UV in [0,255] (JFIF)
+};
+
+/**
+ * @brief The ColorConverter class
+ * Conversion of I420 frames to RGB24, BGR24, RGBA, BGRA or GREY on the CPU.
+ * Lines are converted by a NEON kernel on ARM, a SSE2 kernel on x86 and a scalar kernel
+ * otherwise. All kernels use the same 6 bit fixed point arithmetic and give the same result.
+ */
+class ColorConverter
+{
+public:
+    ColorConverter(COLOR_MATRIX_T matrix = COLOR_MATRIX_BT601, COLOR_RANGE_T range = COLOR_RANGE_FULL);
+
+    void setMatrix(COLOR_MATRIX_T matrix, COLOR_RANGE_T range);
+    COLOR_MATRIX_T getMatrix() const { return m_matrix; }
+    COLOR_RANGE_T getRange() const { return m_range; }
+    MMAL_FOURCC_T getColorSpace() const;
+
+    bool convert(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                 int dst_format, unsigned int dst_stride) const;
+    bool convertReference(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                          int dst_format, unsigned int dst_stride) const;
+
+    static bool isSupported(int dst_format);
+    static const char *getKernelName();
+
+    struct COEFFICIENTS
+    {
+        int16_t y_offset;   /// Black level of Y
+        int16_t y;          /// Y gain
+        int16_t vr;         /// V contribution to R
+        int16_t ug;         /// U contribution to G (subtracted)
+        int16_t vg;         /// V contribution to G (subtracted)
+        int16_t ub;         /// U contribution to B
+    };
+
+private:
+    bool convertFrame(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst,
+                      int dst_format, unsigned int dst_stride, bool simd) const;
+
+    COLOR_MATRIX_T m_matrix;
+    COLOR_RANGE_T m_range;
+    COEFFICIENTS m_coefficients;
+};
+
+#endif // COLORCONVERTER_H
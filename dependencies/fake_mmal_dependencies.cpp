@@ -3,10 +3,18 @@
 #include "mmal/util/mmal_util_params.h"
 #include "mmal/mmal.h"
 #include "mmal/util/mmal_connection.h"
-MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue){}
-MMAL_STATUS_T mmal_buffer_header_mem_lock(MMAL_BUFFER_HEADER_T *header){}
+MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue){ return NULL; }
+MMAL_STATUS_T mmal_buffer_header_mem_lock(MMAL_BUFFER_HEADER_T *header){ return MMAL_ENOSYS; }
 
 void mmal_buffer_header_mem_unlock(MMAL_BUFFER_HEADER_T *header){}
+
+/** Acquire a buffer header.
+ * Acquiring a buffer header increases a reference counter on it and makes sure that the
+ * buffer header won't be recycled until all the references to it are gone.
+ *
+ * @param header buffer header to acquire
+ */
+void mmal_buffer_header_acquire(MMAL_BUFFER_HEADER_T *header){}
  void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool){}
 
 /** Create an instance of a component.
@@ -20,7 +28,7 @@ void mmal_buffer_header_mem_unlock(MMAL_BUFFER_HEADER_T *header){}
  * @return MMAL_SUCCESS on success
  */
 MMAL_STATUS_T mmal_component_create(const char *name,
-                                    MMAL_COMPONENT_T **component){}
+                                    MMAL_COMPONENT_T **component){ return MMAL_ENOSYS; }
 
 /** Acquire a reference on a component.
  * Acquiring a reference on a component will prevent a component from being destroyed until
@@ -41,7 +49,7 @@ void mmal_component_acquire(MMAL_COMPONENT_T *component){}
  * @param component component to release
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_component_release(MMAL_COMPONENT_T *component){}
+MMAL_STATUS_T mmal_component_release(MMAL_COMPONENT_T *component){ return MMAL_ENOSYS; }
 
 /** Destroy a previously created component
  * Release an acquired reference on a component. Only actually destroys the component when
@@ -50,19 +58,19 @@ MMAL_STATUS_T mmal_component_release(MMAL_COMPONENT_T *component){}
  * @param component component to destroy
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T *component){}
+MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T *component){ return MMAL_ENOSYS; }
 
 /** Enable processing on a component
  * @param component component to enable
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component){}
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component){ return MMAL_ENOSYS; }
 
 /** Disable processing on a component
  * @param component component to disable
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component){}
+MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component){ return MMAL_ENOSYS; }
 
 
 
@@ -72,7 +80,7 @@ MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component){}
  * @param port The port for which format changes are to be committed.
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port){}
+MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port){ return MMAL_ENOSYS; }
 
 
 /** Enable processing on a port
@@ -93,7 +101,7 @@ MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port){}
  * @param cb callback use by the port to send a \ref MMAL_BUFFER_HEADER_T back
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb){}
+MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb){ return MMAL_ENOSYS; }
 
 /** Disable processing on a port
  *
@@ -106,7 +114,7 @@ MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb){}
  * @param port port to disable
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *port){}
+MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *port){ return MMAL_ENOSYS; }
 
 /** Ask a port to release all the buffer headers it currently has.
  *
@@ -123,7 +131,7 @@ MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *port){}
  * @param port The port to flush.
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *port){}
+MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *port){ return MMAL_ENOSYS; }
 
 /** Set a parameter on a port.
  *
@@ -132,7 +140,7 @@ MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *port){}
  * @return MMAL_SUCCESS on success
  */
 MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port,
-   const MMAL_PARAMETER_HEADER_T *param){}
+   const MMAL_PARAMETER_HEADER_T *param){ return MMAL_ENOSYS; }
 
 /** Get a parameter from a port.
  * The size field must be set on input to the maximum size of the parameter
@@ -149,7 +157,7 @@ MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port,
  * @return MMAL_SUCCESS on success
  */
 MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port,
-   MMAL_PARAMETER_HEADER_T *param){}
+   MMAL_PARAMETER_HEADER_T *param){ return MMAL_ENOSYS; }
 
 /** Send a buffer header to a port.
  *
@@ -158,7 +166,7 @@ MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port,
  * @return MMAL_SUCCESS on success
  */
 MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
-   MMAL_BUFFER_HEADER_T *buffer){}
+   MMAL_BUFFER_HEADER_T *buffer){ return MMAL_ENOSYS; }
 
 /** Connect an output port to an input port.
  *
@@ -175,7 +183,7 @@ MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
  * @param other_port The other port to connect.
  * @return MMAL_SUCCESS on success.
  */
-MMAL_STATUS_T mmal_port_connect(MMAL_PORT_T *port, MMAL_PORT_T *other_port){}
+MMAL_STATUS_T mmal_port_connect(MMAL_PORT_T *port, MMAL_PORT_T *other_port){ return MMAL_ENOSYS; }
 
 /** Disconnect a connected port.
  *
@@ -186,7 +194,7 @@ MMAL_STATUS_T mmal_port_connect(MMAL_PORT_T *port, MMAL_PORT_T *other_port){}
  * @param port The ports to disconnect.
  * @return MMAL_SUCCESS on success.
  */
-MMAL_STATUS_T mmal_port_disconnect(MMAL_PORT_T *port){}
+MMAL_STATUS_T mmal_port_disconnect(MMAL_PORT_T *port){ return MMAL_ENOSYS; }
 
 /** Allocate a payload buffer.
  * This allows a client to allocate memory for a payload buffer based on the preferences
@@ -200,7 +208,7 @@ MMAL_STATUS_T mmal_port_disconnect(MMAL_PORT_T *port){}
  *
  * @return Pointer to the allocated memory.
  */
-uint8_t *mmal_port_payload_alloc(MMAL_PORT_T *port, uint32_t payload_size){}
+uint8_t *mmal_port_payload_alloc(MMAL_PORT_T *port, uint32_t payload_size){ return NULL; }
 
 /** Free a payload buffer.
  * This allows a client to free memory allocated by a previous call to \ref mmal_port_payload_alloc.
@@ -219,7 +227,7 @@ void mmal_port_payload_free(MMAL_PORT_T *port, uint8_t *payload){}
  * @param event The specific event FourCC required. See the \ref MmalEvents "pre-defined events".
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_port_event_get(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T **buffer, uint32_t event){}
+MMAL_STATUS_T mmal_port_event_get(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T **buffer, uint32_t event){ return MMAL_ENOSYS; }
 /** Shallow copy a format structure.
  * It is worth noting that the extradata buffer will not be copied in the new format.
  *
@@ -246,7 +254,7 @@ void mmal_format_copy(MMAL_ES_FORMAT_T *format_dest, MMAL_ES_FORMAT_T *format_sr
  * @return MMAL_SUCCESS on success.
  */
 MMAL_STATUS_T mmal_connection_create(MMAL_CONNECTION_T **connection,
-   MMAL_PORT_T *out, MMAL_PORT_T *in, uint32_t flags){}
+   MMAL_PORT_T *out, MMAL_PORT_T *in, uint32_t flags){ return MMAL_ENOSYS; }
 
 /** Acquire a reference on a connection.
  * Acquiring a reference on a connection will prevent a connection from being destroyed until
@@ -267,7 +275,7 @@ void mmal_connection_acquire(MMAL_CONNECTION_T *connection){}
  * @param connection connection to release
  * @return MMAL_SUCCESS on success
  */
-MMAL_STATUS_T mmal_connection_release(MMAL_CONNECTION_T *connection){}
+MMAL_STATUS_T mmal_connection_release(MMAL_CONNECTION_T *connection){ return MMAL_ENOSYS; }
 
 /** Destroy a connection.
  * Release an acquired reference on a connection. Only actually destroys the connection when
@@ -278,7 +286,7 @@ MMAL_STATUS_T mmal_connection_release(MMAL_CONNECTION_T *connection){}
  * @param connection The connection to be destroyed.
  * @return MMAL_SUCCESS on success.
  */
-MMAL_STATUS_T mmal_connection_destroy(MMAL_CONNECTION_T *connection){}
+MMAL_STATUS_T mmal_connection_destroy(MMAL_CONNECTION_T *connection){ return MMAL_ENOSYS; }
 
 /** Enable a connection.
  * The format of the two ports must have been committed before calling this function,
@@ -292,14 +300,14 @@ MMAL_STATUS_T mmal_connection_destroy(MMAL_CONNECTION_T *connection){}
  * @param connection The connection to be enabled.
  * @return MMAL_SUCCESS on success.
  */
-MMAL_STATUS_T mmal_connection_enable(MMAL_CONNECTION_T *connection){}
+MMAL_STATUS_T mmal_connection_enable(MMAL_CONNECTION_T *connection){ return MMAL_ENOSYS; }
 
 /** Disable a connection.
  *
  * @param connection The connection to be disabled.
  * @return MMAL_SUCCESS on success.
  */
-MMAL_STATUS_T mmal_connection_disable(MMAL_CONNECTION_T *connection){}
+MMAL_STATUS_T mmal_connection_disable(MMAL_CONNECTION_T *connection){ return MMAL_ENOSYS; }
 
 /** Apply a format changed event to the connection.
  * This function can be used when the client is processing buffer headers and receives
@@ -312,7 +320,7 @@ MMAL_STATUS_T mmal_connection_disable(MMAL_CONNECTION_T *connection){}
  * @return MMAL_SUCCESS on success.
  */
 MMAL_STATUS_T mmal_connection_event_format_changed(MMAL_CONNECTION_T *connection,
-   MMAL_BUFFER_HEADER_T *buffer){}
+   MMAL_BUFFER_HEADER_T *buffer){ return MMAL_ENOSYS; }
 
 
 /** Helper function to set the value of a rational parameter.
@@ -322,7 +330,7 @@ MMAL_STATUS_T mmal_connection_event_format_changed(MMAL_CONNECTION_T *connection
  *
  * @return MMAL_SUCCESS or error
  */
-MMAL_STATUS_T mmal_port_parameter_set_rational(MMAL_PORT_T *port, uint32_t id, MMAL_RATIONAL_T value){}
+MMAL_STATUS_T mmal_port_parameter_set_rational(MMAL_PORT_T *port, uint32_t id, MMAL_RATIONAL_T value){ return MMAL_ENOSYS; }
 
 /** Helper function to set the value of a 32 bits signed integer parameter.
  * @param port   port on which to set the parameter
@@ -331,7 +339,7 @@ MMAL_STATUS_T mmal_port_parameter_set_rational(MMAL_PORT_T *port, uint32_t id, M
  *
  * @return MMAL_SUCCESS or error
  */
-MMAL_STATUS_T mmal_port_parameter_set_int32(MMAL_PORT_T *port, uint32_t id, int32_t value){}
+MMAL_STATUS_T mmal_port_parameter_set_int32(MMAL_PORT_T *port, uint32_t id, int32_t value){ return MMAL_ENOSYS; }
 
 
 /** Helper function to set the value of a 32 bits unsigned integer parameter.
@@ -341,7 +349,16 @@ MMAL_STATUS_T mmal_port_parameter_set_int32(MMAL_PORT_T *port, uint32_t id, int3
  *
  * @return MMAL_SUCCESS or error
  */
-MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value){}
+MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value){ return MMAL_ENOSYS; }
+
+/** Helper function to get the value of a 64 bits unsigned integer parameter.
+ * @param port   port on which to get the parameter
+ * @param id     parameter id
+ * @param value  pointer to where the value will be returned
+ *
+ * @return MMAL_SUCCESS or error
+ */
+MMAL_STATUS_T mmal_port_parameter_get_uint64(MMAL_PORT_T *port, uint32_t id, uint64_t *value){ return MMAL_ENOSYS; }
 
 
 /** Helper function to set the value of a boolean parameter.
@@ -351,7 +368,7 @@ MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uin
  *
  * @return MMAL_SUCCESS or error
  */
-MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value){}
+MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value){ return MMAL_ENOSYS; }
 
 
 
@@ -372,7 +389,7 @@ MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MM
  * @return Pointer to the newly created pool or NULL on failure.
  */
 MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port,
-   unsigned int headers, uint32_t payload_size){}
+   unsigned int headers, uint32_t payload_size){ return NULL; }
 
 /** Release a buffer header.
  * Releasing a buffer header will decrease its reference counter and when no more references
@@ -392,4 +409,4 @@ void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T *header){}
  *
  * @return length (in elements) of the queue.
  */
-unsigned int mmal_queue_length(MMAL_QUEUE_T *queue){}
+unsigned int mmal_queue_length(MMAL_QUEUE_T *queue){ return 0; }
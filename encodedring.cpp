@@ -0,0 +1,131 @@
+#include "encodedring.h"
+#include "mmal/mmal.h"
+
+#include <string.h>
+
+
+EncodedRing::EncodedRing():
+    m_duration(0),
+    m_first(0),
+    m_write(0),
+    m_frame_start(true),
+    m_last_pts(MMAL_TIME_UNKNOWN)
+{
+}
+
+/**
+ * @brief EncodedRing::reset
+ * Allocate the ring, a capacity of 0 disables it.
+ * @param capacity : bytes of encoded data kept
+ * @param duration : time kept, the ring keeps the GOP that started before it
+ */
+void EncodedRing::reset(size_t capacity, std::chrono::microseconds duration)
+{
+    m_data.assign(capacity, 0);
+    m_data.shrink_to_fit();
+    m_duration = duration;
+    clear();
+}
+
+void EncodedRing::clear()
+{
+    m_first += m_entries.size();
+    m_entries.clear();
+    m_keyframes.clear();
+    m_write = 0;
+    m_frame_start = true;
+    m_last_pts = MMAL_TIME_UNKNOWN;
+}
+
+/**
+ * @brief EncodedRing::push
+ * Copy an encoder buffer in the ring, dropping the oldest ones to make room.
+ * @param data : encoded data
+ * @param size : size of data
+ * @param flags : MMAL buffer flags
+ * @param pts : MMAL pts in microseconds, or MMAL_TIME_UNKNOWN
+ */
+void EncodedRing::push(const unsigned char *data, size_t size, uint32_t flags, int64_t pts)
+{
+    if ( m_data.empty() ) return;
+    bool frame_start = m_frame_start;
+    m_frame_start = ( flags & ( MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG ) ) != 0;
+    if ( size > m_data.size() ) {
+        // a buffer bigger than the ring breaks the stream
+        clear();
+        return;
+    }
+
+    // each buffer is contiguous, the end of the ring is skipped when too small
+    if ( m_write + size > m_data.size() ) m_write = 0;
+    while ( !m_entries.empty() ) {
+        const ENCODED_ENTRY &oldest = m_entries.front();
+        if ( oldest.start >= m_write + size || oldest.start + oldest.size <= m_write ) break;
+        popFront();
+    }
+
+    ENCODED_ENTRY added;
+    added.start = m_write;
+    added.size = size;
+    added.flags = flags;
+    added.pts = pts;
+    memcpy(m_data.data() + m_write, data, size);
+    m_write += size;
+    if ( frame_start && ( flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) && !( flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ) )
+        m_keyframes.push_back(end());
+    m_entries.push_back(added);
+    if ( pts != MMAL_TIME_UNKNOWN ) m_last_pts = pts;
+
+    // drop the GOPs older than the duration, keeping the one the duration starts in
+    while ( m_keyframes.size() >= 2 && m_last_pts != MMAL_TIME_UNKNOWN &&
+            entry(m_keyframes[1]).pts != MMAL_TIME_UNKNOWN &&
+            m_last_pts - entry(m_keyframes[1]).pts >= m_duration.count() ) {
+        uint64_t keep = m_keyframes[1];
+        while ( m_first < keep ) popFront();
+    }
+}
+
+/**
+ * @brief EncodedRing::findKeyframe
+ * @param pre : time before the last buffer
+ * @return index of the last IDR frame at least 'pre' before the last buffer, the oldest IDR frame if none
+ * is that old, end() when the ring has no IDR frame
+ */
+uint64_t EncodedRing::findKeyframe(std::chrono::microseconds pre) const
+{
+    if ( m_keyframes.empty() ) return end();
+    uint64_t found = m_keyframes.front();
+    if ( m_last_pts == MMAL_TIME_UNKNOWN ) return found;
+    for ( uint64_t index : m_keyframes ) {
+        int64_t pts = entry(index).pts;
+        if ( pts != MMAL_TIME_UNKNOWN && m_last_pts - pts < pre.count() ) break;
+        found = index;
+    }
+    return found;
+}
+
+size_t EncodedRing::getUsedBytes() const
+{
+    size_t used = 0;
+    for ( const ENCODED_ENTRY &e : m_entries ) used += e.size;
+    return used;
+}
+
+/**
+ * @brief EncodedRing::getDuration
+ * @return time between the oldest IDR frame and the last buffer
+ */
+std::chrono::microseconds EncodedRing::getDuration() const
+{
+    if ( m_keyframes.empty() || m_last_pts == MMAL_TIME_UNKNOWN ) return std::chrono::microseconds(0);
+    int64_t pts = entry(m_keyframes.front()).pts;
+    if ( pts == MMAL_TIME_UNKNOWN ) return std::chrono::microseconds(0);
+    return std::chrono::microseconds(m_last_pts - pts);
+}
+
+void EncodedRing::popFront()
+{
+    if ( !m_keyframes.empty() && m_keyframes.front() == m_first ) m_keyframes.pop_front();
+    m_entries.pop_front();
+    m_first++;
+}
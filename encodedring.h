@@ -0,0 +1,61 @@
+#ifndef ENCODEDRING_H
+#define ENCODEDRING_H
+
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/** A buffer of the encoder kept in an EncodedRing
+*/
+struct ENCODED_ENTRY
+{
+    size_t start;        /// Offset of the data in the ring
+    uint32_t size;
+    uint32_t flags;      /// MMAL buffer flags
+    int64_t pts;         /// MMAL pts in microseconds, or MMAL_TIME_UNKNOWN
+};
+
+/**
+ * @brief The EncodedRing class
+ * Memory ring of the last encoder buffers, for the pre-event recording. The data is kept in one
+ * allocation, each buffer contiguous, and the IDR frames are indexed so a record can start on
+ * the oldest one. The oldest buffers are dropped when the ring is full or when they are older
+ * than the duration of the ring (a whole GOP is kept before the duration).
+ * Not thread safe.
+ */
+class EncodedRing
+{
+public:
+    EncodedRing();
+
+    void reset(size_t capacity, std::chrono::microseconds duration);
+    void clear();
+    bool isEnabled() const { return !m_data.empty(); }
+    void push(const unsigned char *data, size_t size, uint32_t flags, int64_t pts);
+
+    uint64_t findKeyframe(std::chrono::microseconds pre) const;
+    uint64_t begin() const { return m_first; }
+    uint64_t end() const { return m_first + m_entries.size(); }
+    const ENCODED_ENTRY &entry(uint64_t index) const { return m_entries[index - m_first]; }
+    const unsigned char *data(uint64_t index) const { return m_data.data() + entry(index).start; }
+
+    size_t getCapacity() const { return m_data.size(); }
+    size_t getUsedBytes() const;
+    std::chrono::microseconds getDuration() const;
+
+private:
+    void popFront();
+
+    std::vector<unsigned char> m_data;
+    std::chrono::microseconds m_duration;
+    std::deque<ENCODED_ENTRY> m_entries;
+    uint64_t m_first;                  /// Index of the oldest entry
+    std::deque<uint64_t> m_keyframes;  /// Indexes of the entries starting an IDR frame
+    size_t m_write;                    /// Offset of the next data
+    bool m_frame_start;
+    int64_t m_last_pts;
+};
+
+#endif // ENCODEDRING_H
@@ -0,0 +1,256 @@
+#include "encodedsink.h"
+#include "mmal/mmal.h"
+
+#include <iostream>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+
+FileSink::FileSink(const std::string &filename, RECORD_FILE_MODE_T mode):
+    m_filename(filename),
+    m_mode(mode)
+{
+}
+
+bool FileSink::open()
+{
+    return m_file.open(m_filename, m_mode);
+}
+
+void FileSink::write(const ENCODED_CHUNK &chunk)
+{
+    if ( m_file.isOpen() ) m_file.write(chunk.data, chunk.size);
+}
+
+void FileSink::close()
+{
+    if ( m_file.isOpen() && !m_file.close() )
+        std::cerr << "The file " << m_filename << " is incomplete" << std::endl;
+}
+
+/**
+ * @brief MemoryRingSink::MemoryRingSink
+ * @param capacity : bytes of encoded data kept
+ * @param duration : time kept, see EncodedRing::reset
+ */
+MemoryRingSink::MemoryRingSink(size_t capacity, std::chrono::microseconds duration):
+    m_capacity(capacity),
+    m_duration(duration)
+{
+}
+
+bool MemoryRingSink::open()
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    if ( m_ring.getCapacity() != m_capacity ) m_ring.reset(m_capacity, m_duration);
+    else m_ring.clear();
+    m_config.clear();
+    return m_ring.isEnabled();
+}
+
+void MemoryRingSink::write(const ENCODED_CHUNK &chunk)
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    if ( chunk.flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ) m_config.assign(chunk.data, chunk.data + chunk.size);
+    else m_ring.push(chunk.data, chunk.size, chunk.flags, chunk.pts);
+}
+
+/**
+ * @brief MemoryRingSink::copyLatest
+ * Copy the stream from the last IDR frame at least 'pre' old, after the SPS/PPS.
+ * @param data : replaced by the stream
+ * @param pre : time before the last chunk
+ * @return number of chunks copied, 0 when the ring has no IDR frame yet
+ */
+size_t MemoryRingSink::copyLatest(std::vector<unsigned char> &data, std::chrono::microseconds pre)
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    data.clear();
+    uint64_t first = m_ring.findKeyframe(pre);
+    if ( first == m_ring.end() ) return 0;
+
+    size_t size = m_config.size();
+    for ( uint64_t i = first; i < m_ring.end(); i++ ) size += m_ring.entry(i).size;
+    data.reserve(size);
+    data.insert(data.end(), m_config.begin(), m_config.end());
+    for ( uint64_t i = first; i < m_ring.end(); i++ )
+        data.insert(data.end(), m_ring.data(i), m_ring.data(i) + m_ring.entry(i).size);
+    return m_ring.end() - first;
+}
+
+size_t MemoryRingSink::getUsedBytes()
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    return m_ring.getUsedBytes();
+}
+
+/**
+ * @brief SocketSink::SocketSink
+ * @param protocol : SOCKET_SINK_TCP or SOCKET_SINK_UDP
+ * @param host : name or address of the receiver
+ * @param port : port of the receiver
+ */
+SocketSink::SocketSink(SOCKET_SINK_PROTOCOL_T protocol, const std::string &host, unsigned short port):
+    m_protocol(protocol),
+    m_host(host),
+    m_port(port),
+    m_fd(-1),
+    m_connecting(false),
+    m_frame_start(true),
+    m_wait_keyframe(false),
+    m_bytes_sent(0),
+    m_chunks_dropped(0)
+{
+}
+
+SocketSink::~SocketSink()
+{
+    closeSocket();
+}
+
+/**
+ * @brief SocketSink::open
+ * Connect the socket, waiting at most SOCKET_SINK_CONNECT_TIMEOUT_MS for the TCP server.
+ * @return false if the socket can't be created or the TCP server doesn't accept the connection
+ */
+bool SocketSink::open()
+{
+    m_frame_start = true;
+    m_wait_keyframe = false;
+    m_config.clear();
+    if ( !connectSocket() ) return false;
+    if ( waitConnected(SOCKET_SINK_CONNECT_TIMEOUT_MS) ) return true;
+    std::cerr << "Unable to connect to " << m_host << ":" << m_port << std::endl;
+    closeSocket();
+    return false;
+}
+
+/**
+ * @brief SocketSink::write
+ * Send a chunk without blocking. After a full TCP socket the chunks are dropped until the next
+ * IDR frame, after a TCP error the connection is retried on each IDR frame.
+ */
+void SocketSink::write(const ENCODED_CHUNK &chunk)
+{
+    bool frame_start = m_frame_start;
+    m_frame_start = ( chunk.flags & ( MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG ) ) != 0;
+    if ( chunk.flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ) m_config.assign(chunk.data, chunk.data + chunk.size);
+
+    if ( m_wait_keyframe ) {
+        bool idr = frame_start && ( chunk.flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) && !( chunk.flags & MMAL_BUFFER_HEADER_FLAG_CONFIG );
+        if ( !idr || ( m_fd < 0 && !connectSocket() ) || !waitConnected(0) ) {
+            m_chunks_dropped++;
+            return;
+        }
+        m_wait_keyframe = false;
+        if ( !m_config.empty() && !send(m_config.data(), m_config.size()) ) return;
+    }
+    if ( m_fd >= 0 ) send(chunk.data, chunk.size);
+    else m_chunks_dropped++;
+}
+
+void SocketSink::close()
+{
+    closeSocket();
+}
+
+bool SocketSink::connectSocket()
+{
+    closeSocket();
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = m_protocol == SOCKET_SINK_TCP ? SOCK_STREAM : SOCK_DGRAM;
+    struct addrinfo *addresses = NULL;
+    std::string service = std::to_string(m_port);
+    int error = getaddrinfo(m_host.c_str(), service.c_str(), &hints, &addresses);
+    if ( error ) {
+        std::cerr << "Unable to resolve " << m_host << ": " << gai_strerror(error) << std::endl;
+        return false;
+    }
+
+    for ( struct addrinfo *address = addresses; address && m_fd < 0; address = address->ai_next ) {
+        m_fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if ( m_fd < 0 ) continue;
+        // a connected UDP socket only fixes the destination, a TCP one completes in waitConnected
+        if ( ::connect(m_fd, address->ai_addr, address->ai_addrlen) == 0 ) m_connecting = false;
+        else if ( errno == EINPROGRESS ) m_connecting = true;
+        else closeSocket();
+    }
+    freeaddrinfo(addresses);
+    if ( m_fd < 0 ) {
+        std::cerr << "Unable to connect to " << m_host << ":" << m_port << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief SocketSink::waitConnected
+ * @param timeout_ms : longest wait for a TCP connection in progress, 0 to only check it
+ * @return true when the socket is connected, the socket is closed if the connection failed
+ */
+bool SocketSink::waitConnected(int timeout_ms)
+{
+    if ( m_fd < 0 ) return false;
+    if ( !m_connecting ) return true;
+    struct pollfd fd = { m_fd, POLLOUT, 0 };
+    int ready;
+    do ready = poll(&fd, 1, timeout_ms);
+    while ( ready < 0 && errno == EINTR );
+    if ( ready == 0 ) return false;
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if ( ready < 0 || getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error ) {
+        if ( timeout_ms == 0 ) std::cerr << "Unable to connect to " << m_host << ":" << m_port << ": " << strerror(error) << std::endl;
+        closeSocket();
+        return false;
+    }
+    m_connecting = false;
+    return true;
+}
+
+void SocketSink::closeSocket()
+{
+    if ( m_fd >= 0 ) ::close(m_fd);
+    m_fd = -1;
+    m_connecting = false;
+}
+
+bool SocketSink::send(const unsigned char *data, size_t size)
+{
+    while ( size ) {
+        size_t length = size;
+        if ( m_protocol == SOCKET_SINK_UDP && length > SOCKET_SINK_DATAGRAM_SIZE ) length = SOCKET_SINK_DATAGRAM_SIZE;
+        ssize_t sent = ::send(m_fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if ( sent < 0 && errno == EINTR ) continue;
+        if ( sent < 0 && m_protocol == SOCKET_SINK_UDP ) {
+            // nobody listening yet (ECONNREFUSED) or a full socket buffer: the datagram is lost
+            sent = length;
+        }
+        else if ( sent < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            // the receiver is late, the rest of the frame is useless to it: resume on an IDR frame
+            std::cerr << "Socket to " << m_host << ":" << m_port << " full, data dropped until the next IDR frame" << std::endl;
+            m_wait_keyframe = true;
+            m_chunks_dropped++;
+            return false;
+        }
+        else if ( sent <= 0 ) {
+            std::cerr << "Connection to " << m_host << ":" << m_port << " lost: " << strerror(errno) << std::endl;
+            closeSocket();
+            m_wait_keyframe = true;
+            m_chunks_dropped++;
+            return false;
+        }
+        else m_bytes_sent += sent;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
@@ -0,0 +1,157 @@
+#ifndef ENCODEDSINK_H
+#define ENCODEDSINK_H
+
+#include "recordfile.h"
+#include "encodedring.h"
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SOCKET_SINK_DATAGRAM_SIZE 1400    /// Largest UDP payload sent by a SocketSink, fits an Ethernet MTU
+#define SOCKET_SINK_CONNECT_TIMEOUT_MS 1000   /// Wait of SocketSink::open for the TCP connection
+
+/** Encoded data given to a sink. The data belongs to the encoder buffer and is only valid
+ * during EncodedSink::write.
+*/
+struct ENCODED_CHUNK
+{
+    const unsigned char *data;
+    size_t size;
+    uint32_t flags;      /// MMAL buffer flags
+    int64_t pts;         /// MMAL pts in microseconds, or MMAL_TIME_UNKNOWN
+};
+
+typedef std::function<void(const ENCODED_CHUNK &)> ENCODED_CALLBACK_T;
+
+/**
+ * @brief The EncodedSink class
+ * Receiver of the encoder output (H.264 NAL units or JPEG data), called with each encoder buffer
+ * without copy. A video record calls it from its writer thread, a still record from the MMAL
+ * callback: write() must not keep the data and should not block for long.
+ * The sink must live until the record using it is stopped.
+ */
+class EncodedSink
+{
+public:
+    virtual ~EncodedSink() {}
+
+    virtual bool open() { return true; }
+    virtual void write(const ENCODED_CHUNK &chunk) = 0;
+    virtual void close() {}
+};
+
+/**
+ * @brief The FileSink class
+ * Appends the encoded data to a RecordFile.
+ */
+class FileSink : public EncodedSink
+{
+public:
+    FileSink(const std::string &filename, RECORD_FILE_MODE_T mode = RECORD_FILE_IO_URING);
+
+    bool open();
+    void write(const ENCODED_CHUNK &chunk);
+    void close();
+
+private:
+    std::string m_filename;
+    RECORD_FILE_MODE_T m_mode;
+    RecordFile m_file;
+};
+
+/**
+ * @brief The MemoryRingSink class
+ * Keeps the last encoded data in an EncodedRing, read by other threads with copyLatest().
+ */
+class MemoryRingSink : public EncodedSink
+{
+public:
+    MemoryRingSink(size_t capacity, std::chrono::microseconds duration);
+
+    bool open();
+    void write(const ENCODED_CHUNK &chunk);
+
+    size_t copyLatest(std::vector<unsigned char> &data, std::chrono::microseconds pre);
+    size_t getUsedBytes();
+
+private:
+    size_t m_capacity;
+    std::chrono::microseconds m_duration;
+    std::mutex m_mutex;
+    EncodedRing m_ring;
+    std::vector<unsigned char> m_config;   /// Last SPS/PPS, prepended to the copies
+};
+
+/**
+ * @brief The CallbackSink class
+ * Calls a user function with each chunk.
+ */
+class CallbackSink : public EncodedSink
+{
+public:
+    CallbackSink(ENCODED_CALLBACK_T callback) : m_callback(callback) {}
+
+    void write(const ENCODED_CHUNK &chunk) { if ( m_callback ) m_callback(chunk); }
+
+private:
+    ENCODED_CALLBACK_T m_callback;
+};
+
+/** Transport of a SocketSink
+*/
+enum SOCKET_SINK_PROTOCOL_T
+{
+    SOCKET_SINK_TCP,   /// Stream to a listening TCP server, resumed on an IDR frame after a full socket or an error
+    SOCKET_SINK_UDP    /// Datagrams of at most SOCKET_SINK_DATAGRAM_SIZE bytes, a chunk is split
+};
+
+/**
+ * @brief The SocketSink class
+ * Sends the raw encoded stream to a local or LAN socket, for instance a player or a second
+ * process listening on a port. The stream restarts on an IDR frame, after the SPS/PPS, when
+ * the TCP connection is (re)established.
+ * The socket never blocks the writer thread: when the receiver doesn't keep up, the data is
+ * dropped until the next IDR frame, and a reconnection is only started on an IDR frame and used
+ * on a later one once established.
+ */
+class SocketSink : public EncodedSink
+{
+public:
+    SocketSink(SOCKET_SINK_PROTOCOL_T protocol, const std::string &host, unsigned short port);
+    ~SocketSink();
+
+    SocketSink(const SocketSink&) = delete;
+    SocketSink& operator=(const SocketSink&) = delete;
+
+    bool open();
+    void write(const ENCODED_CHUNK &chunk);
+    void close();
+
+    bool isConnected() const { return m_fd >= 0 && !m_wait_keyframe; }
+    uint64_t getBytesSent() const { return m_bytes_sent; }
+    uint64_t getChunksDropped() const { return m_chunks_dropped; }
+
+private:
+    bool connectSocket();
+    bool waitConnected(int timeout_ms);
+    void closeSocket();
+    bool send(const unsigned char *data, size_t size);
+
+    SOCKET_SINK_PROTOCOL_T m_protocol;
+    std::string m_host;
+    unsigned short m_port;
+    int m_fd;
+    bool m_connecting;                     /// Non blocking TCP connection in progress
+    bool m_frame_start;
+    bool m_wait_keyframe;                  /// Data is dropped until an IDR frame after a (re)connection
+    std::vector<unsigned char> m_config;   /// Last SPS/PPS, sent before the first IDR frame
+    uint64_t m_bytes_sent;
+    uint64_t m_chunks_dropped;
+};
+
+#endif // ENCODEDSINK_H
@@ -0,0 +1,347 @@
+#include "framelease.h"
+#include "videommalobject.h"
+
+#include <cstring>
+
+/**
+ * @brief computeFrameLayout
+ * Compute the position of the planes of a frame from the committed format of a port.
+ * The VideoCore aligns the width on 32 pixels and the height on 16 lines.
+ * @param format : committed format of the port that produces the frames
+ * @return the layout of a frame in the port buffers
+ */
+FRAME_LAYOUT computeFrameLayout(MMAL_ES_FORMAT_T *format)
+{
+    FRAME_LAYOUT layout;
+    memset(&layout, 0, sizeof(layout));
+    if (!format) return layout;
+
+    unsigned int aligned_width = VCOS_ALIGN_UP(format->es->video.width, 32);
+    unsigned int aligned_height = VCOS_ALIGN_UP(format->es->video.height, 16);
+
+    layout.format = format->encoding;
+    layout.width = format->es->video.crop.width;
+    layout.height = format->es->video.crop.height;
+
+    if (layout.format == MMAL_ENCODING_I420) {
+        layout.planes = 3;
+        layout.pitch[0] = aligned_width;
+        layout.pitch[1] = layout.pitch[2] = aligned_width/2;
+        layout.offset[0] = 0;
+        layout.offset[1] = aligned_width*aligned_height;
+        layout.offset[2] = layout.offset[1] + layout.pitch[1]*(aligned_height/2);
+        layout.row_bytes[0] = layout.width;
+        layout.row_bytes[1] = layout.row_bytes[2] = (layout.width+1)/2;
+        layout.rows[0] = layout.height;
+        layout.rows[1] = layout.rows[2] = (layout.height+1)/2;
+    }
+    else {
+        unsigned int bpp = 3;
+        if (layout.format == MMAL_ENCODING_RGBA || layout.format == MMAL_ENCODING_BGRA) bpp = 4;
+        layout.planes = 1;
+        layout.pitch[0] = aligned_width*bpp;
+        layout.row_bytes[0] = layout.width*bpp;
+        layout.rows[0] = layout.height;
+    }
+    return layout;
+}
+
+/**
+ * @brief packedFrameLayout
+ * Layout of a packed frame without line padding, as written by the color converter.
+ * @param format : RGB24, BGR24, RGBA, BGRA or GREY
+ * @param width : width in pixels
+ * @param height : height in pixels
+ * @return the layout of the frame
+ */
+FRAME_LAYOUT packedFrameLayout(int format, unsigned int width, unsigned int height)
+{
+    FRAME_LAYOUT layout;
+    memset(&layout, 0, sizeof(layout));
+
+    unsigned int bpp = 3;
+    if (format == MMAL_ENCODING_RGBA || format == MMAL_ENCODING_BGRA) bpp = 4;
+    else if (format == MMAL_ENCODING_GREY) bpp = 1;
+    layout.format = format;
+    layout.width = width;
+    layout.height = height;
+    layout.planes = 1;
+    layout.pitch[0] = layout.row_bytes[0] = width*bpp;
+    layout.rows[0] = height;
+    return layout;
+}
+
+/**
+ * @brief lumaFrameLayout
+ * Layout of the Y plane of an I420 frame, seen as a GREY frame. The plane stays in place
+ * in the buffer, the chroma planes are ignored.
+ * @param layout : layout of the I420 frame
+ * @return the layout of the GREY frame
+ */
+FRAME_LAYOUT lumaFrameLayout(const FRAME_LAYOUT &layout)
+{
+    FRAME_LAYOUT luma = layout;
+    if (layout.format != MMAL_ENCODING_I420) return luma;
+    luma.format = MMAL_ENCODING_GREY;
+    luma.planes = 1;
+    for (unsigned int p = 1; p < FRAME_MAX_PLANES; p++)
+        luma.offset[p] = luma.pitch[p] = luma.row_bytes[p] = luma.rows[p] = 0;
+    return luma;
+}
+
+/**
+ * @brief applyBufferLayout
+ * Use the plane offsets and pitches reported by the VideoCore in the buffer header when
+ * they are consistent with the format, they are more accurate than the computed ones.
+ * @param layout : layout computed from the port format, updated in place
+ * @param buffer : buffer holding a frame
+ */
+void applyBufferLayout(FRAME_LAYOUT &layout, MMAL_BUFFER_HEADER_T *buffer)
+{
+    if (!buffer || !buffer->type) return;
+    MMAL_BUFFER_HEADER_VIDEO_SPECIFIC_T &video = buffer->type->video;
+    // a GREY layout is the first plane of an I420 buffer
+    unsigned int buffer_planes = layout.format == MMAL_ENCODING_GREY ? 3 : layout.planes;
+    if (video.planes != buffer_planes) return;
+    for (unsigned int p = 0; p < layout.planes; p++)
+        if (video.pitch[p] < layout.row_bytes[p]) return;
+    for (unsigned int p = 0; p < layout.planes; p++) {
+        layout.offset[p] = video.offset[p];
+        layout.pitch[p] = video.pitch[p];
+    }
+}
+
+/**
+ * @brief copyFrame
+ * Copy the visible part of a frame into a destination with its own line stride.
+ * A plane is copied with a single memcpy when source and destination strides match.
+ * @param src : start of the frame
+ * @param layout : layout of the frame
+ * @param dst : destination
+ * @param dst_stride : line stride of the first plane of the destination in bytes, the chroma
+ * planes of I420 use half of it. 0 means no padding.
+ */
+void copyFrame(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst, unsigned int dst_stride)
+{
+    for (unsigned int p = 0; p < layout.planes; p++) {
+        unsigned int stride = layout.row_bytes[p];
+        if (dst_stride) stride = p ? dst_stride/2 : dst_stride;
+        if (!layout.rows[p]) continue;
+
+        const unsigned char *line = src + layout.offset[p];
+        if (stride == layout.pitch[p]) {
+            memcpy(dst, line, (size_t) layout.pitch[p]*(layout.rows[p]-1) + layout.row_bytes[p]);
+        }
+        else {
+            unsigned char *out = dst;
+            for (unsigned int i = 0; i < layout.rows[p]; i++) {
+                memcpy(out, line, layout.row_bytes[p]);
+                out += stride;
+                line += layout.pitch[p];
+            }
+        }
+        dst += (size_t) stride*layout.rows[p];
+    }
+}
+
+/**
+ * @brief packedFrameSize
+ * @param layout : layout of the frame
+ * @return the size of the frame without line padding
+ */
+size_t packedFrameSize(const FRAME_LAYOUT &layout)
+{
+    size_t size = 0;
+    for (unsigned int p = 0; p < layout.planes; p++)
+        size += (size_t) layout.row_bytes[p]*layout.rows[p];
+    return size;
+}
+
+/**
+ * @brief frameExtent
+ * @param layout : layout of the frame
+ * @return the number of bytes from the start of the buffer to the end of the last plane
+ */
+size_t frameExtent(const FRAME_LAYOUT &layout)
+{
+    size_t extent = 0;
+    for (unsigned int p = 0; p < layout.planes; p++) {
+        if (!layout.rows[p]) continue;
+        size_t end = layout.offset[p] + (size_t) layout.pitch[p]*(layout.rows[p]-1) + layout.row_bytes[p];
+        if (end > extent) extent = end;
+    }
+    return extent;
+}
+
+/**
+ * @brief copyFramePacked
+ * Copy a frame without its line padding. Planar formats (I420) are copied plane after plane
+ * whatever the batch layout. Packed formats are deinterleaved in BATCH_LAYOUT_NCHW.
+ * @param src : start of the frame in the MMAL buffer
+ * @param layout : layout of the frame
+ * @param dst : destination of packedFrameSize(layout) bytes
+ * @param batch_layout : channel ordering of the destination
+ */
+void copyFramePacked(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst, BATCH_LAYOUT_T batch_layout)
+{
+    if (layout.planes > 1 || batch_layout == BATCH_LAYOUT_NHWC) {
+        copyFrame(src, layout, dst, 0);
+        return;
+    }
+
+    unsigned int channels = layout.row_bytes[0]/layout.width;
+    size_t plane_size = (size_t) layout.width*layout.height;
+    for (unsigned int y = 0; y < layout.height; y++) {
+        const unsigned char *line = src + layout.offset[0] + (size_t) y*layout.pitch[0];
+        for (unsigned int c = 0; c < channels; c++) {
+            unsigned char *out = dst + c*plane_size + (size_t) y*layout.width;
+            const unsigned char *in = line + c;
+            for (unsigned int x = 0; x < layout.width; x++, in += channels)
+                out[x] = *in;
+        }
+    }
+}
+/**
+ * @brief makeFrameInfo
+ * @param stamp : stamp of the frame
+ * @param dropped : frames not grabbed since the previous grab
+ * @return the metadata of the frame
+ */
+FRAME_INFO makeFrameInfo(const FRAME_STAMP &stamp, uint64_t dropped)
+{
+    FRAME_INFO info;
+    info.pts = stamp.pts;
+    info.dts = stamp.dts;
+    info.flags = stamp.flags;
+    info.sequence = stamp.sequence;
+    info.dropped = dropped;
+    info.receive_time = stamp.receive_time;
+    info.latency = std::chrono::microseconds(stamp.latency);
+    return info;
+}
+
+
+FrameLease::FrameLease():
+    m_buffer(NULL),
+    m_owner(NULL),
+    m_dropped(0)
+{
+    memset(&m_layout, 0, sizeof(m_layout));
+}
+
+/**
+ * @brief FrameLease::FrameLease
+ * @param buffer : preview buffer, already acquired by the preview callback
+ * @param owner : preview userdata that gives the buffer back to the port
+ * @param layout : layout of the planes in the buffer
+ * @param dropped : frames not grabbed since the previous grab, reported by getInfo()
+ */
+FrameLease::FrameLease(MMAL_BUFFER_HEADER_T *buffer, PORT_PREVIEW_USERDATA *owner, const FRAME_LAYOUT &layout, uint64_t dropped):
+    m_buffer(buffer),
+    m_owner(owner),
+    m_layout(layout),
+    m_dropped(dropped)
+{
+    if (m_buffer) {
+        applyBufferLayout(m_layout, m_buffer);
+        mmal_buffer_header_mem_lock(m_buffer);
+    }
+}
+
+FrameLease::FrameLease(FrameLease &&other):
+    m_buffer(other.m_buffer),
+    m_owner(other.m_owner),
+    m_layout(other.m_layout),
+    m_dropped(other.m_dropped)
+{
+    other.m_buffer = NULL;
+    other.m_owner = NULL;
+}
+
+FrameLease& FrameLease::operator=(FrameLease &&other)
+{
+    if (this != &other) {
+        release();
+        m_buffer = other.m_buffer;
+        m_owner = other.m_owner;
+        m_layout = other.m_layout;
+        m_dropped = other.m_dropped;
+        other.m_buffer = NULL;
+        other.m_owner = NULL;
+    }
+    return *this;
+}
+
+FrameLease::~FrameLease()
+{
+    release();
+}
+
+/**
+ * @brief FrameLease::release
+ * Give the buffer back to its pool and refill the preview port.
+ * The lease is invalid afterwards.
+ */
+void FrameLease::release()
+{
+    if (!m_buffer) return;
+    mmal_buffer_header_mem_unlock(m_buffer);
+    if (m_owner) m_owner->releaseLease(m_buffer);
+    else mmal_buffer_header_release(m_buffer);
+    m_buffer = NULL;
+    m_owner = NULL;
+}
+
+/**
+ * @brief FrameLease::getPlane
+ * @param plane : index of the plane (0 = Y or packed RGB, 1 = U, 2 = V)
+ * @return pointer to the first pixel of the plane, NULL if the plane doesn't exist
+ */
+const unsigned char *FrameLease::getPlane(unsigned int plane) const
+{
+    if (!m_buffer || plane >= m_layout.planes) return NULL;
+    return m_buffer->data + m_buffer->offset + m_layout.offset[plane];
+}
+
+/**
+ * @brief FrameLease::getStride
+ * @param plane : index of the plane
+ * @return line stride of the plane in bytes
+ */
+unsigned int FrameLease::getStride(unsigned int plane) const
+{
+    if (plane >= m_layout.planes) return 0;
+    return m_layout.pitch[plane];
+}
+
+/**
+ * @brief FrameLease::getReceiveTime
+ * @return the time at which the preview callback received the frame
+ */
+std::chrono::steady_clock::time_point FrameLease::getReceiveTime() const
+{
+    if (!m_buffer || !m_buffer->user_data) return std::chrono::steady_clock::time_point();
+    return ((FRAME_STAMP *) m_buffer->user_data)->receive_time;
+}
+
+/**
+ * @brief FrameLease::getAge
+ * @return the time elapsed since the preview callback received the frame
+ */
+std::chrono::microseconds FrameLease::getAge() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - getReceiveTime());
+}
+
+/**
+ * @brief FrameLease::getInfo
+ * @return the pts, sequence number, drop count and latency of the frame
+ */
+FRAME_INFO FrameLease::getInfo() const
+{
+    FRAME_STAMP stamp = FRAME_STAMP();
+    stamp.pts = stamp.dts = MMAL_TIME_UNKNOWN;
+    stamp.latency = -1;
+    if (m_buffer && m_buffer->user_data) stamp = *(FRAME_STAMP *) m_buffer->user_data;
+    return makeFrameInfo(stamp, m_dropped);
+}
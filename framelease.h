@@ -0,0 +1,119 @@
+#ifndef FRAMELEASE_H
+#define FRAMELEASE_H
+
+#include "mmal/mmal.h"
+#include "mmal/mmal_buffer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <stdint.h>
+
+#define FRAME_MAX_PLANES 3
+
+// 8 bit luma only frames, not defined by this version of MMAL
+#ifndef MMAL_ENCODING_GREY
+#define MMAL_ENCODING_GREY MMAL_FOURCC('G','R','E','Y')
+#endif
+
+struct PORT_PREVIEW_USERDATA;
+
+/** Description of the planes of a preview frame inside a MMAL buffer
+*/
+struct FRAME_LAYOUT
+{
+    int format;                                 /// MMAL encoding of the frame
+    unsigned int width;                         /// Visible width in pixels
+    unsigned int height;                        /// Visible height in pixels
+    unsigned int planes;                        /// Number of planes (1 for RGB and GREY, 3 for I420)
+    unsigned int offset[FRAME_MAX_PLANES];      /// Offset of each plane from the start of the buffer
+    unsigned int pitch[FRAME_MAX_PLANES];       /// Line stride of each plane in bytes
+    unsigned int row_bytes[FRAME_MAX_PLANES];   /// Useful bytes in a line of each plane
+    unsigned int rows[FRAME_MAX_PLANES];        /// Number of lines of each plane
+};
+
+/** Memory layout of the frames written by retrieveBatch()
+*/
+enum BATCH_LAYOUT_T
+{
+    BATCH_LAYOUT_NHWC,    /// Frames one after the other, interleaved channels (packed RGB)
+    BATCH_LAYOUT_NCHW     /// Frames one after the other, one plane per channel
+};
+
+FRAME_LAYOUT computeFrameLayout(MMAL_ES_FORMAT_T *format);
+FRAME_LAYOUT packedFrameLayout(int format, unsigned int width, unsigned int height);
+FRAME_LAYOUT lumaFrameLayout(const FRAME_LAYOUT &layout);
+size_t frameExtent(const FRAME_LAYOUT &layout);
+void applyBufferLayout(FRAME_LAYOUT &layout, MMAL_BUFFER_HEADER_T *buffer);
+size_t packedFrameSize(const FRAME_LAYOUT &layout);
+void copyFrame(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst, unsigned int dst_stride);
+void copyFramePacked(const unsigned char *src, const FRAME_LAYOUT &layout, unsigned char *dst, BATCH_LAYOUT_T batch_layout);
+
+/** Host side information attached to each preview buffer header through its user_data
+*/
+struct FRAME_STAMP
+{
+    std::chrono::steady_clock::time_point receive_time;   /// When the preview callback received the buffer
+    int64_t pts;          /// Camera time of the frame since the first frame of the preview in microseconds, MMAL_TIME_UNKNOWN if not set
+    int64_t dts;          /// Decode time on the same clock, MMAL_TIME_UNKNOWN if not set
+    uint32_t flags;       /// MMAL_BUFFER_HEADER_FLAG_* of the buffer
+    uint64_t sequence;    /// Number of the frame since the preview started, frames lost before the callback included
+    int64_t latency;      /// Camera clock time from the capture to the callback in microseconds, from a periodic STC sample, -1 if unknown
+};
+
+/** Metadata of a grabbed preview frame
+*/
+struct FRAME_INFO
+{
+    int64_t pts;                                          /// Camera time since the first frame of the preview (us)
+    int64_t dts;                                          /// Decode time on the same clock (us)
+    uint32_t flags;                                       /// MMAL_BUFFER_HEADER_FLAG_* of the buffer
+    uint64_t sequence;                                    /// Monotonic frame number, gaps are lost frames
+    uint64_t dropped;                                     /// Frames produced and not grabbed since the previous grab
+    std::chrono::steady_clock::time_point receive_time;   /// Host time at which the frame was received
+    std::chrono::microseconds latency;                    /// Time from the capture to the reception, negative if unknown
+};
+
+FRAME_INFO makeFrameInfo(const FRAME_STAMP &stamp, uint64_t dropped);
+
+/**
+ * @brief The FrameLease class
+ * Handle on a preview buffer that is kept out of its MMAL pool while the lease exists.
+ * The image is read in place, without any copy. The buffer goes back to the preview port
+ * when the lease is released or destroyed.
+ * /!\ Leases must be released before stopping the preview they come from.
+ */
+class FrameLease
+{
+public:
+    FrameLease();
+    FrameLease(MMAL_BUFFER_HEADER_T *buffer, PORT_PREVIEW_USERDATA *owner, const FRAME_LAYOUT &layout, uint64_t dropped = 0);
+    FrameLease(FrameLease &&other);
+    FrameLease& operator=(FrameLease &&other);
+    ~FrameLease();
+
+    FrameLease(const FrameLease&) = delete;
+    FrameLease& operator=(const FrameLease&) = delete;
+
+    bool isValid() const { return m_buffer != NULL; }
+    void release();
+
+    int getFormat() const { return m_layout.format; }
+    unsigned int getWidth() const { return m_layout.width; }
+    unsigned int getHeight() const { return m_layout.height; }
+    unsigned int getPlaneCount() const { return m_layout.planes; }
+    const unsigned char *getPlane(unsigned int plane) const;
+    unsigned int getStride(unsigned int plane) const;
+    const FRAME_LAYOUT& getLayout() const { return m_layout; }
+    MMAL_BUFFER_HEADER_T *getBuffer() const { return m_buffer; }
+    std::chrono::steady_clock::time_point getReceiveTime() const;
+    std::chrono::microseconds getAge() const;
+    FRAME_INFO getInfo() const;
+
+private:
+    MMAL_BUFFER_HEADER_T *m_buffer;
+    PORT_PREVIEW_USERDATA *m_owner;
+    FRAME_LAYOUT m_layout;
+    uint64_t m_dropped;
+};
+
+#endif // FRAMELEASE_H
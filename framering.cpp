@@ -0,0 +1,105 @@
+#include "framering.h"
+
+#include <cstdlib>
+#include <unistd.h>
+
+
+FrameRing::FrameRing():
+    m_memory(NULL),
+    m_slot_count(0),
+    m_slot_size(0),
+    m_write_index(0),
+    m_latest_index(-1)
+{
+    for (unsigned int i = 0; i < FRAME_RING_SLOTS_NUM; i++) m_lengths[i] = 0;
+}
+
+FrameRing::~FrameRing()
+{
+    deallocate();
+}
+
+/**
+ * @brief FrameRing::allocate
+ * Allocate the slots in one page aligned block. Nothing is done if the ring already has
+ * the requested geometry.
+ * @param slot_count : number of slots, at most FRAME_RING_SLOTS_NUM
+ * @param slot_size : size of a frame in bytes, rounded up to the page size
+ * @return true if the ring is ready
+ */
+bool FrameRing::allocate(unsigned int slot_count, size_t slot_size)
+{
+    if (slot_count > FRAME_RING_SLOTS_NUM) slot_count = FRAME_RING_SLOTS_NUM;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    slot_size = (slot_size + page_size - 1) / page_size * page_size;
+
+    if (m_memory && slot_count == m_slot_count && slot_size == m_slot_size) {
+        m_write_index = 0;
+        m_latest_index = -1;
+        return true;
+    }
+    deallocate();
+    if (slot_count == 0 || slot_size == 0) return false;
+
+    void *memory = NULL;
+    if (posix_memalign(&memory, page_size, slot_count*slot_size) != 0) return false;
+
+    m_memory = (unsigned char *) memory;
+    m_slot_count = slot_count;
+    m_slot_size = slot_size;
+    return true;
+}
+
+/**
+ * @brief FrameRing::deallocate
+ * Free the slots. The ring must not be in use by a callback anymore.
+ */
+void FrameRing::deallocate()
+{
+    free(m_memory);
+    m_memory = NULL;
+    m_slot_count = 0;
+    m_slot_size = 0;
+    m_write_index = 0;
+    m_latest_index = -1;
+    for (unsigned int i = 0; i < FRAME_RING_SLOTS_NUM; i++) m_lengths[i] = 0;
+}
+
+/**
+ * @brief FrameRing::nextSlot
+ * @return the slot that will be published by the next commit, NULL if not allocated.
+ * The slot is never the latest published one.
+ */
+unsigned char *FrameRing::nextSlot()
+{
+    if (!m_memory) return NULL;
+    return m_memory + m_write_index*m_slot_size;
+}
+
+/**
+ * @brief FrameRing::commit
+ * Publish the slot returned by nextSlot as the latest frame.
+ * @param length : number of bytes written in the slot
+ */
+void FrameRing::commit(size_t length)
+{
+    if (!m_memory) return;
+    m_lengths[m_write_index] = length;
+    m_latest_index = m_write_index;
+    m_write_index = (m_write_index + 1) % m_slot_count;
+}
+
+/**
+ * @brief FrameRing::latest
+ * @param length : filled with the size of the latest frame, 0 if there is none
+ * @return the latest published frame, NULL if there is none
+ */
+const unsigned char *FrameRing::latest(size_t *length) const
+{
+    if (!m_memory || m_latest_index < 0) {
+        if (length) *length = 0;
+        return NULL;
+    }
+    if (length) *length = m_lengths[m_latest_index];
+    return m_memory + m_latest_index*m_slot_size;
+}
@@ -0,0 +1,43 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <cstddef>
+
+#define FRAME_RING_SLOTS_NUM 3
+
+/**
+ * @brief The FrameRing class
+ * Fixed set of page aligned frame slots, allocated once when a preview is created.
+ * The preview callback copies a frame in the next slot and publishes it, so no memory
+ * is allocated on the MMAL callback thread.
+ */
+class FrameRing
+{
+public:
+    FrameRing();
+    ~FrameRing();
+
+    FrameRing(const FrameRing&) = delete;
+    FrameRing& operator=(const FrameRing&) = delete;
+
+    bool allocate(unsigned int slot_count, size_t slot_size);
+    void deallocate();
+
+    unsigned char *nextSlot();
+    void commit(size_t length);
+    const unsigned char *latest(size_t *length) const;
+
+    bool isAllocated() const { return m_slot_count != 0; }
+    unsigned int getSlotCount() const { return m_slot_count; }
+    size_t getSlotSize() const { return m_slot_size; }
+
+private:
+    unsigned char *m_memory;
+    unsigned int m_slot_count;
+    size_t m_slot_size;
+    size_t m_lengths[FRAME_RING_SLOTS_NUM];
+    unsigned int m_write_index;
+    int m_latest_index;
+};
+
+#endif // FRAMERING_H
@@ -0,0 +1,114 @@
+#include "framesubscriber.h"
+
+/**
+ * @brief FrameSubscriber::FrameSubscriber
+ * Start the delivery thread of the subscriber.
+ * @param callback : function called on the delivery thread for each frame
+ * @param policy : behaviour when the queue is full
+ * @param queue_depth : maximum number of frames waiting for delivery
+ */
+FrameSubscriber::FrameSubscriber(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth):
+    m_callback(callback),
+    m_policy(policy),
+    m_queue_depth(queue_depth ? queue_depth : 1),
+    m_running(true),
+    m_delivered(0),
+    m_dropped(0)
+{
+    m_thread = std::thread(&FrameSubscriber::run, this);
+}
+
+FrameSubscriber::~FrameSubscriber()
+{
+    stop();
+}
+
+/**
+ * @brief FrameSubscriber::push
+ * Queue a frame for delivery. Called from the preview callback.
+ * @param lease : frame to deliver, dropped according to the policy if the queue is full
+ */
+void FrameSubscriber::push(FrameLease &&lease)
+{
+    FrameLease dropped;
+    {
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        if ( !m_running ) return;
+
+        if ( m_queue.size() >= m_queue_depth ) {
+            if ( m_policy == FRAME_DELIVERY_DROP_NEWEST ) {
+                m_dropped++;
+                return;
+            }
+            else if ( m_policy == FRAME_DELIVERY_DROP_OLDEST ) {
+                dropped = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_dropped++;
+            }
+            else {
+                // bounded, the wait holds the preview callback thread
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds ( FRAME_SUBSCRIBER_BLOCK_TIMEOUT_MS );
+                while ( m_running && m_queue.size() >= m_queue_depth ) {
+                    if ( m_cv_not_full.wait_until ( lck, deadline ) == std::cv_status::timeout ) break;
+                }
+                if ( !m_running ) return;
+                if ( m_queue.size() >= m_queue_depth ) {
+                    m_dropped++;
+                    return;
+                }
+            }
+        }
+        m_queue.push_back(std::move(lease));
+    }
+    m_cv_not_empty.notify_one();
+    // the dropped frame goes back to its pool when leaving this scope, outside of the lock
+}
+
+/**
+ * @brief FrameSubscriber::flush
+ * Give back all the queued frames without delivering them.
+ */
+void FrameSubscriber::flush()
+{
+    std::deque<FrameLease> pending;
+    {
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        pending.swap(m_queue);
+    }
+    m_cv_not_full.notify_all();
+}
+
+/**
+ * @brief FrameSubscriber::stop
+ * Stop the delivery thread and give back the queued frames.
+ * A frame being delivered is completed first.
+ */
+void FrameSubscriber::stop()
+{
+    {
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        m_running = false;
+    }
+    m_cv_not_empty.notify_all();
+    m_cv_not_full.notify_all();
+    if ( m_thread.joinable() ) m_thread.join();
+    flush();
+}
+
+void FrameSubscriber::run()
+{
+    while (true) {
+        FrameLease lease;
+        {
+            std::unique_lock<std::mutex> lck ( m_mutex );
+            while ( m_running && m_queue.empty() ) m_cv_not_empty.wait ( lck );
+            if ( !m_running ) return;
+            lease = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_cv_not_full.notify_one();
+
+        if ( m_callback ) m_callback(lease);
+        m_delivered++;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef FRAMESUBSCRIBER_H
+#define FRAMESUBSCRIBER_H
+
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+
+#include "framelease.h"
+
+#define FRAME_SUBSCRIBER_QUEUE_DEPTH 2
+#define FRAME_SUBSCRIBER_BLOCK_TIMEOUT_MS 10   /// Longest wait of a FRAME_DELIVERY_BLOCK push, below a frame period
+
+/** What to do with a new frame when the queue of a subscriber is full
+*/
+enum FRAME_DELIVERY_POLICY_T
+{
+    FRAME_DELIVERY_DROP_OLDEST,   /// Drop the oldest queued frame to keep the newest
+    FRAME_DELIVERY_DROP_NEWEST,   /// Drop the new frame
+    FRAME_DELIVERY_BLOCK          /// Wait up to FRAME_SUBSCRIBER_BLOCK_TIMEOUT_MS for room in the queue, then drop the new frame.
+                                  /// The wait delays the preview callback, the other subscribers get the frame before it
+};
+
+typedef std::function<void(FrameLease &)> FRAME_CALLBACK_T;
+
+/**
+ * @brief The FrameSubscriber class
+ * Bounded queue of frame leases consumed by a dedicated delivery thread.
+ * Each queued frame keeps its preview buffer out of the pool until it is delivered,
+ * so a slow subscriber only drops its own frames.
+ * /!\ A subscriber must not be stopped from its own callback.
+ */
+class FrameSubscriber
+{
+public:
+    FrameSubscriber(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth);
+    ~FrameSubscriber();
+
+    FrameSubscriber(const FrameSubscriber&) = delete;
+    FrameSubscriber& operator=(const FrameSubscriber&) = delete;
+
+    void push(FrameLease &&lease);
+    void flush();
+    void stop();
+
+    unsigned long getDeliveredCount() const { return m_delivered; }
+    unsigned long getDroppedCount() const { return m_dropped; }
+    FRAME_DELIVERY_POLICY_T getPolicy() const { return m_policy; }
+
+private:
+    void run();
+
+    FRAME_CALLBACK_T m_callback;
+    FRAME_DELIVERY_POLICY_T m_policy;
+    unsigned int m_queue_depth;
+
+    std::deque<FrameLease> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_not_empty;
+    std::condition_variable m_cv_not_full;
+    bool m_running;
+    std::atomic<unsigned long> m_delivered;
+    std::atomic<unsigned long> m_dropped;
+    std::thread m_thread;
+};
+
+#endif // FRAMESUBSCRIBER_H
@@ -0,0 +1,58 @@
+#include "motionfield.h"
+#include "mmal/mmal.h"
+
+#include <iostream>
+#include <string.h>
+
+
+MotionField::MotionField():
+    m_columns(0),
+    m_rows(0),
+    m_pts(MMAL_TIME_UNKNOWN)
+{
+}
+
+/**
+ * @brief MotionField::parse
+ * Read the motion vectors of a side information buffer. The vectors are stored without
+ * reallocation when the size of the frame doesn't change.
+ * @param data : content of the buffer, 4 bytes per macroblock (dx, dy, 16 bits SAD)
+ * @param size : bytes in the buffer
+ * @param width : width of the encoded frame
+ * @param height : height of the encoded frame
+ * @param pts : pts of the buffer
+ * @return false if the buffer doesn't match the frame size
+ */
+bool MotionField::parse(const unsigned char *data, size_t size, unsigned int width, unsigned int height, int64_t pts)
+{
+    unsigned int columns = ( width + MOTION_MACROBLOCK_SIZE - 1 ) / MOTION_MACROBLOCK_SIZE;
+    unsigned int rows = ( height + MOTION_MACROBLOCK_SIZE - 1 ) / MOTION_MACROBLOCK_SIZE;
+    if ( !columns || !rows || size % ( rows * sizeof(MOTION_VECTOR) ) ) return false;
+    unsigned int stride = size / ( rows * sizeof(MOTION_VECTOR) );
+    if ( stride < columns ) {
+        std::cerr << "Motion vectors of " << size << " bytes don't match a " << width << "*" << height << " frame" << std::endl;
+        return false;
+    }
+
+    m_columns = columns;
+    m_rows = rows;
+    m_pts = pts;
+    m_vectors.resize(columns * rows);
+    for ( unsigned int row = 0; row < rows; row++ )
+        memcpy(&m_vectors[row * columns], data + row * stride * sizeof(MOTION_VECTOR), columns * sizeof(MOTION_VECTOR));
+    return true;
+}
+
+/**
+ * @brief MotionField::countMoving
+ * @param min_magnitude : smallest motion counted, in pixels
+ * @return number of macroblocks moving by at least 'min_magnitude'
+ */
+unsigned int MotionField::countMoving(unsigned int min_magnitude) const
+{
+    int threshold = min_magnitude * min_magnitude;
+    unsigned int count = 0;
+    for ( const MOTION_VECTOR &vector : m_vectors )
+        if ( vector.dx * vector.dx + vector.dy * vector.dy >= threshold ) count++;
+    return count;
+}
@@ -0,0 +1,53 @@
+#ifndef MOTIONFIELD_H
+#define MOTIONFIELD_H
+
+#include <functional>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MOTION_MACROBLOCK_SIZE 16
+
+/** Motion vector of a 16x16 macroblock, as written by the H.264 encoder
+*/
+struct MOTION_VECTOR
+{
+    int8_t dx;       /// Horizontal motion, in pixels
+    int8_t dy;       /// Vertical motion, in pixels
+    uint16_t sad;    /// Sum of absolute differences with the reference block
+};
+
+/**
+ * @brief The MotionField class
+ * Grid of the motion vectors of one encoded frame, one per 16x16 macroblock, parsed from the
+ * side information buffers of the encoder (MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS).
+ * The encoder writes one more column than the frame has macroblocks, it is dropped.
+ */
+class MotionField
+{
+public:
+    MotionField();
+
+    bool parse(const unsigned char *data, size_t size, unsigned int width, unsigned int height, int64_t pts);
+
+    unsigned int getColumns() const { return m_columns; }
+    unsigned int getRows() const { return m_rows; }
+    int64_t getPts() const { return m_pts; }
+    const MOTION_VECTOR &at(unsigned int column, unsigned int row) const { return m_vectors[row * m_columns + column]; }
+    const std::vector<MOTION_VECTOR> &getVectors() const { return m_vectors; }
+
+    unsigned int countMoving(unsigned int min_magnitude) const;
+
+private:
+    unsigned int m_columns;
+    unsigned int m_rows;
+    int64_t m_pts;                          /// MMAL pts of the frame in microseconds, or MMAL_TIME_UNKNOWN
+    std::vector<MOTION_VECTOR> m_vectors;   /// Row by row
+};
+
+/** Called by the record writer with the motion field of each encoded frame. The field is only
+ * valid during the call.
+*/
+typedef std::function<void(const MotionField &)> MOTION_CALLBACK_T;
+
+#endif // MOTIONFIELD_H
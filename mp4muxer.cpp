@@ -0,0 +1,495 @@
+#include "mp4muxer.h"
+#include "mmal/mmal.h"
+
+#include <iostream>
+#include <utility>
+
+using namespace std;
+
+// --------------------------------------------------
+// Box serialization, all the fields are big endian
+// --------------------------------------------------
+
+static void put8(vector<unsigned char> &b, uint8_t v)
+{
+    b.push_back(v);
+}
+
+static void put16(vector<unsigned char> &b, uint16_t v)
+{
+    b.push_back(v >> 8);
+    b.push_back(v);
+}
+
+static void put32(vector<unsigned char> &b, uint32_t v)
+{
+    b.push_back(v >> 24);
+    b.push_back(v >> 16);
+    b.push_back(v >> 8);
+    b.push_back(v);
+}
+
+static void put64(vector<unsigned char> &b, uint64_t v)
+{
+    put32(b, v >> 32);
+    put32(b, v);
+}
+
+static void putZeros(vector<unsigned char> &b, size_t count)
+{
+    b.insert(b.end(), count, 0);
+}
+
+static void putType(vector<unsigned char> &b, const char *type)
+{
+    b.insert(b.end(), type, type + 4);
+}
+
+static void patch32(vector<unsigned char> &b, size_t pos, uint32_t v)
+{
+    b[pos] = v >> 24;
+    b[pos + 1] = v >> 16;
+    b[pos + 2] = v >> 8;
+    b[pos + 3] = v;
+}
+
+static size_t beginBox(vector<unsigned char> &b, const char *type)
+{
+    size_t pos = b.size();
+    put32(b, 0);
+    putType(b, type);
+    return pos;
+}
+
+static size_t beginFullBox(vector<unsigned char> &b, const char *type, uint8_t version, uint32_t flags)
+{
+    size_t pos = beginBox(b, type);
+    put32(b, ( (uint32_t) version << 24 ) | flags);
+    return pos;
+}
+
+static void endBox(vector<unsigned char> &b, size_t pos)
+{
+    patch32(b, pos, b.size() - pos);
+}
+
+static void putMatrix(vector<unsigned char> &b)
+{
+    static const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+    for ( uint32_t v : unity ) put32(b, v);
+}
+
+/**
+ * @brief Mp4Muxer::splitNals
+ * Find the NAL units of an Annex B stream.
+ * @return offset and size of each NAL unit, without the start codes
+ */
+vector<pair<size_t, size_t>> Mp4Muxer::splitNals(const unsigned char *data, size_t size)
+{
+    vector<pair<size_t, size_t>> nals;
+    size_t start = size;
+    size_t i = 0;
+    while ( i + 3 <= size ) {
+        if ( data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1 ) {
+            if ( start < i ) nals.push_back(make_pair(start, i - start));
+            i += 3;
+            start = i;
+        }
+        else i++;
+    }
+    if ( start == size && size ) start = 0;   // no start code, a single NAL unit
+    if ( start < size ) nals.push_back(make_pair(start, size - start));
+
+    // the zeros before a 4 bytes start code belong to the start code
+    for ( pair<size_t, size_t> &nal : nals )
+        while ( nal.second && data[nal.first + nal.second - 1] == 0 ) nal.second--;
+    return nals;
+}
+
+static int64_t toTimescale(int64_t us)
+{
+    return us * MP4_TIMESCALE / 1000000;
+}
+
+
+#define SAMPLE_FLAGS_SYNC 0x02000000        /// Depends on no other sample
+#define SAMPLE_FLAGS_NON_SYNC 0x01010000    /// Depends on others, not a sync sample
+
+
+Mp4Muxer::Mp4Muxer():
+    m_file(NULL),
+    m_width(0),
+    m_height(0),
+    m_header_written(false),
+    m_frame_keyframe(false),
+    m_frame_pts(MMAL_TIME_UNKNOWN),
+    m_first_pts(MMAL_TIME_UNKNOWN),
+    m_last_pts(0),
+    m_decode_time(0),
+    m_last_duration(MP4_DEFAULT_SAMPLE_DURATION),
+    m_sequence(0)
+{
+}
+
+/**
+ * @brief Mp4Muxer::start
+ * Start a new movie in 'file'. The header is written with the first keyframe.
+ * @param file : opened file, the muxer doesn't own it
+ * @param width : width of the video
+ * @param height : height of the video
+ * @return false if the muxer is already started
+ */
+bool Mp4Muxer::start(RecordFile *file, unsigned int width, unsigned int height)
+{
+    if ( m_file ) return false;
+    m_file = file;
+    m_width = width;
+    m_height = height;
+    m_sps.clear();
+    m_pps.clear();
+    m_header_written = false;
+    m_frame.clear();
+    m_frame_pts = MMAL_TIME_UNKNOWN;
+    m_first_pts = MMAL_TIME_UNKNOWN;
+    m_last_pts = 0;
+    m_samples.clear();
+    m_mdat.clear();
+    m_decode_time = 0;
+    m_last_duration = MP4_DEFAULT_SAMPLE_DURATION;
+    m_sequence = 0;
+    m_index.clear();
+    return true;
+}
+
+/**
+ * @brief Mp4Muxer::write
+ * Give an encoder buffer to the muxer. A frame can span several buffers,
+ * it is complete with MMAL_BUFFER_HEADER_FLAG_FRAME_END.
+ * @param data : Annex B data
+ * @param size : size of data
+ * @param flags : MMAL buffer flags
+ * @param pts : MMAL presentation time in microseconds, or MMAL_TIME_UNKNOWN
+ * @return false if writing the file failed
+ */
+bool Mp4Muxer::write(const unsigned char *data, size_t size, uint32_t flags, int64_t pts)
+{
+    if ( !m_file ) return false;
+    if ( flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ) {
+        setParameterSets(data, size);
+        return true;
+    }
+
+    if ( m_frame.empty() ) {
+        m_frame_keyframe = ( flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) != 0;
+        m_frame_pts = pts;
+    }
+    else if ( m_frame_pts == MMAL_TIME_UNKNOWN ) m_frame_pts = pts;
+    m_frame.insert(m_frame.end(), data, data + size);
+
+    if ( !( flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END ) ) return true;
+    bool ok = addFrame();
+    m_frame.clear();
+    return ok;
+}
+
+/**
+ * @brief Mp4Muxer::close
+ * Write the last fragment and the mfra index. The file is not closed.
+ * @return false if writing the file failed
+ */
+bool Mp4Muxer::close()
+{
+    if ( !m_file ) return true;
+    bool ok = true;
+    if ( !m_samples.empty() ) ok = writeFragment(MMAL_TIME_UNKNOWN);
+
+    if ( m_header_written ) {
+        m_box.clear();
+        size_t mfra = beginBox(m_box, "mfra");
+        size_t tfra = beginFullBox(m_box, "tfra", 1, 0);
+        put32(m_box, 1);            // track_ID
+        put32(m_box, 0);            // traf, trun and sample numbers on 1 byte
+        put32(m_box, m_index.size());
+        for ( const FRAGMENT_ENTRY &entry : m_index ) {
+            put64(m_box, entry.time);
+            put64(m_box, entry.offset);
+            put8(m_box, 1);
+            put8(m_box, 1);
+            put8(m_box, 1);
+        }
+        endBox(m_box, tfra);
+        size_t mfro = beginFullBox(m_box, "mfro", 0, 0);
+        put32(m_box, m_box.size() + 4 - mfra);
+        endBox(m_box, mfro);
+        endBox(m_box, mfra);
+        ok = m_file->write(m_box.data(), m_box.size()) && ok;
+    }
+
+    m_file = NULL;
+    m_frame.clear();
+    m_samples.clear();
+    m_mdat.clear();
+    m_index.clear();
+    return ok;
+}
+
+void Mp4Muxer::setParameterSets(const unsigned char *data, size_t size)
+{
+    // the sample description can't change once written
+    if ( m_header_written ) return;
+    for ( const pair<size_t, size_t> &nal : splitNals(data, size) ) {
+        if ( !nal.second ) continue;
+        int type = data[nal.first] & 0x1f;
+        if ( type == NAL_TYPE_SPS ) m_sps.assign(data + nal.first, data + nal.first + nal.second);
+        else if ( type == NAL_TYPE_PPS ) m_pps.assign(data + nal.first, data + nal.first + nal.second);
+    }
+}
+
+bool Mp4Muxer::addFrame()
+{
+    // SPS and PPS may also be inlined in the keyframes
+    setParameterSets(m_frame.data(), m_frame.size());
+    if ( !m_header_written ) {
+        // the movie starts with a keyframe, once the parameter sets are known
+        if ( !m_frame_keyframe || m_sps.size() < 4 || m_pps.empty() ) return true;
+        if ( !writeHeader() ) return false;
+    }
+
+    int64_t pts;
+    if ( m_frame_pts == MMAL_TIME_UNKNOWN ) pts = m_last_pts + m_last_duration * 1000000LL / MP4_TIMESCALE;
+    else {
+        if ( m_first_pts == MMAL_TIME_UNKNOWN ) m_first_pts = m_frame_pts;
+        pts = m_frame_pts - m_first_pts;
+    }
+
+    bool ok = true;
+    vector<pair<size_t, size_t>> nals = splitNals(m_frame.data(), m_frame.size());
+    size_t sample_size = 0;
+    for ( const pair<size_t, size_t> &nal : nals ) sample_size += 4 + nal.second;
+    if ( !m_samples.empty() && ( m_frame_keyframe || m_mdat.size() + sample_size > MP4_FRAGMENT_MAX_SIZE ) )
+        ok = writeFragment(pts);
+
+    size_t begin = m_mdat.size();
+    for ( const pair<size_t, size_t> &nal : nals ) {
+        int type = nal.second ? m_frame[nal.first] & 0x1f : 0;
+        if ( !nal.second || type == NAL_TYPE_SPS || type == NAL_TYPE_PPS || type == NAL_TYPE_AUD ) continue;
+        put32(m_mdat, nal.second);
+        m_mdat.insert(m_mdat.end(), m_frame.begin() + nal.first, m_frame.begin() + nal.first + nal.second);
+    }
+    SAMPLE sample;
+    sample.size = m_mdat.size() - begin;
+    sample.keyframe = m_frame_keyframe;
+    sample.pts = pts;
+    if ( sample.size ) m_samples.push_back(sample);
+    m_last_pts = pts;
+    return ok;
+}
+
+bool Mp4Muxer::writeHeader()
+{
+    vector<unsigned char> &b = m_box;
+    b.clear();
+
+    size_t ftyp = beginBox(b, "ftyp");
+    putType(b, "isom");
+    put32(b, 0x200);
+    putType(b, "isom");
+    putType(b, "iso6");
+    putType(b, "iso2");
+    putType(b, "avc1");
+    putType(b, "mp41");
+    endBox(b, ftyp);
+
+    size_t moov = beginBox(b, "moov");
+
+    size_t mvhd = beginFullBox(b, "mvhd", 0, 0);
+    put32(b, 0);                // creation_time
+    put32(b, 0);                // modification_time
+    put32(b, 1000);             // timescale
+    put32(b, 0);                // duration, given by the fragments
+    put32(b, 0x00010000);       // rate
+    put16(b, 0x0100);           // volume
+    putZeros(b, 10);
+    putMatrix(b);
+    putZeros(b, 24);
+    put32(b, 2);                // next_track_ID
+    endBox(b, mvhd);
+
+    size_t trak = beginBox(b, "trak");
+    size_t tkhd = beginFullBox(b, "tkhd", 0, 3);    // enabled, in movie
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 1);                // track_ID
+    put32(b, 0);
+    put32(b, 0);                // duration
+    putZeros(b, 8);
+    put16(b, 0);                // layer
+    put16(b, 0);                // alternate_group
+    put16(b, 0);                // volume
+    put16(b, 0);
+    putMatrix(b);
+    put32(b, m_width << 16);
+    put32(b, m_height << 16);
+    endBox(b, tkhd);
+
+    size_t mdia = beginBox(b, "mdia");
+    size_t mdhd = beginFullBox(b, "mdhd", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, MP4_TIMESCALE);
+    put32(b, 0);
+    put16(b, 0x55c4);           // "und"
+    put16(b, 0);
+    endBox(b, mdhd);
+
+    size_t hdlr = beginFullBox(b, "hdlr", 0, 0);
+    put32(b, 0);
+    putType(b, "vide");
+    putZeros(b, 12);
+    static const char name[] = "VideoHandler";
+    b.insert(b.end(), name, name + sizeof(name));
+    endBox(b, hdlr);
+
+    size_t minf = beginBox(b, "minf");
+    size_t vmhd = beginFullBox(b, "vmhd", 0, 1);
+    putZeros(b, 8);
+    endBox(b, vmhd);
+    size_t dinf = beginBox(b, "dinf");
+    size_t dref = beginFullBox(b, "dref", 0, 0);
+    put32(b, 1);
+    endBox(b, beginFullBox(b, "url ", 0, 1));       // data in this file
+    endBox(b, dref);
+    endBox(b, dinf);
+
+    size_t stbl = beginBox(b, "stbl");
+    size_t stsd = beginFullBox(b, "stsd", 0, 0);
+    put32(b, 1);
+    size_t avc1 = beginBox(b, "avc1");
+    putZeros(b, 6);
+    put16(b, 1);                // data_reference_index
+    putZeros(b, 16);
+    put16(b, m_width);
+    put16(b, m_height);
+    put32(b, 0x00480000);       // 72 dpi
+    put32(b, 0x00480000);
+    put32(b, 0);
+    put16(b, 1);                // frame_count
+    putZeros(b, 32);            // compressorname
+    put16(b, 0x0018);           // depth
+    put16(b, 0xffff);
+
+    size_t avcc = beginBox(b, "avcC");
+    put8(b, 1);                 // configurationVersion
+    put8(b, m_sps[1]);          // profile
+    put8(b, m_sps[2]);          // profile compatibility
+    put8(b, m_sps[3]);          // level
+    put8(b, 0xff);              // 4 bytes NAL unit lengths
+    put8(b, 0xe1);              // 1 SPS
+    put16(b, m_sps.size());
+    b.insert(b.end(), m_sps.begin(), m_sps.end());
+    put8(b, 1);                 // 1 PPS
+    put16(b, m_pps.size());
+    b.insert(b.end(), m_pps.begin(), m_pps.end());
+    if ( m_sps[1] == 100 || m_sps[1] == 110 || m_sps[1] == 122 || m_sps[1] == 144 ) {
+        // high profiles, the encoder gives 8 bits 4:2:0
+        put8(b, 0xfc | 1);
+        put8(b, 0xf8);
+        put8(b, 0xf8);
+        put8(b, 0);
+    }
+    endBox(b, avcc);
+    endBox(b, avc1);
+    endBox(b, stsd);
+
+    // the samples are described by the fragments
+    size_t stts = beginFullBox(b, "stts", 0, 0);
+    put32(b, 0);
+    endBox(b, stts);
+    size_t stsc = beginFullBox(b, "stsc", 0, 0);
+    put32(b, 0);
+    endBox(b, stsc);
+    size_t stsz = beginFullBox(b, "stsz", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    endBox(b, stsz);
+    size_t stco = beginFullBox(b, "stco", 0, 0);
+    put32(b, 0);
+    endBox(b, stco);
+    endBox(b, stbl);
+    endBox(b, minf);
+    endBox(b, mdia);
+    endBox(b, trak);
+
+    size_t mvex = beginBox(b, "mvex");
+    size_t trex = beginFullBox(b, "trex", 0, 0);
+    put32(b, 1);                // track_ID
+    put32(b, 1);                // default_sample_description_index
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    endBox(b, trex);
+    endBox(b, mvex);
+    endBox(b, moov);
+
+    m_header_written = true;
+    return m_file->write(b.data(), b.size());
+}
+
+bool Mp4Muxer::writeFragment(int64_t next_pts)
+{
+    vector<unsigned char> &b = m_box;
+    b.clear();
+
+    size_t moof = beginBox(b, "moof");
+    size_t mfhd = beginFullBox(b, "mfhd", 0, 0);
+    put32(b, ++m_sequence);
+    endBox(b, mfhd);
+
+    size_t traf = beginBox(b, "traf");
+    size_t tfhd = beginFullBox(b, "tfhd", 0, 0x020000);    // default-base-is-moof
+    put32(b, 1);
+    endBox(b, tfhd);
+    size_t tfdt = beginFullBox(b, "tfdt", 1, 0);
+    put64(b, m_decode_time);
+    endBox(b, tfdt);
+
+    // data offset, sample duration, size and flags
+    size_t trun = beginFullBox(b, "trun", 0, 0x000701);
+    put32(b, m_samples.size());
+    size_t data_offset = b.size();
+    put32(b, 0);
+    uint64_t duration = 0;
+    for ( size_t i = 0; i < m_samples.size(); i++ ) {
+        const SAMPLE &sample = m_samples[i];
+        bool next_known = i + 1 < m_samples.size() || next_pts != MMAL_TIME_UNKNOWN;
+        int64_t next = i + 1 < m_samples.size() ? m_samples[i + 1].pts : next_pts;
+        // the durations come from the timestamps, a dropped frame lengthens the previous one
+        int64_t d = next_known ? toTimescale(next) - toTimescale(sample.pts) : 0;
+        if ( d > 0 && d <= 0xffffffffLL ) m_last_duration = d;
+        put32(b, m_last_duration);
+        put32(b, sample.size);
+        put32(b, sample.keyframe ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+        duration += m_last_duration;
+    }
+    endBox(b, trun);
+    endBox(b, traf);
+    endBox(b, moof);
+    patch32(b, data_offset, b.size() + 8);
+
+    put32(b, 8 + m_mdat.size());
+    putType(b, "mdat");
+
+    if ( m_samples.front().keyframe ) {
+        FRAGMENT_ENTRY entry;
+        entry.time = m_decode_time;
+        entry.offset = m_file->getSize();
+        m_index.push_back(entry);
+    }
+
+    bool ok = m_file->write(b.data(), b.size());
+    ok = m_file->write(m_mdat.data(), m_mdat.size()) && ok;
+    m_decode_time += duration;
+    m_samples.clear();
+    m_mdat.clear();
+    return ok;
+}
@@ -0,0 +1,80 @@
+#ifndef MP4MUXER_H
+#define MP4MUXER_H
+
+#include "recordfile.h"
+
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MP4_TIMESCALE 90000                        /// Time unit of the video track, in Hz
+#define MP4_FRAGMENT_MAX_SIZE (8 << 20)            /// A fragment is cut before a keyframe or at this size
+#define MP4_DEFAULT_SAMPLE_DURATION (MP4_TIMESCALE / 30)   /// Used when the timestamps can't give the duration
+
+#define NAL_TYPE_IDR 5
+#define NAL_TYPE_SPS 7
+#define NAL_TYPE_PPS 8
+#define NAL_TYPE_AUD 9
+
+/**
+ * @brief The Mp4Muxer class
+ * Fragmented MP4 (ISO BMFF) muxer for the H.264 encoder output. The file starts with an
+ * empty moov, then each GOP is written as a moof/mdat fragment once the next keyframe arrives,
+ * so a crash only loses the fragment being built. close() appends a mfra index of the keyframes.
+ * Frames are given as Annex B (start codes), SPS and PPS come from the MMAL config buffers.
+ */
+class Mp4Muxer
+{
+public:
+    Mp4Muxer();
+
+    bool start(RecordFile *file, unsigned int width, unsigned int height);
+    bool write(const unsigned char *data, size_t size, uint32_t flags, int64_t pts);
+    bool close();
+    bool isStarted() const { return m_file != NULL; }
+    uint32_t getFragmentsNum() const { return m_sequence; }
+    static std::vector<std::pair<size_t, size_t>> splitNals(const unsigned char *data, size_t size);
+
+private:
+    struct SAMPLE
+    {
+        uint32_t size;
+        bool keyframe;
+        int64_t pts;       /// Microseconds since the first frame
+    };
+
+    struct FRAGMENT_ENTRY
+    {
+        uint64_t time;      /// Decode time of the first sample, in MP4_TIMESCALE
+        uint64_t offset;    /// Offset of the moof in the file
+    };
+
+    void setParameterSets(const unsigned char *data, size_t size);
+    bool addFrame();
+    bool writeHeader();
+    bool writeFragment(int64_t next_pts);
+
+    RecordFile *m_file;
+    unsigned int m_width;
+    unsigned int m_height;
+    std::vector<unsigned char> m_sps;
+    std::vector<unsigned char> m_pps;
+    bool m_header_written;
+
+    std::vector<unsigned char> m_frame;      /// Annex B data of the frame being received
+    bool m_frame_keyframe;
+    int64_t m_frame_pts;
+
+    int64_t m_first_pts;                     /// Raw pts of the first frame
+    int64_t m_last_pts;                      /// Pts of the last sample, since the first frame
+    std::vector<SAMPLE> m_samples;           /// Samples of the current fragment
+    std::vector<unsigned char> m_mdat;       /// Length prefixed NAL units of the current fragment
+    uint64_t m_decode_time;                  /// Decode time of the current fragment
+    uint32_t m_last_duration;
+    uint32_t m_sequence;
+    std::vector<FRAGMENT_ENTRY> m_index;     /// Fragments starting with a keyframe, for the mfra
+    std::vector<unsigned char> m_box;        /// Boxes being serialized
+};
+
+#endif // MP4MUXER_H
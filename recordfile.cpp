@@ -0,0 +1,391 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "recordfile.h"
+
+#include <iostream>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define RECORD_FILE_HAS_IO_URING
+#endif
+#endif
+
+using namespace std;
+
+
+RecordFile::RecordFile():
+    m_fd(-1),
+    m_direct(false),
+    m_preallocate(false),
+    m_error(false),
+    m_size(0),
+    m_chunk_offset(0),
+    m_allocated(0),
+    m_current(0)
+{
+    memset(&m_uring, 0, sizeof(m_uring));
+    m_uring.fd = -1;
+}
+
+RecordFile::~RecordFile()
+{
+    close();
+}
+
+/**
+ * @brief RecordFile::open
+ * Open a file to write data at its end. O_DIRECT is not supported by every filesystem
+ * (tmpfs for example) and io_uring by every kernel, the file uses the buffered writes and
+ * pwrite instead.
+ * @param filename : file to append to, created if needed
+ * @param mode : preferred way to write the file
+ * @param append : keep the content of an existing file, otherwise it is truncated
+ * @return false if the file can't be opened
+ */
+bool RecordFile::open(const std::string &filename, RECORD_FILE_MODE_T mode, bool append)
+{
+    close();
+
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | ( append ? 0 : O_TRUNC );
+    m_direct = false;
+    if ( mode != RECORD_FILE_BUFFERED ) {
+        m_fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+        m_direct = m_fd >= 0;
+    }
+    if ( m_fd < 0 )
+        m_fd = ::open(filename.c_str(), flags, 0644);
+    if ( m_fd < 0 ) {
+        cerr << "Unable to open the record file " << filename << " : " << strerror(errno) << endl;
+        return false;
+    }
+
+    // the existing data must not be truncated when open fails
+    auto fail = [this]() {
+        ::close(m_fd);
+        m_fd = -1;
+        close();
+        return false;
+    };
+
+    struct stat st;
+    if ( fstat(m_fd, &st) != 0 ) {
+        cerr << "Unable to stat the record file " << filename << endl;
+        return fail();
+    }
+
+    m_chunks.resize(RECORD_FILE_CHUNKS_NUM);
+    for ( CHUNK &chunk : m_chunks ) {
+        void *data = NULL;
+        if ( posix_memalign(&data, RECORD_FILE_ALIGNMENT, RECORD_FILE_CHUNK_SIZE) != 0 ) {
+            cerr << "Unable to allocate the record file chunks" << endl;
+            return fail();
+        }
+        chunk.data = (unsigned char *) data;
+        chunk.used = 0;
+        chunk.busy = false;
+        chunk.offset = 0;
+    }
+
+    // the writes start on an aligned offset, the end of the last block is written again
+    m_size = st.st_size;
+    m_chunk_offset = m_size - m_size % RECORD_FILE_ALIGNMENT;
+    m_current = 0;
+    size_t tail = m_size - m_chunk_offset;
+    if ( tail && pread(m_fd, m_chunks[0].data, RECORD_FILE_ALIGNMENT, m_chunk_offset) < (ssize_t) tail ) {
+        cerr << "Unable to read the end of the record file " << filename << endl;
+        return fail();
+    }
+    m_chunks[0].used = tail;
+
+    m_allocated = m_size;
+    m_preallocate = true;
+    m_error = false;
+
+    if ( mode == RECORD_FILE_IO_URING && !setupUring() )
+        cerr << "io_uring is not available, the record file uses pwrite" << endl;
+    return true;
+}
+
+/**
+ * @brief RecordFile::write
+ * Append data to the file. Data is copied in the current chunk, which is written once full.
+ * @return false if a write failed since the file was opened
+ */
+bool RecordFile::write(const void *data, size_t size)
+{
+    if ( m_fd < 0 ) return false;
+    const unsigned char *src = (const unsigned char *) data;
+    while ( size ) {
+        CHUNK &chunk = m_chunks[m_current];
+        size_t n = min(size, (size_t) RECORD_FILE_CHUNK_SIZE - chunk.used);
+        memcpy(chunk.data + chunk.used, src, n);
+        chunk.used += n;
+        m_size += n;
+        src += n;
+        size -= n;
+
+        if ( chunk.used == RECORD_FILE_CHUNK_SIZE ) {
+            submit(m_current);
+            m_chunk_offset += RECORD_FILE_CHUNK_SIZE;
+            m_current = ( m_current + 1 ) % m_chunks.size();
+            waitChunk(m_current);
+            m_chunks[m_current].used = 0;
+        }
+    }
+    return !m_error;
+}
+
+/**
+ * @brief RecordFile::close
+ * Write the last chunk, wait for the writes, give back the space reserved after the data and close the file.
+ * @return false if a write failed since the file was opened
+ */
+bool RecordFile::close()
+{
+    if ( m_fd >= 0 ) {
+        if ( m_chunks[m_current].used ) submit(m_current);
+        waitAll();
+        destroyUring();
+        // drops the padding of the last O_DIRECT write and the blocks reserved by fallocate
+        if ( ftruncate(m_fd, m_size) != 0 ) {
+            cerr << "Unable to truncate the record file : " << strerror(errno) << endl;
+            m_error = true;
+        }
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    destroyUring();
+    for ( CHUNK &chunk : m_chunks ) free(chunk.data);
+    m_chunks.clear();
+    return !m_error;
+}
+
+/**
+ * @brief RecordFile::getMode
+ * @return the way the file is actually written, after the fallbacks of open()
+ */
+RECORD_FILE_MODE_T RecordFile::getMode() const
+{
+    if ( m_uring.fd >= 0 ) return RECORD_FILE_IO_URING;
+    return m_direct ? RECORD_FILE_PWRITE : RECORD_FILE_BUFFERED;
+}
+
+/**
+ * @brief RecordFile::getBackendName
+ * @return a description of the writes, for the logs
+ */
+const char *RecordFile::getBackendName() const
+{
+    if ( m_uring.fd >= 0 ) return m_direct ? "io_uring+O_DIRECT" : "io_uring";
+    return m_direct ? "pwrite+O_DIRECT" : "pwrite";
+}
+
+void RecordFile::submit(unsigned int index)
+{
+    CHUNK &chunk = m_chunks[index];
+    size_t size = chunk.used;
+    if ( m_direct ) {
+        // O_DIRECT writes whole blocks, the padding is truncated by close()
+        size_t padded = ( size + RECORD_FILE_ALIGNMENT - 1 ) & ~( (size_t) RECORD_FILE_ALIGNMENT - 1 );
+        memset(chunk.data + size, 0, padded - size);
+        size = padded;
+    }
+    chunk.offset = m_chunk_offset;
+    chunk.iov.iov_base = chunk.data;
+    chunk.iov.iov_len = size;
+    reserve(chunk.offset + size);
+
+    if ( m_uring.fd >= 0 && submitUring(index) ) return;
+    if ( !writeSync(chunk.data, size, chunk.offset) ) m_error = true;
+}
+
+bool RecordFile::writeSync(const unsigned char *data, size_t size, uint64_t offset)
+{
+    while ( size ) {
+        ssize_t n = pwrite(m_fd, data, size, offset);
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) {
+            cerr << "Unable to write the record file : " << strerror(errno) << endl;
+            return false;
+        }
+        // O_DIRECT offsets and sizes stay on block boundaries, a partial block is written again
+        if ( m_direct ) n &= ~( (ssize_t) RECORD_FILE_ALIGNMENT - 1 );
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+void RecordFile::reserve(uint64_t end)
+{
+    if ( !m_preallocate || end <= m_allocated ) return;
+    uint64_t start = m_allocated;
+    uint64_t length = end - start + RECORD_FILE_PREALLOCATE_SIZE;
+    // the reserved blocks are not part of the file size until they are written
+    if ( fallocate(m_fd, FALLOC_FL_KEEP_SIZE, start, length) != 0 ) {
+        if ( errno != EOPNOTSUPP && errno != ENOSYS )
+            cerr << "Unable to reserve space for the record file : " << strerror(errno) << endl;
+        m_preallocate = false;
+        return;
+    }
+    m_allocated = start + length;
+}
+
+void RecordFile::waitChunk(unsigned int index)
+{
+    while ( m_chunks[index].busy ) {
+        if ( !reapUring(true) ) {
+            m_error = true;
+            m_chunks[index].busy = false;
+        }
+    }
+}
+
+void RecordFile::waitAll()
+{
+    for ( unsigned int i = 0; i < m_chunks.size(); i++ ) waitChunk(i);
+}
+
+#ifdef RECORD_FILE_HAS_IO_URING
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+bool RecordFile::setupUring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, RECORD_FILE_CHUNKS_NUM, &params);
+    if ( fd < 0 ) return false;
+
+    URING &ring = m_uring;
+    ring.fd = fd;
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+        ring.sq_ring_size = ring.cq_ring_size = max(ring.sq_ring_size, ring.cq_ring_size);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if ( ring.sq_ring == MAP_FAILED ) ring.sq_ring = NULL;
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+        ring.cq_ring = ring.sq_ring;
+    else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if ( ring.cq_ring == MAP_FAILED ) ring.cq_ring = NULL;
+    }
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if ( ring.sqes == MAP_FAILED ) ring.sqes = NULL;
+    if ( !ring.sq_ring || !ring.cq_ring || !ring.sqes ) {
+        destroyUring();
+        return false;
+    }
+
+    unsigned char *sq = (unsigned char *) ring.sq_ring;
+    unsigned char *cq = (unsigned char *) ring.cq_ring;
+    ring.sq_head = (unsigned *) ( sq + params.sq_off.head );
+    ring.sq_tail = (unsigned *) ( sq + params.sq_off.tail );
+    ring.sq_mask = (unsigned *) ( sq + params.sq_off.ring_mask );
+    ring.sq_array = (unsigned *) ( sq + params.sq_off.array );
+    ring.cq_head = (unsigned *) ( cq + params.cq_off.head );
+    ring.cq_tail = (unsigned *) ( cq + params.cq_off.tail );
+    ring.cq_mask = (unsigned *) ( cq + params.cq_off.ring_mask );
+    ring.cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+void RecordFile::destroyUring()
+{
+    URING &ring = m_uring;
+    if ( ring.sqes ) munmap(ring.sqes, ring.sqes_size);
+    if ( ring.cq_ring && ring.cq_ring != ring.sq_ring ) munmap(ring.cq_ring, ring.cq_ring_size);
+    if ( ring.sq_ring ) munmap(ring.sq_ring, ring.sq_ring_size);
+    if ( ring.fd >= 0 ) ::close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+bool RecordFile::submitUring(unsigned int index)
+{
+    URING &ring = m_uring;
+    CHUNK &chunk = m_chunks[index];
+
+    // one entry per chunk, the submission queue can't be full
+    unsigned tail = *ring.sq_tail;
+    unsigned slot = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *) ring.sqes + slot;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = m_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &chunk.iov;
+    sqe->len = 1;
+    sqe->off = chunk.offset;
+    sqe->user_data = index;
+    ring.sq_array[slot] = slot;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do ret = io_uring_enter(ring.fd, 1, 0, 0);
+    while ( ret < 0 && errno == EINTR );
+    if ( ret == 1 ) {
+        chunk.busy = true;
+        return true;
+    }
+
+    // the entry may still be consumed later: wait for the others and stop using io_uring
+    cerr << "io_uring submission failed, the record file uses pwrite" << endl;
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    waitAll();
+    destroyUring();
+    return false;
+}
+
+bool RecordFile::reapUring(bool wait)
+{
+    URING &ring = m_uring;
+    if ( ring.fd < 0 ) return false;
+    if ( wait && io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR ) {
+        cerr << "io_uring wait failed : " << strerror(errno) << endl;
+        return false;
+    }
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++ ) {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *) ring.cqes + ( head & *ring.cq_mask );
+        CHUNK &chunk = m_chunks[cqe->user_data];
+        // short or failed write : the rest is written synchronously, from a block boundary with
+        // O_DIRECT (the block partly written is written again), the whole chunk after an error
+        size_t written = cqe->res > 0 ? cqe->res : 0;
+        if ( m_direct ) written &= ~( (size_t) RECORD_FILE_ALIGNMENT - 1 );
+        if ( written < chunk.iov.iov_len &&
+             !writeSync(chunk.data + written, chunk.iov.iov_len - written, chunk.offset + written) )
+            m_error = true;
+        chunk.busy = false;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+bool RecordFile::setupUring() { return false; }
+void RecordFile::destroyUring() {}
+bool RecordFile::submitUring(unsigned int) { return false; }
+bool RecordFile::reapUring(bool) { return false; }
+
+#endif
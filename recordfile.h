@@ -0,0 +1,102 @@
+#ifndef RECORDFILE_H
+#define RECORDFILE_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define RECORD_FILE_CHUNK_SIZE (1 << 20)          /// Size of the writes, multiple of RECORD_FILE_ALIGNMENT
+#define RECORD_FILE_CHUNKS_NUM 4                  /// Chunks that can be written at the same time
+#define RECORD_FILE_ALIGNMENT 4096                /// Alignment of the offsets, sizes and memory for O_DIRECT
+#define RECORD_FILE_PREALLOCATE_SIZE (64 << 20)   /// Space reserved on the disk each time the file grows
+
+/** How a record file is written. The file falls back to the next mode when the
+ * kernel or the filesystem doesn't support the requested one.
+*/
+enum RECORD_FILE_MODE_T
+{
+    RECORD_FILE_IO_URING,    /// Asynchronous writes with io_uring, bypassing the page cache (O_DIRECT)
+    RECORD_FILE_PWRITE,      /// Synchronous pwrite, bypassing the page cache (O_DIRECT)
+    RECORD_FILE_BUFFERED     /// Synchronous pwrite through the page cache
+};
+
+/**
+ * @brief The RecordFile class
+ * Append only file for the encoded streams. Data is gathered in aligned chunks of
+ * RECORD_FILE_CHUNK_SIZE bytes written at once, and the disk space is reserved ahead with
+ * fallocate so the writes don't have to allocate blocks. Not thread safe: a file is written
+ * by one thread.
+ */
+class RecordFile
+{
+public:
+    RecordFile();
+    ~RecordFile();
+
+    RecordFile(const RecordFile&) = delete;
+    RecordFile& operator=(const RecordFile&) = delete;
+
+    bool open(const std::string &filename, RECORD_FILE_MODE_T mode = RECORD_FILE_IO_URING, bool append = true);
+    bool write(const void *data, size_t size);
+    bool close();
+    bool isOpen() const { return m_fd >= 0; }
+    bool isDirect() const { return m_direct; }
+    RECORD_FILE_MODE_T getMode() const;
+    const char *getBackendName() const;
+    uint64_t getSize() const { return m_size; }
+
+private:
+    struct CHUNK
+    {
+        unsigned char *data;    /// RECORD_FILE_CHUNK_SIZE bytes aligned on RECORD_FILE_ALIGNMENT
+        size_t used;            /// Bytes of data in the chunk
+        bool busy;              /// Being written by io_uring
+        uint64_t offset;        /// Offset of the write in the file
+        struct iovec iov;       /// Written data, must live until the write completes
+    };
+
+    struct URING
+    {
+        int fd;
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        void *sqes;
+        size_t sqes_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        void *cqes;
+    };
+
+    void submit(unsigned int index);
+    bool writeSync(const unsigned char *data, size_t size, uint64_t offset);
+    void reserve(uint64_t end);
+    void waitChunk(unsigned int index);
+    void waitAll();
+
+    bool setupUring();
+    void destroyUring();
+    bool submitUring(unsigned int index);
+    bool reapUring(bool wait);
+
+    int m_fd;
+    bool m_direct;              /// Opened with O_DIRECT
+    bool m_preallocate;         /// fallocate is supported by the filesystem
+    bool m_error;
+    uint64_t m_size;            /// Bytes of data in the file
+    uint64_t m_chunk_offset;    /// Offset of the current chunk in the file
+    uint64_t m_allocated;       /// End of the space reserved by fallocate
+    std::vector<CHUNK> m_chunks;
+    unsigned int m_current;     /// Chunk being filled
+    URING m_uring;
+};
+
+#endif // RECORDFILE_H
@@ -0,0 +1,523 @@
+#include "recordwriter.h"
+#include "mmal/util/mmal_util_params.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <stdio.h>
+
+
+RecordWriter::RecordWriter():
+    m_port(NULL),
+    m_pool(NULL),
+    m_file_mode(RECORD_FILE_IO_URING),
+    m_file_backend(""),
+    m_sink(NULL),
+    m_sink_opened(false),
+    m_container(RECORD_CONTAINER_AUTO),
+    m_mp4(false),
+    m_width(0),
+    m_height(0),
+    m_segmented(false),
+    m_segment(0),
+    m_segment_bytes(0),
+    m_segment_first_pts(MMAL_TIME_UNKNOWN),
+    m_segment_idr_requested(false),
+    m_write_frame_start(true),
+    m_last_pts(MMAL_TIME_UNKNOWN),
+    m_ring_duration(0),
+    m_ring_bytes(0),
+    m_trigger_pre(0),
+    m_trigger_post(0),
+    m_trigger_pending(false),
+    m_event_active(false),
+    m_event_post(0),
+    m_event_end_pts(MMAL_TIME_UNKNOWN),
+    m_policy(RECORD_OVERFLOW_DROP_TO_IDR),
+    m_limit(0),
+    m_head(0),
+    m_tail(0),
+    m_frame_start(true),
+    m_writer_waiting(false),
+    m_dropping(false),
+    m_idr_requested(false),
+    m_running(false),
+    m_high_water_mark(0),
+    m_buffers_written(0),
+    m_bytes_written(0),
+    m_buffers_dropped(0),
+    m_idr_requests(0),
+    m_longest_write_us(0)
+{
+    m_segment_policy.max_bytes = 0;
+    m_segment_policy.max_duration = std::chrono::milliseconds(0);
+    m_segment_limits = m_segment_policy;
+}
+
+RecordWriter::~RecordWriter()
+{
+    stop();
+}
+
+static bool isMp4Filename(const std::string &filename)
+{
+    size_t dot = filename.rfind('.');
+    if ( dot == std::string::npos ) return false;
+    std::string extension = filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == "mp4" || extension == "m4v";
+}
+
+/**
+ * @brief RecordWriter::segmentFilename
+ * Name of a segment: the index is inserted before the extension, video.mp4 gives video_0000.mp4.
+ */
+std::string RecordWriter::segmentFilename(const std::string &filename, unsigned int segment)
+{
+    char index[16];
+    snprintf(index, sizeof(index), "_%04u", segment);
+    size_t dot = filename.rfind('.');
+    size_t slash = filename.rfind('/');
+    if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) ) return filename + index;
+    return filename.substr(0, dot) + index + filename.substr(dot);
+}
+
+/**
+ * @brief RecordWriter::start
+ * Open the file and start the writer thread.
+ * @param filename : file the encoded stream is written to, or name of the segments (see segmentFilename).
+ * Empty to only fill the event ring (see setEventRing and trigger) or the sink.
+ * @param port : encoder output port, refilled with the written buffers
+ * @param pool : pool of the encoder output port, all its buffers can wait in the queue
+ * @return false if the file or the sink can't be opened
+ */
+bool RecordWriter::start(const std::string &filename, MMAL_PORT_T *port, MMAL_POOL_T *pool)
+{
+    stop();
+
+    m_filename = filename;
+    m_mp4 = m_container == RECORD_CONTAINER_MP4 || ( m_container == RECORD_CONTAINER_AUTO && isMp4Filename(filename) );
+    MMAL_VIDEO_FORMAT_T &video = port->format->es->video;
+    m_width = video.crop.width ? video.crop.width : video.width;
+    m_height = video.crop.height ? video.crop.height : video.height;
+    m_segment_limits = m_segment_policy;
+    m_segmented = !filename.empty() && ( m_segment_limits.max_bytes || m_segment_limits.max_duration.count() > 0 );
+    m_segment = 0;
+    m_config.clear();
+    m_write_frame_start = true;
+    m_last_pts = MMAL_TIME_UNKNOWN;
+    m_event_active = false;
+    m_trigger_pending = false;
+    m_motion_active = m_motion_callback;
+    if ( !filename.empty() && !openFile(m_segmented ? segmentFilename(filename, 0) : filename) ) return false;
+    if ( m_sink ) {
+        if ( !m_sink->open() ) {
+            std::cerr << "Unable to open the record sink" << std::endl;
+            closeFile();
+            return false;
+        }
+        m_sink_opened = true;
+    }
+
+    if ( m_ring_duration.count() > 0 ) {
+        size_t capacity = m_ring_bytes;
+        if ( !capacity ) {
+            // room for the duration at 1.5 times the bitrate, plus a GOP margin
+            uint64_t bitrate = port->format->bitrate ? port->format->bitrate : RECORD_EVENT_DEFAULT_BITRATE;
+            capacity = bitrate * m_ring_duration.count() / 8000 * 3 / 2 + ( 1 << 20 );
+        }
+        m_ring.reset(capacity, m_ring_duration);
+    }
+    else m_ring.reset(0, std::chrono::microseconds(0));
+
+    m_port = port;
+    m_pool = pool;
+    m_limit = pool->headers_num;
+    unsigned int size = 1;
+    while ( size < m_limit ) size <<= 1;
+    m_queue.assign(size, NULL);
+    m_head = 0;
+    m_tail = 0;
+    m_frame_start = true;
+    m_dropping = false;
+    m_idr_requested = false;
+    m_high_water_mark = 0;
+    m_buffers_written = 0;
+    m_bytes_written = 0;
+    m_buffers_dropped = 0;
+    m_idr_requests = 0;
+    m_longest_write_us = 0;
+
+    m_running = true;
+    m_thread = std::thread(&RecordWriter::run, this);
+    return true;
+}
+
+/**
+ * @brief RecordWriter::stop
+ * Write the queued buffers, stop the writer thread and close the file and the sink.
+ */
+void RecordWriter::stop()
+{
+    if ( m_thread.joinable() ) {
+        {
+            std::unique_lock<std::mutex> lck ( m_mutex );
+            m_running = false;
+        }
+        m_cv_not_empty.notify_all();
+        m_cv_not_full.notify_all();
+        m_thread.join();
+    }
+    m_running = false;
+
+    // buffers pushed while the thread was leaving
+    while ( MMAL_BUFFER_HEADER_T *buffer = pop() ) write(buffer);
+    closeFile();
+    if ( m_sink_opened ) m_sink->close();
+    m_sink_opened = false;
+    m_motion_active = nullptr;
+    m_event_active = false;
+    m_ring.reset(0, std::chrono::microseconds(0));
+    m_port = NULL;
+    m_pool = NULL;
+}
+
+/**
+ * @brief RecordWriter::push
+ * Queue a buffer for the writer. Called from the encoder callback, which gives up its
+ * reference on the buffer. With RECORD_OVERFLOW_DROP_TO_IDR, the frames are dropped when
+ * the queue leaves less than RECORD_WRITER_PORT_RESERVE buffers to the port, until an IDR
+ * frame arrives once the queue is half empty.
+ * @param buffer : encoder buffer
+ */
+void RecordWriter::push(MMAL_BUFFER_HEADER_T *buffer)
+{
+    bool frame_start = m_frame_start;
+    bool side_info = ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO ) != 0;
+    if ( !side_info )
+        m_frame_start = ( buffer->flags & ( MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG ) ) != 0;
+
+    if ( !m_running || !buffer->length || ( side_info && !m_motion_active ) ) {
+        mmal_buffer_header_release ( buffer );
+        return;
+    }
+
+    unsigned int backlog = queued();
+    unsigned int threshold = m_limit > RECORD_WRITER_PORT_RESERVE ? m_limit - RECORD_WRITER_PORT_RESERVE : m_limit;
+    bool config = ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ) != 0;
+
+    if ( m_policy == RECORD_OVERFLOW_BLOCK ) {
+        if ( backlog >= m_limit ) {
+            std::unique_lock<std::mutex> lck ( m_mutex );
+            while ( m_running && queued() >= m_limit ) m_cv_not_full.wait ( lck );
+            if ( !m_running ) {
+                mmal_buffer_header_release ( buffer );
+                return;
+            }
+        }
+    }
+    else if ( side_info ) {
+        // the motion vectors are only kept when the writer keeps up
+        if ( m_dropping || backlog >= threshold ) {
+            m_buffers_dropped++;
+            mmal_buffer_header_release ( buffer );
+            return;
+        }
+    }
+    else {
+        // the reserve lets the frame being received complete, only whole frames are dropped
+        if ( !m_dropping && backlog >= threshold && frame_start && !config ) {
+            m_dropping = true;
+            m_idr_requested = true;
+            std::cerr << "Record writer late, dropping frames until the next IDR frame" << std::endl;
+        }
+        if ( m_dropping ) {
+            bool idr = frame_start && ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) && backlog < threshold/2;
+            // SPS/PPS are kept when there is room, the IDR frame needs them
+            if ( idr ) m_dropping = false;
+            else if ( !config || backlog >= m_limit ) {
+                m_buffers_dropped++;
+                mmal_buffer_header_release ( buffer );
+                if ( m_idr_requested ) wakeWriter();
+                return;
+            }
+        }
+    }
+
+    unsigned int tail = m_tail.load();
+    m_queue[tail & ( m_queue.size() - 1 )] = buffer;
+    m_tail.store(tail + 1);
+
+    unsigned int depth = backlog + 1;
+    if ( depth > m_high_water_mark ) m_high_water_mark = depth;
+    wakeWriter();
+}
+
+/**
+ * @brief RecordWriter::refillPort
+ * Send the free buffers of the pool to the encoder port.
+ */
+void RecordWriter::refillPort()
+{
+    if ( !m_port || !m_pool ) return;
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ( m_port->is_enabled && ( buffer = mmal_queue_get ( m_pool->queue ) ) != NULL ) {
+        if ( mmal_port_send_buffer ( m_port, buffer ) != MMAL_SUCCESS ) {
+            mmal_buffer_header_release ( buffer );
+            break;
+        }
+    }
+}
+
+/**
+ * @brief RecordWriter::setEventRing
+ * Keep the last encoded data in memory for the event records, applied by the next start().
+ * @param duration : time kept before the events, 0 disables the ring
+ * @param max_bytes : memory of the ring, 0 to size it from the encoder bitrate
+ */
+void RecordWriter::setEventRing(std::chrono::milliseconds duration, size_t max_bytes)
+{
+    m_ring_duration = duration;
+    m_ring_bytes = max_bytes;
+}
+
+/**
+ * @brief RecordWriter::trigger
+ * Start an event record: the writer thread writes the ring from the last IDR frame at least 'pre'
+ * old, then the live stream until 'post' after the trigger. A trigger during an event record
+ * extends it, the file name is then ignored.
+ * @return false if the writer has no event ring
+ */
+bool RecordWriter::trigger(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post)
+{
+    if ( !m_running || !m_ring.isEnabled() ) return false;
+    {
+        std::unique_lock<std::mutex> lck ( m_trigger_mutex );
+        m_trigger_filename = filename;
+        m_trigger_pre = pre;
+        m_trigger_post = post;
+        m_trigger_pending = true;
+    }
+    wakeWriter();
+    return true;
+}
+
+/**
+ * @brief RecordWriter::getStats
+ * @return the counters of the writer since it was started
+ */
+RECORD_WRITER_STATS RecordWriter::getStats() const
+{
+    RECORD_WRITER_STATS stats;
+    stats.capacity = m_limit;
+    stats.queued = queued();
+    stats.high_water_mark = m_high_water_mark;
+    stats.buffers_written = m_buffers_written;
+    stats.bytes_written = m_bytes_written;
+    stats.buffers_dropped = m_buffers_dropped;
+    stats.idr_requests = m_idr_requests;
+    stats.longest_write = std::chrono::microseconds(m_longest_write_us.load());
+    stats.file_backend = m_file_backend;
+    stats.segment = m_segment;
+    stats.event_recording = m_event_active;
+    stats.event_ring_bytes = m_ring.getCapacity();
+    return stats;
+}
+
+void RecordWriter::wakeWriter()
+{
+    // the queue is published before the flag is read and the writer sets the flag before it checks
+    // the queue (both sequentially consistent), so a writer not flagged yet sees the new buffer
+    if ( !m_writer_waiting ) return;
+    // taking the lock makes sure the writer is either before its check or waiting
+    { std::unique_lock<std::mutex> lck ( m_mutex ); }
+    m_cv_not_empty.notify_one();
+}
+
+MMAL_BUFFER_HEADER_T *RecordWriter::pop()
+{
+    unsigned int head = m_head.load();
+    if ( head == m_tail.load() ) return NULL;
+    MMAL_BUFFER_HEADER_T *buffer = m_queue[head & ( m_queue.size() - 1 )];
+    m_head.store(head + 1);
+    return buffer;
+}
+
+bool RecordWriter::openFile(const std::string &filename)
+{
+    if ( !m_file.open(filename, m_file_mode, !m_mp4) ) return false;
+    m_file_backend = m_file.getBackendName();
+    std::cerr << "Record " << filename << " written with " << m_file_backend << ( m_mp4 ? " as fragmented MP4" : "" ) << std::endl;
+    if ( m_mp4 ) m_muxer.start(&m_file, m_width, m_height);
+    m_segment_bytes = 0;
+    m_segment_first_pts = MMAL_TIME_UNKNOWN;
+    m_segment_idr_requested = false;
+    return true;
+}
+
+void RecordWriter::closeFile()
+{
+    if ( m_muxer.isStarted() && !m_muxer.close() )
+        std::cerr << "Unable to write the end of the MP4 record" << std::endl;
+    if ( m_file.isOpen() && !m_file.close() )
+        std::cerr << "The record file is incomplete" << std::endl;
+}
+
+/**
+ * @brief RecordWriter::nextSegment
+ * Close the current segment and open the next one, which starts with the SPS/PPS.
+ * Called before the first buffer of an IDR frame.
+ */
+void RecordWriter::nextSegment()
+{
+    closeFile();
+    m_segment++;
+    if ( openFile(segmentFilename(m_filename, m_segment)) ) writeConfig();
+}
+
+/**
+ * @brief RecordWriter::startEvent
+ * Handle a trigger on the writer thread, between two buffers.
+ */
+void RecordWriter::startEvent()
+{
+    std::string filename;
+    std::chrono::milliseconds pre, post;
+    {
+        std::unique_lock<std::mutex> lck ( m_trigger_mutex );
+        filename = m_trigger_filename;
+        pre = m_trigger_pre;
+        post = m_trigger_post;
+    }
+
+    if ( m_event_active ) {
+        if ( m_last_pts != MMAL_TIME_UNKNOWN && m_event_end_pts != MMAL_TIME_UNKNOWN )
+            m_event_end_pts = std::max(m_event_end_pts, m_last_pts + (int64_t) post.count() * 1000);
+        return;
+    }
+    if ( m_file.isOpen() ) {
+        std::cerr << "A record is already written, the event is ignored" << std::endl;
+        return;
+    }
+
+    m_mp4 = m_container == RECORD_CONTAINER_MP4 || ( m_container == RECORD_CONTAINER_AUTO && isMp4Filename(filename) );
+    if ( !openFile(filename) ) return;
+    writeConfig();
+    uint64_t first = m_ring.findKeyframe(pre);
+    if ( first == m_ring.end() ) requestIdr();
+    for ( uint64_t i = first; i < m_ring.end(); i++ ) {
+        const ENCODED_ENTRY &entry = m_ring.entry(i);
+        writeData(m_ring.data(i), entry.size, entry.flags, entry.pts);
+    }
+    m_event_post = post;
+    m_event_end_pts = m_last_pts != MMAL_TIME_UNKNOWN ? m_last_pts + (int64_t) post.count() * 1000 : MMAL_TIME_UNKNOWN;
+    m_event_active = true;
+    std::cerr << "Event record " << filename << " started " << ( m_ring.end() - first ) << " buffers before the trigger" << std::endl;
+}
+
+void RecordWriter::writeConfig()
+{
+    if ( !m_config.empty() )
+        writeData(m_config.data(), m_config.size(), MMAL_BUFFER_HEADER_FLAG_CONFIG, MMAL_TIME_UNKNOWN);
+}
+
+void RecordWriter::writeData(const unsigned char *data, size_t size, uint32_t flags, int64_t pts)
+{
+    if ( m_muxer.isStarted() ) m_muxer.write ( data, size, flags, pts );
+    else m_file.write ( data, size );
+}
+
+void RecordWriter::requestIdr()
+{
+    if ( !m_port ) return;
+    m_idr_requests++;
+    if ( mmal_port_parameter_set_boolean ( m_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1 ) != MMAL_SUCCESS )
+        std::cerr << "Unable to request an IDR frame" << std::endl;
+}
+
+/**
+ * @brief RecordWriter::write
+ * Write a buffer to the file and give it back to the encoder port.
+ * A segmented record switches to the next file here, before an IDR frame.
+ */
+void RecordWriter::write(MMAL_BUFFER_HEADER_T *buffer)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    mmal_buffer_header_mem_lock ( buffer );
+
+    if ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO ) {
+        if ( m_motion.parse(buffer->data + buffer->offset, buffer->length, m_width, m_height, buffer->pts) ) m_motion_active(m_motion);
+        mmal_buffer_header_mem_unlock ( buffer );
+        mmal_buffer_header_release ( buffer );
+        refillPort();
+        return;
+    }
+
+    bool frame_start = m_write_frame_start;
+    m_write_frame_start = ( buffer->flags & ( MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG ) ) != 0;
+    if ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG )
+        m_config.assign(buffer->data + buffer->offset, buffer->data + buffer->offset + buffer->length);
+    else if ( m_segmented && frame_start ) {
+        bool full = ( m_segment_limits.max_bytes && m_segment_bytes >= m_segment_limits.max_bytes ) ||
+                    ( m_segment_limits.max_duration.count() > 0 && buffer->pts != MMAL_TIME_UNKNOWN &&
+                      m_segment_first_pts != MMAL_TIME_UNKNOWN &&
+                      buffer->pts - m_segment_first_pts >= (int64_t) m_segment_limits.max_duration.count() * 1000 );
+        if ( full && ( buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) ) nextSegment();
+        else if ( full && !m_segment_idr_requested ) {
+            requestIdr();
+            m_segment_idr_requested = true;
+        }
+    }
+    if ( m_segment_first_pts == MMAL_TIME_UNKNOWN && buffer->pts != MMAL_TIME_UNKNOWN )
+        m_segment_first_pts = buffer->pts;
+    if ( buffer->pts != MMAL_TIME_UNKNOWN ) m_last_pts = buffer->pts;
+
+    if ( m_event_active && buffer->pts != MMAL_TIME_UNKNOWN ) {
+        if ( m_event_end_pts == MMAL_TIME_UNKNOWN ) m_event_end_pts = buffer->pts + (int64_t) m_event_post.count() * 1000;
+        else if ( frame_start && buffer->pts >= m_event_end_pts ) {
+            closeFile();
+            m_event_active = false;
+            std::cerr << "Event record finished" << std::endl;
+        }
+    }
+
+    m_ring.push ( buffer->data + buffer->offset, buffer->length, buffer->flags, buffer->pts );
+    if ( m_file.isOpen() ) writeData ( buffer->data + buffer->offset, buffer->length, buffer->flags, buffer->pts );
+    if ( m_sink_opened ) {
+        ENCODED_CHUNK chunk = { buffer->data + buffer->offset, buffer->length, buffer->flags, buffer->pts };
+        m_sink->write ( chunk );
+    }
+    mmal_buffer_header_mem_unlock ( buffer );
+    int64_t duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+    if ( duration > m_longest_write_us ) m_longest_write_us = duration;
+
+    m_segment_bytes += buffer->length;
+    m_buffers_written++;
+    m_bytes_written += buffer->length;
+    mmal_buffer_header_release ( buffer );
+    refillPort();
+}
+
+void RecordWriter::run()
+{
+    while ( true ) {
+        if ( m_idr_requested.exchange(false) ) requestIdr();
+        if ( m_trigger_pending.exchange(false) ) startEvent();
+
+        MMAL_BUFFER_HEADER_T *buffer = pop();
+        if ( buffer ) {
+            write(buffer);
+            if ( m_policy == RECORD_OVERFLOW_BLOCK ) {
+                { std::unique_lock<std::mutex> lck ( m_mutex ); }
+                m_cv_not_full.notify_one();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        if ( !m_running ) break;
+        m_writer_waiting = true;
+        m_cv_not_empty.wait ( lck, [this]{ return queued() != 0 || m_idr_requested || m_trigger_pending || !m_running; } );
+        m_writer_waiting = false;
+    }
+}
@@ -0,0 +1,197 @@
+#ifndef RECORDWRITER_H
+#define RECORDWRITER_H
+
+#include "mmal/mmal.h"
+#include "mmal/mmal_buffer.h"
+#include "recordfile.h"
+#include "mp4muxer.h"
+#include "encodedring.h"
+#include "encodedsink.h"
+#include "motionfield.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <stdint.h>
+
+#define RECORD_WRITER_BUFFERS_NUM 32      /// Extra encoder buffers that can wait for the writer
+#define RECORD_WRITER_PORT_RESERVE 4      /// Encoder buffers kept for the port when dropping to an IDR
+#define RECORD_EVENT_DEFAULT_BITRATE 25000000   /// Bitrate used to size the pre-event ring when the encoder has none
+
+/** What the encoder callback does when the writer is too late
+*/
+enum RECORD_OVERFLOW_POLICY_T
+{
+    RECORD_OVERFLOW_DROP_TO_IDR,   /// Drop the frames until the next IDR frame, which is requested to the encoder
+    RECORD_OVERFLOW_BLOCK          /// Wait for the writer, this stalls the encoder and may drop camera frames
+};
+
+/** Format of the record file
+*/
+enum RECORD_CONTAINER_T
+{
+    RECORD_CONTAINER_AUTO,   /// Fragmented MP4 for the .mp4 and .m4v files, H.264 elementary stream otherwise
+    RECORD_CONTAINER_H264,   /// H.264 elementary stream (Annex B), appended to the file
+    RECORD_CONTAINER_MP4     /// Fragmented MP4, one fragment per GOP, replaces the file
+};
+
+/** When a segmented record switches to the next file. The switch happens on the next IDR frame,
+ * which is requested to the encoder once a limit is reached. A policy without limits records a single file.
+*/
+struct RECORD_SEGMENT_POLICY
+{
+    uint64_t max_bytes;                        /// Size of a segment, 0 for no limit
+    std::chrono::milliseconds max_duration;    /// Duration of a segment (encoder timestamps), 0 for no limit
+};
+
+/** Counters of a record writer
+*/
+struct RECORD_WRITER_STATS
+{
+    unsigned int capacity;                  /// Encoder buffers that can wait for the writer
+    unsigned int queued;                    /// Encoder buffers waiting for the writer
+    unsigned int high_water_mark;           /// Highest number of buffers that waited for the writer
+    uint64_t buffers_written;
+    uint64_t bytes_written;
+    uint64_t buffers_dropped;               /// Buffers dropped by RECORD_OVERFLOW_DROP_TO_IDR
+    uint64_t idr_requests;                  /// IDR frames requested to recover from an overflow or to start a segment
+    unsigned int segment;                   /// Index of the segment being written
+    bool event_recording;                   /// An event record is being written
+    size_t event_ring_bytes;                /// Bytes of encoded data in the pre-event ring
+    std::chrono::microseconds longest_write;  /// Longest write of a buffer to the file
+    const char *file_backend;               /// How the file is written, see RecordFile::getBackendName
+};
+
+/**
+ * @brief The RecordWriter class
+ * Writes the encoder output to a file on a dedicated thread. The encoder callback keeps the
+ * MMAL buffers in a lock-free single producer / single consumer queue instead of writing them,
+ * so a slow write doesn't hold the MMAL callback thread. The callback only takes a lock to wake
+ * the writer when it sleeps on an empty queue, or to wait with RECORD_OVERFLOW_BLOCK. The writer gives each buffer back to
+ * the encoder port once written. The file is a RecordFile, written by chunks of 1 MiB.
+ * With a segment policy, the writer switches to the next file on an IDR frame without
+ * stopping the encoder. Started without file and with an event ring, the writer only keeps
+ * the last seconds in memory until an event record is triggered. A sink set with setSink
+ * receives each buffer too, without copy, on the writer thread. With a motion callback, the
+ * motion vectors of the encoder side information buffers are parsed and given to it on the
+ * writer thread too.
+ * /!\ The encoder port must be disabled before the writer is stopped.
+ */
+class RecordWriter
+{
+public:
+    RecordWriter();
+    ~RecordWriter();
+
+    RecordWriter(const RecordWriter&) = delete;
+    RecordWriter& operator=(const RecordWriter&) = delete;
+
+    bool start(const std::string &filename, MMAL_PORT_T *port, MMAL_POOL_T *pool);
+    void stop();
+    bool isRunning() const { return m_running; }
+
+    void push(MMAL_BUFFER_HEADER_T *buffer);
+    void refillPort();
+
+    void setOverflowPolicy(RECORD_OVERFLOW_POLICY_T policy) { m_policy = policy; }
+    RECORD_OVERFLOW_POLICY_T getOverflowPolicy() const { return m_policy; }
+    void setContainer(RECORD_CONTAINER_T container) { m_container = container; }
+    RECORD_CONTAINER_T getContainer() const { return m_container; }
+    void setSegmentPolicy(const RECORD_SEGMENT_POLICY &policy) { m_segment_policy = policy; }
+    RECORD_SEGMENT_POLICY getSegmentPolicy() const { return m_segment_policy; }
+    static std::string segmentFilename(const std::string &filename, unsigned int segment);
+    void setEventRing(std::chrono::milliseconds duration, size_t max_bytes);
+    bool trigger(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post);
+    bool isEventRecording() const { return m_event_active; }
+    void setFileMode(RECORD_FILE_MODE_T mode) { m_file_mode = mode; }
+    RECORD_FILE_MODE_T getFileMode() const { return m_file_mode; }
+    void setSink(EncodedSink *sink) { m_sink = sink; }
+    EncodedSink *getSink() const { return m_sink; }
+    void setMotionCallback(MOTION_CALLBACK_T callback) { m_motion_callback = callback; }
+    bool hasMotionCallback() const { return (bool) m_motion_callback; }
+    RECORD_WRITER_STATS getStats() const;
+
+private:
+    void run();
+    void write(MMAL_BUFFER_HEADER_T *buffer);
+    bool openFile(const std::string &filename);
+    void closeFile();
+    void writeData(const unsigned char *data, size_t size, uint32_t flags, int64_t pts);
+    void writeConfig();
+    void nextSegment();
+    void startEvent();
+    void requestIdr();
+    MMAL_BUFFER_HEADER_T *pop();
+    unsigned int queued() const { return m_tail.load() - m_head.load(); }
+    void wakeWriter();
+
+    MMAL_PORT_T *m_port;
+    MMAL_POOL_T *m_pool;
+    RecordFile m_file;
+    RECORD_FILE_MODE_T m_file_mode;     /// Mode requested for the next file
+    const char *m_file_backend;
+    EncodedSink *m_sink;                /// Sink of the next record, NULL for none
+    bool m_sink_opened;
+    MOTION_CALLBACK_T m_motion_callback; /// Motion callback of the next record
+    MOTION_CALLBACK_T m_motion_active;   /// Motion callback of the current record
+    MotionField m_motion;
+    RECORD_CONTAINER_T m_container;     /// Container requested for the next file
+    Mp4Muxer m_muxer;                   /// Started when the file is a MP4
+    bool m_mp4;
+    unsigned int m_width;
+    unsigned int m_height;
+
+    RECORD_SEGMENT_POLICY m_segment_policy;     /// Policy requested for the next record
+    bool m_segmented;                           /// The current record is segmented
+    RECORD_SEGMENT_POLICY m_segment_limits;     /// Policy of the current record
+    std::string m_filename;                     /// File name given to start()
+    std::atomic<unsigned int> m_segment;
+    uint64_t m_segment_bytes;
+    int64_t m_segment_first_pts;
+    bool m_segment_idr_requested;
+    bool m_write_frame_start;                   /// The next written buffer starts a frame
+    std::vector<unsigned char> m_config;        /// Last SPS/PPS, written again at the start of each segment
+    int64_t m_last_pts;                         /// Last known pts written
+
+    std::chrono::milliseconds m_ring_duration;  /// Pre-event ring requested for the next record
+    size_t m_ring_bytes;
+    EncodedRing m_ring;
+    std::mutex m_trigger_mutex;                 /// Protects the trigger request
+    std::string m_trigger_filename;
+    std::chrono::milliseconds m_trigger_pre;
+    std::chrono::milliseconds m_trigger_post;
+    std::atomic<bool> m_trigger_pending;
+    std::atomic<bool> m_event_active;
+    std::chrono::milliseconds m_event_post;
+    int64_t m_event_end_pts;                    /// The event record stops on the first frame after it
+    std::atomic<RECORD_OVERFLOW_POLICY_T> m_policy;
+
+    std::vector<MMAL_BUFFER_HEADER_T *> m_queue;    /// Ring of buffers, its size is a power of 2
+    unsigned int m_limit;                           /// Buffers that can be queued
+    std::atomic<unsigned int> m_head;               /// Next buffer to write, moved by the writer
+    std::atomic<unsigned int> m_tail;               /// Next free slot, moved by the encoder callback
+
+    bool m_frame_start;                   /// The next buffer starts a frame, frames are dropped whole
+    bool m_dropping;                      /// Dropping buffers until an IDR frame
+    std::atomic<bool> m_idr_requested;    /// The writer must request an IDR frame
+
+    std::mutex m_mutex;                   /// Only used to sleep and wake up
+    std::atomic<bool> m_writer_waiting;   /// The writer sleeps on m_cv_not_empty, set before its last check of the queue
+    std::condition_variable m_cv_not_empty;
+    std::condition_variable m_cv_not_full;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    std::atomic<unsigned int> m_high_water_mark;
+    std::atomic<uint64_t> m_buffers_written;
+    std::atomic<uint64_t> m_bytes_written;
+    std::atomic<uint64_t> m_buffers_dropped;
+    std::atomic<uint64_t> m_idr_requests;
+    std::atomic<int64_t> m_longest_write_us;
+};
+
+#endif // RECORDWRITER_H
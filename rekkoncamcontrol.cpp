@@ -66,7 +66,8 @@ void RekkonCamControl::setStillPreviewSize(unsigned int width, unsigned int heig
  * The following formats are supported:
  * MMAL_ENCODING_I420 (YUV420),
  * MMAL_ENCODING_BGR24 (BGR 8 bits per canal),
- * MMAL_ENCODING_BGR24 (BGR 8 bits per canal)
+ * MMAL_ENCODING_BGR24 (BGR 8 bits per canal),
+ * MMAL_ENCODING_GREY (Y plane of the YUV420 image, no conversion and no chroma copy)
  */
 void RekkonCamControl::setStillPreviewImageFormat(int mmal_image_format)
 {
@@ -115,7 +116,8 @@ void RekkonCamControl::setVideoPreviewSize(unsigned int width, unsigned int heig
  * The following formats are supported:
  * MMAL_ENCODING_I420 (YUV420),
  * MMAL_ENCODING_BGR24 (BGR 8 bits per canal),
- * MMAL_ENCODING_BGR24 (BGR 8 bits per canal)
+ * MMAL_ENCODING_BGR24 (BGR 8 bits per canal),
+ * MMAL_ENCODING_GREY (Y plane of the YUV420 image, no conversion and no chroma copy)
  */
 void RekkonCamControl::setVideoPreviewImageFormat(int mmal_image_format)
 {
@@ -157,6 +159,38 @@ bool RekkonCamControl::grab()
     return m_mmal_instance->grab();
 }
 
+/**
+ * @brief RekkonCamControl::grab
+ * @param timeout (std::chrono::milliseconds) Maximum wait, GRAB_INFINITE to wait without limit.
+ * Same as grab() but gives up after 'timeout'.
+ * @return GRAB_SUCCESS if an image is grabbed, GRAB_TIMEOUT, GRAB_CANCELLED if cancelGrab() was
+ * called or the preview stopped, GRAB_NOT_OPENED if no preview is opened.
+ */
+GRAB_STATUS_T RekkonCamControl::grab(std::chrono::milliseconds timeout)
+{
+    return m_mmal_instance->grab(timeout);
+}
+
+/**
+ * @brief RekkonCamControl::tryGrab
+ * Grab an image only if one is already available, never waits.
+ * @return GRAB_SUCCESS if an image is grabbed, GRAB_NO_FRAME otherwise (try again later),
+ * GRAB_NOT_OPENED if no preview is opened.
+ */
+GRAB_STATUS_T RekkonCamControl::tryGrab()
+{
+    return m_mmal_instance->tryGrab();
+}
+
+/**
+ * @brief RekkonCamControl::cancelGrab
+ * Wake up every thread waiting in grab() or grabLease(). They return GRAB_CANCELLED.
+ */
+void RekkonCamControl::cancelGrab()
+{
+    m_mmal_instance->cancelGrab();
+}
+
 /**
  * @brief RekkonCamControl::retrieve
  * @param data (unsigned char *) Pointer to an instantiated array of char or uint8_t
@@ -168,6 +202,215 @@ void RekkonCamControl::retrieve(unsigned char *data)
     m_mmal_instance->retrieve(data);
 }
 
+/**
+ * @brief RekkonCamControl::retrieve
+ * @param data (unsigned char *) Pointer to an instantiated array of char or uint8_t
+ * @param stride Size in bytes of a line of 'data' (of the Y plane for I420, the U and V planes use half of it).
+ * Same as retrieve(data) for an array whose lines are padded. Planes whose stride matches the
+ * preview are copied at once.
+ */
+void RekkonCamControl::retrieve(unsigned char *data, unsigned int stride)
+{
+    m_mmal_instance->retrieve(data, stride);
+}
+
+/**
+ * @brief RekkonCamControl::grabLease
+ * Wait for the next preview image and give direct access to its buffer, without any copy.
+ * Works for both Video and Still preview.
+ * The buffer is given back to the camera when the returned lease is destroyed or released.
+ * /!\ Release all leases before stopping the preview.
+ * @return a lease on the image, invalid if no preview is opened.
+ */
+FrameLease RekkonCamControl::grabLease()
+{
+    return m_mmal_instance->grabLease();
+}
+
+/**
+ * @brief RekkonCamControl::grabLease
+ * @param lease (FrameLease) Filled with the image on success.
+ * @param timeout (std::chrono::milliseconds) Maximum wait, GRAB_INFINITE to wait without limit.
+ * Same as grabLease() but gives up after 'timeout'.
+ * @return see grab(timeout).
+ */
+GRAB_STATUS_T RekkonCamControl::grabLease(FrameLease &lease, std::chrono::milliseconds timeout)
+{
+    return m_mmal_instance->grabLease(lease, timeout);
+}
+
+/**
+ * @brief RekkonCamControl::retrieveBatch
+ * @param count Number of consecutive preview images to collect.
+ * @param data (unsigned char *) Array of 'count' times the size of a retrieve() image.
+ * @param layout (BATCH_LAYOUT_T) BATCH_LAYOUT_NHWC keeps the channels interleaved,
+ * BATCH_LAYOUT_NCHW stores one plane per channel (RGB / BGR formats).
+ * @param timestamps (std::vector<int64_t> *) If not NULL, filled with the timestamp of each image (microseconds).
+ * @param timeout (std::chrono::milliseconds) Maximum wait for each image.
+ * Collect the next 'count' preview images into 'data', without line padding.
+ * The frames wait for the copy in a ring of up to 'count' frames, limited by the spare preview buffers.
+ * @return GRAB_SUCCESS if all the images are collected, GRAB_FRAMES_LOST if they are all collected but frames
+ * were lost between them (the copy was too slow, see the timestamps), see grab(timeout) otherwise.
+ */
+GRAB_STATUS_T RekkonCamControl::retrieveBatch(unsigned int count, unsigned char *data, BATCH_LAYOUT_T layout,
+                                              std::vector<int64_t> *timestamps, std::chrono::milliseconds timeout)
+{
+    return m_mmal_instance->retrieveBatch(count, data, layout, timestamps, timeout);
+}
+
+/**
+ * @brief RekkonCamControl::setPreviewGrabMode
+ * @param mode (PREVIEW_GRAB_MODE_T)
+ * PREVIEW_GRAB_NEXT_FRAME (default): grab() and grabLease() wait for the next image of the preview.
+ * PREVIEW_GRAB_LATEST_FRAME: the newest image is kept in a mailbox and grab() and grabLease()
+ * return it immediately. Use getGrabbedFrameAge() or FrameLease::getAge() to know how old it is.
+ */
+void RekkonCamControl::setPreviewGrabMode(PREVIEW_GRAB_MODE_T mode)
+{
+    m_mmal_instance->setPreviewGrabMode(mode);
+}
+
+/**
+ * @brief RekkonCamControl::getGrabbedFrameAge
+ * @return the time elapsed since the camera delivered the image of the last grab().
+ */
+std::chrono::microseconds RekkonCamControl::getGrabbedFrameAge()
+{
+    return m_mmal_instance->getGrabbedFrameAge();
+}
+
+/**
+ * @brief RekkonCamControl::getFrameInfo
+ * Metadata of the image of the last grab:
+ * pts (camera time since the first image of the preview, in microseconds), MMAL buffer flags,
+ * sequence number (gaps are images lost by the camera), images not grabbed since the previous grab,
+ * host time of reception and latency between the capture and the reception.
+ * @return FRAME_INFO of the grabbed image.
+ */
+FRAME_INFO RekkonCamControl::getFrameInfo()
+{
+    return m_mmal_instance->getFrameInfo();
+}
+
+/**
+ * @brief RekkonCamControl::subscribeFrames
+ * @param callback (FRAME_CALLBACK_T) Function called with each preview image.
+ * @param policy (FRAME_DELIVERY_POLICY_T) Behaviour when the subscriber is late:
+ * FRAME_DELIVERY_DROP_OLDEST, FRAME_DELIVERY_DROP_NEWEST or FRAME_DELIVERY_BLOCK (waits up to FRAME_SUBSCRIBER_BLOCK_TIMEOUT_MS, then drops).
+ * A blocking subscriber gets each image after the others, its wait only delays the preview callback.
+ * @param queue_depth Number of images that can wait for the subscriber.
+ * Push every preview image to 'callback', called on a thread dedicated to this subscriber.
+ * Images are not copied: the lease given to the callback is released when the callback returns,
+ * unless it is moved elsewhere.
+ * @return the id of the subscriber.
+ */
+int RekkonCamControl::subscribeFrames(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth)
+{
+    return m_mmal_instance->subscribeFrames(callback, policy, queue_depth);
+}
+
+/**
+ * @brief RekkonCamControl::unsubscribeFrames
+ * @param subscriber_id Id returned by subscribeFrames.
+ * Stop pushing preview images to this subscriber.
+ * /!\ Do not call from the callback of the subscriber itself.
+ */
+void RekkonCamControl::unsubscribeFrames(int subscriber_id)
+{
+    m_mmal_instance->unsubscribeFrames(subscriber_id);
+}
+
+/**
+ * @brief RekkonCamControl::setCpuColorConversion
+ * @param enable (bool) true to convert the preview images on the CPU.
+ * @param matrix (COLOR_MATRIX_T) COLOR_MATRIX_BT601 or COLOR_MATRIX_BT709.
+ * @param range (COLOR_RANGE_T) COLOR_RANGE_FULL or COLOR_RANGE_LIMITED.
+ * The preview port outputs I420 and retrieve()/retrieveBatch() convert it to the preview
+ * image format (RGB24, BGR24, RGBA or BGRA) with NEON instructions.
+ * This avoids the ISP RGB conversion, which limits the RGB preview to about 1 MP at 30 fps.
+ * Leases and subscribers receive the I420 images.
+ * /!\ Applied at the next start of a preview.
+ */
+void RekkonCamControl::setCpuColorConversion(bool enable, COLOR_MATRIX_T matrix, COLOR_RANGE_T range)
+{
+    m_mmal_instance->setCpuColorConversion(enable, matrix, range);
+}
+
+/**
+ * @brief RekkonCamControl::startPreviewStream
+ * @param name (string) Name of the stream, used by the other stream functions.
+ * @param width (unsigned int) Width of the stream images.
+ * @param height (unsigned int) Height of the stream images.
+ * @param mmal_image_format (int) Format of the stream images, see @setVideoPreviewImageFormat.
+ * Open an additional video preview with its own resolution and format. It is resized by a
+ * dedicated ISP in parallel of the Video preview and Video record, so no CPU is used for the resize.
+ * Up to 2 streams can be opened (free outputs of the video splitter).
+ * @return true if the stream is opened.
+ */
+bool RekkonCamControl::startPreviewStream(const std::string &name, unsigned int width, unsigned int height, int mmal_image_format)
+{
+    return m_mmal_instance->startPreviewStream(name, width, height, mmal_image_format);
+}
+
+/**
+ * @brief RekkonCamControl::stopPreviewStream
+ * @param name (string) Name of the stream.
+ * Close a stream opened by startPreviewStream.
+ * /!\ Leases on the stream images must be released before.
+ */
+void RekkonCamControl::stopPreviewStream(const std::string &name)
+{
+    m_mmal_instance->stopPreviewStream(name);
+}
+
+/**
+ * @brief RekkonCamControl::grabStream
+ * @param name (string) Name of the stream.
+ * @param timeout (std::chrono::milliseconds) Maximum wait, GRAB_INFINITE by default.
+ * Same as grab() for a preview stream.
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME, GRAB_CANCELLED or GRAB_NOT_OPENED.
+ */
+GRAB_STATUS_T RekkonCamControl::grabStream(const std::string &name, std::chrono::milliseconds timeout)
+{
+    return m_mmal_instance->grabStream(name, timeout);
+}
+
+/**
+ * @brief RekkonCamControl::retrieveStream
+ * @param name (string) Name of the stream.
+ * @param data (unsigned char*) Array filled with the image of the last grabStream.
+ * @param stride (unsigned int) Line stride of data in bytes, 0 for lines without padding.
+ * Same as retrieve() for a preview stream.
+ */
+void RekkonCamControl::retrieveStream(const std::string &name, unsigned char *data, unsigned int stride)
+{
+    m_mmal_instance->retrieveStream(name, data, stride);
+}
+
+/**
+ * @brief RekkonCamControl::grabStreamLease
+ * @param name (string) Name of the stream.
+ * @param lease (FrameLease&) Filled with the image.
+ * @param timeout (std::chrono::milliseconds) Maximum wait, GRAB_INFINITE by default.
+ * Same as grabLease() for a preview stream.
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME, GRAB_CANCELLED or GRAB_NOT_OPENED.
+ */
+GRAB_STATUS_T RekkonCamControl::grabStreamLease(const std::string &name, FrameLease &lease, std::chrono::milliseconds timeout)
+{
+    return m_mmal_instance->grabStreamLease(name, lease, timeout);
+}
+
+/**
+ * @brief RekkonCamControl::getStreamFrameInfo
+ * @param name (string) Name of the stream.
+ * Same as getFrameInfo() for a preview stream.
+ * @return FRAME_INFO of the image of the last grabStream.
+ */
+FRAME_INFO RekkonCamControl::getStreamFrameInfo(const std::string &name)
+{
+    return m_mmal_instance->getStreamFrameInfo(name);
+}
+
 // --------------------------------------------------
 // Controls on Video Record output
 // --------------------------------------------------
@@ -188,6 +431,8 @@ void RekkonCamControl::setVideoRecordSize(unsigned int width, unsigned int heigh
  * @brief RekkonCamControl::startVideoRecord
  * @param filename (string)
  * Create the video recording components and then record encoded frames into "filename" file.
+ * A .mp4 or .m4v file is written as fragmented MP4 and replaced, other files get the H.264
+ * elementary stream appended (see setRecordContainer).
  * /!\ Do not work if still (image) components are enabled.
  */
 void RekkonCamControl::startVideoRecord(string filename)
@@ -195,6 +440,28 @@ void RekkonCamControl::startVideoRecord(string filename)
     m_mmal_instance->startVideoRecord(filename);
 }
 
+/**
+ * @brief RekkonCamControl::startVideoRecord
+ * @param sink (EncodedSink *) Receiver of the H.264 stream: FileSink, MemoryRingSink, CallbackSink, SocketSink
+ * or any EncodedSink. Each encoder buffer is given to the sink without copy, from the record writer thread.
+ * /!\ The sink must live until stopVideoRecord.
+ */
+void RekkonCamControl::startVideoRecord(EncodedSink *sink)
+{
+    m_mmal_instance->startVideoRecord(sink);
+}
+
+/**
+ * @brief RekkonCamControl::startVideoRecord
+ * @param filename (string) File of the record, see startVideoRecord.
+ * @param sink (EncodedSink *) Receiver of the same H.264 stream, for instance a StreamServer serving it live.
+ * /!\ The sink must live until stopVideoRecord.
+ */
+void RekkonCamControl::startVideoRecord(string filename, EncodedSink *sink)
+{
+    m_mmal_instance->startVideoRecord(filename, sink);
+}
+
 /**
  * @brief RekkonCamControl::stopVideoRecord
  * Stop and destroy video recording related components.
@@ -204,6 +471,217 @@ void RekkonCamControl::stopVideoRecord()
     m_mmal_instance->stopVideoRecord();
 }
 
+/**
+ * @brief RekkonCamControl::startEventRing
+ * @param duration (std::chrono::milliseconds) Encoded video kept in memory before the events.
+ * @param max_bytes (size_t) Memory of the ring, 0 to size it from the encoder bitrate.
+ * Run the video encoder without writing any file, the last 'duration' of video is kept in a memory ring
+ * indexed on the IDR frames. Use triggerEventRecord to write an event and stopVideoRecord to stop.
+ * /!\ Stops the current video record.
+ */
+void RekkonCamControl::startEventRing(std::chrono::milliseconds duration, size_t max_bytes)
+{
+    m_mmal_instance->startEventRing(duration, max_bytes);
+}
+
+/**
+ * @brief RekkonCamControl::triggerEventRecord
+ * @param filename (string) File of the event, .mp4 for a fragmented MP4 (see setRecordContainer).
+ * @param pre (std::chrono::milliseconds) Video written before the trigger, from the last IDR frame at least that old
+ * (or the oldest one in the ring).
+ * @param post (std::chrono::milliseconds) Video written after the trigger.
+ * Write the memory ring then the live video to 'filename'. A trigger during an event record extends it.
+ * @return false if the event ring is not started.
+ */
+bool RekkonCamControl::triggerEventRecord(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post)
+{
+    return m_mmal_instance->triggerEventRecord(filename, pre, post);
+}
+
+/**
+ * @brief RekkonCamControl::setRecordOverflowPolicy
+ * @param policy (RECORD_OVERFLOW_POLICY_T) Behaviour when the file writes are too slow for the encoder:
+ * RECORD_OVERFLOW_DROP_TO_IDR (default) drops the frames and requests an IDR frame to resume cleanly,
+ * RECORD_OVERFLOW_BLOCK waits for the writes, which stalls the encoder and may drop camera frames.
+ * Encoded frames are written to the file by a dedicated thread, not by the MMAL callback.
+ */
+void RekkonCamControl::setRecordOverflowPolicy(RECORD_OVERFLOW_POLICY_T policy)
+{
+    m_mmal_instance->setRecordOverflowPolicy(policy);
+}
+
+/**
+ * @brief RekkonCamControl::getRecordWriterStats
+ * Counters of the current (or last) video record: queue depth and high water mark,
+ * buffers and bytes written, buffers dropped, IDR frames requested and longest file write.
+ * @return RECORD_WRITER_STATS of the record writer.
+ */
+RECORD_WRITER_STATS RekkonCamControl::getRecordWriterStats()
+{
+    return m_mmal_instance->getRecordWriterStats();
+}
+
+/**
+ * @brief RekkonCamControl::setRecordContainer
+ * @param container (RECORD_CONTAINER_T) Format of the next video records:
+ * RECORD_CONTAINER_AUTO (default) chooses from the file extension, RECORD_CONTAINER_H264 appends the
+ * H.264 elementary stream, RECORD_CONTAINER_MP4 writes a fragmented MP4 with one fragment per GOP.
+ * The MP4 files are timestamped with the camera pts, playable while recorded, seekable (mfra index)
+ * and keep all the fragments written before a crash.
+ */
+void RekkonCamControl::setRecordContainer(RECORD_CONTAINER_T container)
+{
+    m_mmal_instance->setRecordContainer(container);
+}
+
+/**
+ * @brief RekkonCamControl::setRecordSegmentPolicy
+ * @param max_bytes (uint64_t) Size of a segment, 0 for no limit.
+ * @param max_duration (std::chrono::milliseconds) Duration of a segment, 0 for no limit.
+ * Split the next video records in several files: once a limit is reached, an IDR frame is requested
+ * and the record switches to the next file on it, without stopping the encoder so no frame is lost.
+ * startVideoRecord("video.mp4") then writes video_0000.mp4, video_0001.mp4... each one playable alone.
+ * Both limits to 0 records a single file (default).
+ */
+void RekkonCamControl::setRecordSegmentPolicy(uint64_t max_bytes, std::chrono::milliseconds max_duration)
+{
+    RECORD_SEGMENT_POLICY policy;
+    policy.max_bytes = max_bytes;
+    policy.max_duration = max_duration;
+    m_mmal_instance->setRecordSegmentPolicy(policy);
+}
+
+/**
+ * @brief RekkonCamControl::setRecordFileMode
+ * @param mode (RECORD_FILE_MODE_T) How the next video records are written:
+ * RECORD_FILE_IO_URING (default) asynchronous io_uring writes with O_DIRECT,
+ * RECORD_FILE_PWRITE synchronous writes with O_DIRECT, RECORD_FILE_BUFFERED writes through the page cache.
+ * The file is written by chunks of 1 MiB and its space reserved with fallocate. When the kernel or the
+ * filesystem doesn't support the mode (O_DIRECT on tmpfs), the record uses the next one:
+ * getRecordWriterStats().file_backend tells which.
+ */
+void RekkonCamControl::setRecordFileMode(RECORD_FILE_MODE_T mode)
+{
+    m_mmal_instance->setRecordFileMode(mode);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoMotionCallback
+ * @param callback (MOTION_CALLBACK_T) Function called with the motion vectors of each encoded frame
+ * (dx, dy and SAD of each 16x16 macroblock), empty function to disable them.
+ * Applied when the next video record starts: the encoder then adds its motion vectors to the stream,
+ * for a motion detection without CPU optical flow. The callback runs on the record writer thread,
+ * a slow callback delays the record.
+ */
+void RekkonCamControl::setVideoMotionCallback(MOTION_CALLBACK_T callback)
+{
+    m_mmal_instance->setVideoMotionCallback(callback);
+}
+
+/**
+ * @brief RekkonCamControl::setH264EncoderConfig
+ * @param config (H264_ENCODER_CONFIG) Settings of the H.264 encoder: bitrate, profile, level, intra period,
+ * rate control, quantisation bounds, inline headers, low latency, separate NAL buffers and slices.
+ * The zero values keep the encoder defaults.
+ * /!\ Applied when the next video record starts.
+ */
+void RekkonCamControl::setH264EncoderConfig(const H264_ENCODER_CONFIG &config)
+{
+    m_mmal_instance->setH264EncoderConfig(config);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoBitrate
+ * @param bitrate (unsigned int) Bitrate of the H.264 encoder in bits per second, changed without restarting
+ * a running video record. Clamped to 25 Mbit/s up to the level 4.
+ * @return false if the running encoder refused the bitrate
+ */
+bool RekkonCamControl::setVideoBitrate(unsigned int bitrate)
+{
+    return m_mmal_instance->setVideoBitrate(bitrate);
+}
+
+/**
+ * @brief RekkonCamControl::startVideoSubstream
+ * @param filename (string) File of the substream, .mp4 for a fragmented MP4 (see setVideoSubstreamContainer).
+ * @param width (unsigned int) Width of the substream
+ * @param height (unsigned int) Height of the substream
+ * Record a second, downscaled video at the same time as the main video record (for instance a 640x480 live
+ * stream beside a 1920x1080 archive). The GPU resizes a splitter output and encodes it with its own encoder,
+ * configured by setVideoSubstreamEncoderConfig (2 Mbit/s by default). It runs with or without startVideoRecord.
+ * /!\ The substream uses a splitter output, shared with the preview streams. The two encoders share the
+ * hardware encoder throughput: the main record and the substream together must stay within it.
+ * @return false if no splitter output is free or the components can't be set up.
+ */
+bool RekkonCamControl::startVideoSubstream(const std::string &filename, unsigned int width, unsigned int height)
+{
+    return m_mmal_instance->startVideoSubstream(filename, width, height);
+}
+
+/**
+ * @brief RekkonCamControl::startVideoSubstream
+ * @param sink (EncodedSink *) Receiver of the H.264 substream, see startVideoRecord.
+ * /!\ The sink must live until stopVideoSubstream.
+ */
+bool RekkonCamControl::startVideoSubstream(EncodedSink *sink, unsigned int width, unsigned int height)
+{
+    return m_mmal_instance->startVideoSubstream(sink, width, height);
+}
+
+void RekkonCamControl::stopVideoSubstream()
+{
+    m_mmal_instance->stopVideoSubstream();
+}
+
+/**
+ * @brief RekkonCamControl::setVideoSubstreamEncoderConfig
+ * @param config (H264_ENCODER_CONFIG) Settings of the substream encoder, see setH264EncoderConfig.
+ * /!\ Applied when the next substream starts.
+ */
+void RekkonCamControl::setVideoSubstreamEncoderConfig(const H264_ENCODER_CONFIG &config)
+{
+    m_mmal_instance->setVideoSubstreamEncoderConfig(config);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoSubstreamBitrate
+ * @param bitrate (unsigned int) Same as setVideoBitrate for the substream encoder.
+ */
+bool RekkonCamControl::setVideoSubstreamBitrate(unsigned int bitrate)
+{
+    return m_mmal_instance->setVideoSubstreamBitrate(bitrate);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoSubstreamContainer
+ * @param container (RECORD_CONTAINER_T) Same as setRecordContainer for the substream.
+ */
+void RekkonCamControl::setVideoSubstreamContainer(RECORD_CONTAINER_T container)
+{
+    m_mmal_instance->setVideoSubstreamContainer(container);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoSubstreamSegmentPolicy
+ * Same as setRecordSegmentPolicy for the substream.
+ */
+void RekkonCamControl::setVideoSubstreamSegmentPolicy(uint64_t max_bytes, std::chrono::milliseconds max_duration)
+{
+    RECORD_SEGMENT_POLICY policy;
+    policy.max_bytes = max_bytes;
+    policy.max_duration = max_duration;
+    m_mmal_instance->setVideoSubstreamSegmentPolicy(policy);
+}
+
+/**
+ * @brief RekkonCamControl::setVideoSubstreamMotionCallback
+ * Same as setVideoMotionCallback for the substream, the grid then has the size of the substream.
+ */
+void RekkonCamControl::setVideoSubstreamMotionCallback(MOTION_CALLBACK_T callback)
+{
+    m_mmal_instance->setVideoSubstreamMotionCallback(callback);
+}
+
 // --------------------------------------------------
 // Controls on Still Record output
 // --------------------------------------------------
@@ -231,6 +709,87 @@ void RekkonCamControl::startStillRecord(string filename)
     m_mmal_instance->startStillRecord(filename);
 }
 
+/**
+ * @brief RekkonCamControl::startStillRecord
+ * @param sink (EncodedSink *) Receiver of the encoded image, see startVideoRecord. Called from the MMAL callback.
+ * Same as startStillRecord with a file, returns once the image is given to the sink.
+ */
+void RekkonCamControl::startStillRecord(EncodedSink *sink)
+{
+    m_mmal_instance->startStillRecord(sink);
+}
+
+/**
+ * @brief RekkonCamControl::captureStillAsync
+ * @param sink (EncodedSink *) Receiver of the encoded image.
+ * @return (std::future<STILL_CAPTURE_RESULT>) Ready once the image is complete and the sink closed, with its
+ * status, size, pts and the request and completion times.
+ * Start a still capture without waiting for it, for instance to set the next exposure or process the previous
+ * image meanwhile. A capture started while another one is pending returns STILL_CAPTURE_BUSY.
+ * /!\ The sink must live until the future is ready. It is written and closed from the MMAL callback thread.
+ */
+std::future<STILL_CAPTURE_RESULT> RekkonCamControl::captureStillAsync(EncodedSink *sink)
+{
+    return m_mmal_instance->captureStillAsync(sink);
+}
+
+/**
+ * @brief RekkonCamControl::captureStillAt
+ * @param sink (EncodedSink *) Receiver of the encoded image.
+ * @param trigger (int64_t) Instant of the trigger in the camera clock, stamped with getCameraTime() as soon as
+ * the trigger is received.
+ * @param look_back (std::chrono::microseconds) Oldest trigger still captured, an older one gives STILL_CAPTURE_MISSED.
+ * @return (std::future<STILL_CAPTURE_RESULT>) Same as captureStillAsync, result.pts - result.trigger tells how far
+ * the image is from the trigger.
+ * With setZeroShutterLag(true) the camera gives the last frame it captured instead of exposing a new one after a
+ * sensor mode switch. /!\ The frame is chosen by the camera firmware, not from the trigger: the image is the one
+ * of the trigger when the request follows it within a frame.
+ */
+std::future<STILL_CAPTURE_RESULT> RekkonCamControl::captureStillAt(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back)
+{
+    return m_mmal_instance->captureStillAt(sink, trigger, look_back);
+}
+
+/**
+ * @brief RekkonCamControl::setZeroShutterLag
+ * @param enable (bool) Create the camera in zero shutter lag mode (false by default): the sensor stays in its
+ * still mode and keeps capturing, so a still capture doesn't wait for a mode switch and an exposure.
+ * /!\ Applied when the camera is opened: call it before open(), or release() and open() after it.
+ * Best used with setStillPipelinePersistent(true).
+ */
+void RekkonCamControl::setZeroShutterLag(bool enable)
+{
+    m_mmal_instance->setZeroShutterLag(enable);
+}
+
+/**
+ * @brief RekkonCamControl::captureBurst
+ * @param count (unsigned int) Images to capture.
+ * @param interval (std::chrono::milliseconds) Time between the starts of two captures, 0 for as fast as possible.
+ * @param sink_factory (STILL_SINK_FACTORY_T) Gives the sink of the image 'index', for instance
+ * [](unsigned int i) { return std::unique_ptr<EncodedSink>(new FileSink("burst_" + std::to_string(i) + ".jpg")); }
+ * @return (std::vector<STILL_CAPTURE_RESULT>) Result of each image, once all are written.
+ * Capture several still images with the camera in burst mode: the sensor stays in its still mode and the JPEG
+ * encoder is built once, each image is written by a background thread while the next one is exposed.
+ * /!\ The sink factory and the sinks are used from the writer thread.
+ */
+std::vector<STILL_CAPTURE_RESULT> RekkonCamControl::captureBurst(unsigned int count, std::chrono::milliseconds interval, STILL_SINK_FACTORY_T sink_factory)
+{
+    return m_mmal_instance->captureBurst(count, interval, sink_factory);
+}
+
+/**
+ * @brief RekkonCamControl::setStillPipelinePersistent
+ * @param persistent (bool) Keep the JPEG encoder built and connected between the captures (false by default).
+ * Each startStillRecord then only sets the file or sink and triggers the capture, the shot to shot time
+ * drops to the sensor mode switch. The pipeline is built by this call and rebuilt by setStillRecordSize.
+ * /!\ The still port and the encoder memory stay allocated until persistent is set back to false.
+ */
+void RekkonCamControl::setStillPipelinePersistent(bool persistent)
+{
+    m_mmal_instance->setStillPipelinePersistent(persistent);
+}
+
 // --------------------------------------------------
 // Controls on Camera components settings
 // --------------------------------------------------
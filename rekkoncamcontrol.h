@@ -33,7 +33,32 @@ public:
     void startVideoPreview();
     void stopVideoPreview();
     bool grab();
+    GRAB_STATUS_T grab(std::chrono::milliseconds timeout);
+    GRAB_STATUS_T tryGrab();
+    void cancelGrab();
     void retrieve(unsigned char *data);
+    void retrieve(unsigned char *data, unsigned int stride);
+    FrameLease grabLease();
+    GRAB_STATUS_T grabLease(FrameLease &lease, std::chrono::milliseconds timeout);
+    GRAB_STATUS_T retrieveBatch(unsigned int count, unsigned char *data, BATCH_LAYOUT_T layout,
+                                std::vector<int64_t> *timestamps = NULL, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    void setPreviewGrabMode(PREVIEW_GRAB_MODE_T mode);
+    PREVIEW_GRAB_MODE_T getPreviewGrabMode() { return m_mmal_instance->getPreviewGrabMode();};
+    std::chrono::microseconds getGrabbedFrameAge();
+    FRAME_INFO getFrameInfo();
+    int subscribeFrames(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth = FRAME_SUBSCRIBER_QUEUE_DEPTH);
+    void unsubscribeFrames(int subscriber_id);
+    void setCpuColorConversion(bool enable, COLOR_MATRIX_T matrix = COLOR_MATRIX_BT601, COLOR_RANGE_T range = COLOR_RANGE_FULL);
+    bool isCpuColorConversionEnabled() { return m_mmal_instance->isCpuColorConversionEnabled();};
+
+    // Named preview streams, resized in parallel of the Video preview
+    bool startPreviewStream(const std::string &name, unsigned int width, unsigned int height, int mmal_image_format);
+    void stopPreviewStream(const std::string &name);
+    bool isPreviewStreamOpened(const std::string &name) { return m_mmal_instance->isPreviewStreamOpened(name);};
+    GRAB_STATUS_T grabStream(const std::string &name, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    void retrieveStream(const std::string &name, unsigned char *data, unsigned int stride = 0);
+    GRAB_STATUS_T grabStreamLease(const std::string &name, FrameLease &lease, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    FRAME_INFO getStreamFrameInfo(const std::string &name);
     unsigned int getVideoPreviewWidth() { return m_mmal_instance->getVideoPreviewWidth();};
     unsigned int getVideoPreviewHeight() { return m_mmal_instance->getVideoPreviewHeight();};
     bool isVideoPreviewOpened(){ return m_mmal_instance->isVideoPreviewOpened();}
@@ -44,13 +69,53 @@ public:
     // Controls on Video Record output
     void setVideoRecordSize(unsigned int width, unsigned int height);
     void startVideoRecord(string filename);
+    void startVideoRecord(EncodedSink *sink);
+    void startVideoRecord(string filename, EncodedSink *sink);
     void stopVideoRecord();
+    void startEventRing(std::chrono::milliseconds duration, size_t max_bytes = 0);
+    bool triggerEventRecord(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post);
+    bool isEventRecording() { return m_mmal_instance->isEventRecording();};
+    void setRecordOverflowPolicy(RECORD_OVERFLOW_POLICY_T policy);
+    RECORD_OVERFLOW_POLICY_T getRecordOverflowPolicy() { return m_mmal_instance->getRecordOverflowPolicy();};
+    RECORD_WRITER_STATS getRecordWriterStats();
+    void setRecordContainer(RECORD_CONTAINER_T container);
+    RECORD_CONTAINER_T getRecordContainer() { return m_mmal_instance->getRecordContainer();};
+    void setRecordSegmentPolicy(uint64_t max_bytes, std::chrono::milliseconds max_duration);
+    RECORD_SEGMENT_POLICY getRecordSegmentPolicy() { return m_mmal_instance->getRecordSegmentPolicy();};
+    void setRecordFileMode(RECORD_FILE_MODE_T mode);
+    RECORD_FILE_MODE_T getRecordFileMode() { return m_mmal_instance->getRecordFileMode();};
+    void setVideoMotionCallback(MOTION_CALLBACK_T callback);
+    void setH264EncoderConfig(const H264_ENCODER_CONFIG &config);
+    H264_ENCODER_CONFIG getH264EncoderConfig() { return m_mmal_instance->getH264EncoderConfig();};
+    bool setVideoBitrate(unsigned int bitrate);
+    bool startVideoSubstream(const std::string &filename, unsigned int width, unsigned int height);
+    bool startVideoSubstream(EncodedSink *sink, unsigned int width, unsigned int height);
+    void stopVideoSubstream();
+    bool isVideoSubstreamRecording() { return m_mmal_instance->isVideoSubstreamRecording();};
+    void setVideoSubstreamEncoderConfig(const H264_ENCODER_CONFIG &config);
+    H264_ENCODER_CONFIG getVideoSubstreamEncoderConfig() { return m_mmal_instance->getVideoSubstreamEncoderConfig();};
+    bool setVideoSubstreamBitrate(unsigned int bitrate);
+    void setVideoSubstreamContainer(RECORD_CONTAINER_T container);
+    void setVideoSubstreamSegmentPolicy(uint64_t max_bytes, std::chrono::milliseconds max_duration);
+    void setVideoSubstreamMotionCallback(MOTION_CALLBACK_T callback);
+    RECORD_WRITER_STATS getVideoSubstreamWriterStats() { return m_mmal_instance->getVideoSubstreamWriterStats();};
+    unsigned int getVideoSubstreamWidth() { return m_mmal_instance->getVideoSubstreamWidth();};
+    unsigned int getVideoSubstreamHeight() { return m_mmal_instance->getVideoSubstreamHeight();};
     unsigned int getVideoRecordWidth() { return m_mmal_instance->getVideoRecordWidth();};
     unsigned int getVideoRecordHeight() { return m_mmal_instance->getVideoRecordHeight();};
 
     // Controls on Still Record output
     void setStillRecordSize(unsigned int width, unsigned int height);
     void startStillRecord(string filename);
+    void startStillRecord(EncodedSink *sink);
+    std::future<STILL_CAPTURE_RESULT> captureStillAsync(EncodedSink *sink);
+    std::future<STILL_CAPTURE_RESULT> captureStillAt(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back);
+    void setZeroShutterLag(bool enable);
+    bool isZeroShutterLag() { return m_mmal_instance->isZeroShutterLag();};
+    int64_t getCameraTime() { return m_mmal_instance->getCameraTime();};
+    std::vector<STILL_CAPTURE_RESULT> captureBurst(unsigned int count, std::chrono::milliseconds interval, STILL_SINK_FACTORY_T sink_factory);
+    void setStillPipelinePersistent(bool persistent);
+    bool isStillPipelinePersistent() { return m_mmal_instance->isStillPipelinePersistent();};
     unsigned int getStillRecordWidth() { return m_mmal_instance->getStillRecordWidth();};
     unsigned int getStillRecordHeight() { return m_mmal_instance->getStillRecordHeight();};
 
@@ -0,0 +1,625 @@
+#include "streamserver.h"
+#include "mp4muxer.h"
+#include "mmal/mmal.h"
+
+#include <iostream>
+#include <random>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#define RTP_HEADER_SIZE 12
+#define NAL_TYPE_FU_A 28
+
+static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+
+static std::string base64(const std::vector<unsigned char> &data)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string text;
+    for ( size_t i = 0; i < data.size(); i += 3 ) {
+        uint32_t bits = data[i] << 16;
+        if ( i + 1 < data.size() ) bits |= data[i + 1] << 8;
+        if ( i + 2 < data.size() ) bits |= data[i + 2];
+        text += table[( bits >> 18 ) & 0x3f];
+        text += table[( bits >> 12 ) & 0x3f];
+        text += i + 1 < data.size() ? table[( bits >> 6 ) & 0x3f] : '=';
+        text += i + 2 < data.size() ? table[bits & 0x3f] : '=';
+    }
+    return text;
+}
+
+static bool resolve(const std::string &host, unsigned short port, int socktype, int flags,
+                    struct sockaddr_storage &address, socklen_t &address_len)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = flags;
+    struct addrinfo *addresses = NULL;
+    std::string service = std::to_string(port);
+    int error = getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses);
+    if ( error || !addresses ) {
+        std::cerr << "Unable to resolve " << host << ": " << gai_strerror(error) << std::endl;
+        return false;
+    }
+    memcpy(&address, addresses->ai_addr, addresses->ai_addrlen);
+    address_len = addresses->ai_addrlen;
+    freeaddrinfo(addresses);
+    return true;
+}
+
+
+/**
+ * @brief StreamServer::StreamServer
+ * @param ring_bytes : memory of the NAL units shared by the clients, a client later than that resyncs
+ */
+StreamServer::StreamServer(size_t ring_bytes):
+    m_frame_keyframe(false),
+    m_frame_pts(MMAL_TIME_UNKNOWN),
+    m_listen_fd(-1),
+    m_udp_fd(-1),
+    m_wake_fd(-1),
+    m_tcp_port(0),
+    m_running(false),
+    m_bytes_sent(0),
+    m_resyncs(0)
+{
+    m_ring.reset(ring_bytes, std::chrono::microseconds::max());
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+StreamServer::~StreamServer()
+{
+    stop();
+    if ( m_wake_fd >= 0 ) ::close(m_wake_fd);
+}
+
+/**
+ * @brief StreamServer::start
+ * Listen for the TCP clients and start the server thread.
+ * @param tcp_port : port of the raw H.264 stream, 0 for a port chosen by the system (see getTcpPort)
+ * @param address : local address listened
+ * @return false if the sockets can't be created
+ */
+bool StreamServer::start(unsigned short tcp_port, const std::string &address)
+{
+    if ( m_running ) return false;
+
+    struct sockaddr_storage local;
+    socklen_t local_len;
+    if ( !resolve(address, tcp_port, SOCK_STREAM, AI_PASSIVE, local, local_len) ) return false;
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    m_udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if ( m_listen_fd >= 0 ) setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ( m_wake_fd < 0 || m_listen_fd < 0 || m_udp_fd < 0 ||
+         bind(m_listen_fd, (struct sockaddr *) &local, local_len) != 0 || listen(m_listen_fd, STREAM_SERVER_MAX_CLIENTS) != 0 ) {
+        std::cerr << "Unable to start the stream server on port " << tcp_port << ": " << strerror(errno) << std::endl;
+        stop();
+        return false;
+    }
+
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    if ( getsockname(m_listen_fd, (struct sockaddr *) &bound, &bound_len) == 0 ) m_tcp_port = ntohs(bound.sin_port);
+    std::cerr << "Stream server listening on port " << m_tcp_port << std::endl;
+
+    m_running = true;
+    m_thread = std::thread(&StreamServer::run, this);
+    return true;
+}
+
+/**
+ * @brief StreamServer::stop
+ * Disconnect the clients and stop the server thread. The RTP destinations are kept.
+ */
+void StreamServer::stop()
+{
+    m_running = false;
+    if ( m_thread.joinable() ) {
+        wake();
+        m_thread.join();
+    }
+
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    for ( CLIENT &client : m_clients ) {
+        if ( client.fd >= 0 ) closeClient(client);
+    }
+    std::vector<CLIENT> rtp_clients;
+    for ( CLIENT &client : m_clients ) {
+        if ( !client.closed ) rtp_clients.push_back(client);
+    }
+    m_clients.swap(rtp_clients);
+
+    if ( m_listen_fd >= 0 ) ::close(m_listen_fd);
+    if ( m_udp_fd >= 0 ) ::close(m_udp_fd);
+    m_listen_fd = -1;
+    m_udp_fd = -1;
+    m_tcp_port = 0;
+}
+
+/**
+ * @brief StreamServer::addRtpClient
+ * Send the RTP stream to a destination, from the last IDR frame.
+ * @param host : name or address of the receiver, may be a multicast address
+ * @param port : RTP port of the receiver
+ * @return false if the host can't be resolved or the server has too many clients
+ */
+bool StreamServer::addRtpClient(const std::string &host, unsigned short port)
+{
+    CLIENT client = CLIENT();
+    client.fd = -1;
+    client.closed = false;
+    if ( !resolve(host, port, SOCK_DGRAM, 0, client.address, client.address_len) ) return false;
+    client.next = 0;
+    client.wait_keyframe = true;
+    client.send_config = false;
+    client.blocked = false;
+    client.pending_offset = 0;
+    std::random_device random;
+    client.sequence = random();
+    client.ssrc = random();
+    client.last_pts = 0;
+
+    {
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        if ( m_clients.size() >= STREAM_SERVER_MAX_CLIENTS ) {
+            std::cerr << "Stream server full, RTP client " << host << ":" << port << " refused" << std::endl;
+            return false;
+        }
+        m_clients.push_back(client);
+    }
+    wake();
+    return true;
+}
+
+void StreamServer::removeRtpClient(const std::string &host, unsigned short port)
+{
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    if ( !resolve(host, port, SOCK_DGRAM, 0, address, address_len) ) return;
+
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    for ( CLIENT &client : m_clients ) {
+        if ( client.fd < 0 && client.address_len == address_len && !memcmp(&client.address, &address, address_len) )
+            client.closed = true;
+    }
+    if ( !m_running ) {
+        std::vector<CLIENT> clients;
+        for ( CLIENT &client : m_clients ) {
+            if ( !client.closed ) clients.push_back(client);
+        }
+        m_clients.swap(clients);
+    }
+}
+
+/**
+ * @brief StreamServer::getSdp
+ * @param host : address of the receiver
+ * @param port : RTP port of the receiver
+ * @return SDP description of the RTP stream for a receiver, empty until the SPS/PPS are known
+ */
+std::string StreamServer::getSdp(const std::string &host, unsigned short port)
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    if ( m_sps.size() < 4 || m_pps.empty() ) return std::string();
+    char profile[8];
+    snprintf(profile, sizeof(profile), "%02x%02x%02x", m_sps[1], m_sps[2], m_sps[3]);
+    std::string payload = std::to_string(STREAM_SERVER_RTP_PAYLOAD_TYPE);
+    return "v=0\r\n"
+           "o=- 0 0 IN IP4 " + host + "\r\n"
+           "s=RekkonMMALCamera\r\n"
+           "c=IN IP4 " + host + "\r\n"
+           "t=0 0\r\n"
+           "m=video " + std::to_string(port) + " RTP/AVP " + payload + "\r\n"
+           "a=rtpmap:" + payload + " H264/90000\r\n"
+           "a=fmtp:" + payload + " packetization-mode=1;profile-level-id=" + profile +
+           ";sprop-parameter-sets=" + base64(m_sps) + "," + base64(m_pps) + "\r\n";
+}
+
+/**
+ * @brief StreamServer::open
+ * Called when the encoder starts: the ring is emptied and the clients wait for the new stream.
+ */
+bool StreamServer::open()
+{
+    m_frame.clear();
+    m_frame_keyframe = false;
+    m_frame_pts = MMAL_TIME_UNKNOWN;
+
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    m_ring.clear();
+    m_sps.clear();
+    m_pps.clear();
+    m_config.clear();
+    for ( CLIENT &client : m_clients ) {
+        client.wait_keyframe = true;
+        client.next = m_ring.end();
+    }
+    return true;
+}
+
+/**
+ * @brief StreamServer::write
+ * Gather the buffers of a frame and add its NAL units to the ring. Never blocks on the clients.
+ */
+void StreamServer::write(const ENCODED_CHUNK &chunk)
+{
+    m_frame.insert(m_frame.end(), chunk.data, chunk.data + chunk.size);
+    if ( chunk.flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ) m_frame_keyframe = true;
+    if ( m_frame_pts == MMAL_TIME_UNKNOWN ) m_frame_pts = chunk.pts;
+    if ( !( chunk.flags & ( MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG ) ) ) return;
+
+    addFrame();
+    m_frame.clear();
+    m_frame_keyframe = false;
+    m_frame_pts = MMAL_TIME_UNKNOWN;
+    wake();
+}
+
+/**
+ * @brief StreamServer::getStats
+ * @return the counters of the server since it was created
+ */
+STREAM_SERVER_STATS StreamServer::getStats()
+{
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    STREAM_SERVER_STATS stats;
+    stats.tcp_clients = 0;
+    stats.rtp_clients = 0;
+    for ( const CLIENT &client : m_clients ) {
+        if ( client.closed ) continue;
+        if ( client.fd >= 0 ) stats.tcp_clients++;
+        else stats.rtp_clients++;
+    }
+    stats.bytes_sent = m_bytes_sent;
+    stats.resyncs = m_resyncs;
+    stats.ring_bytes = m_ring.getUsedBytes();
+    return stats;
+}
+
+/**
+ * @brief StreamServer::addFrame
+ * Split the frame in NAL units: the SPS/PPS are kept aside, the other ones go to the ring,
+ * the last one of the frame flagged FRAME_END.
+ */
+void StreamServer::addFrame()
+{
+    std::vector<std::pair<size_t, size_t>> nals = Mp4Muxer::splitNals(m_frame.data(), m_frame.size());
+    std::vector<std::pair<size_t, size_t>> slices;
+
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    bool config_changed = false;
+    for ( const std::pair<size_t, size_t> &nal : nals ) {
+        if ( !nal.second ) continue;
+        const unsigned char *data = m_frame.data() + nal.first;
+        int type = data[0] & 0x1f;
+        if ( type == NAL_TYPE_SPS || type == NAL_TYPE_PPS ) {
+            std::vector<unsigned char> &set = type == NAL_TYPE_SPS ? m_sps : m_pps;
+            if ( set.size() != nal.second || memcmp(set.data(), data, nal.second) ) {
+                set.assign(data, data + nal.second);
+                config_changed = true;
+            }
+        }
+        else if ( type != NAL_TYPE_AUD ) slices.push_back(nal);
+    }
+    if ( config_changed ) {
+        m_config.assign(m_sps.begin(), m_sps.end());
+        m_config.insert(m_config.end(), start_code, start_code + sizeof(start_code));
+        m_config.insert(m_config.end(), m_pps.begin(), m_pps.end());
+    }
+
+    for ( size_t i = 0; i < slices.size(); i++ ) {
+        uint32_t flags = m_frame_keyframe ? MMAL_BUFFER_HEADER_FLAG_KEYFRAME : 0;
+        if ( i + 1 == slices.size() ) flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+        m_ring.push(m_frame.data() + slices[i].first, slices[i].second, flags, m_frame_pts);
+    }
+}
+
+void StreamServer::wake()
+{
+    if ( m_wake_fd >= 0 ) eventfd_write(m_wake_fd, 1);
+}
+
+void StreamServer::run()
+{
+    std::vector<struct pollfd> fds;
+    while ( m_running ) {
+        fds.clear();
+        struct pollfd fd = { m_wake_fd, POLLIN, 0 };
+        fds.push_back(fd);
+        fd.fd = m_listen_fd;
+        fds.push_back(fd);
+        {
+            std::unique_lock<std::mutex> lck ( m_mutex );
+            for ( const CLIENT &client : m_clients ) {
+                if ( client.fd < 0 || client.closed ) continue;
+                fd.fd = client.fd;
+                fd.events = POLLIN | ( client.blocked ? POLLOUT : 0 );
+                fds.push_back(fd);
+            }
+        }
+
+        if ( poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR ) {
+            std::cerr << "Stream server poll error: " << strerror(errno) << std::endl;
+            break;
+        }
+        if ( fds[0].revents ) {
+            eventfd_t value;
+            eventfd_read(m_wake_fd, &value);
+        }
+        if ( fds[1].revents & POLLIN ) acceptClient();
+
+        std::unique_lock<std::mutex> lck ( m_mutex );
+        for ( size_t i = 2; i < fds.size(); i++ ) {
+            if ( !fds[i].revents ) continue;
+            for ( CLIENT &client : m_clients ) {
+                if ( client.fd != fds[i].fd || client.closed ) continue;
+                if ( fds[i].revents & POLLOUT ) client.blocked = false;
+                if ( fds[i].revents & ( POLLIN | POLLERR | POLLHUP ) ) {
+                    // the clients send nothing, data or end of file means the connection is closing
+                    char discard[256];
+                    ssize_t length = recv(client.fd, discard, sizeof(discard), MSG_DONTWAIT);
+                    if ( length == 0 || ( length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+                        closeClient(client);
+                }
+            }
+        }
+        for ( CLIENT &client : m_clients ) serve(client);
+
+        std::vector<CLIENT>::iterator it = m_clients.begin();
+        while ( it != m_clients.end() ) {
+            if ( it->closed ) it = m_clients.erase(it);
+            else ++it;
+        }
+    }
+}
+
+void StreamServer::acceptClient()
+{
+    int fd = accept4(m_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( fd < 0 ) return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    CLIENT client = CLIENT();
+    client.fd = fd;
+    client.closed = false;
+    client.address_len = 0;
+    client.next = 0;
+    client.wait_keyframe = true;
+    client.send_config = false;
+    client.blocked = false;
+    client.pending_offset = 0;
+    client.sequence = 0;
+    client.ssrc = 0;
+    client.last_pts = 0;
+
+    std::unique_lock<std::mutex> lck ( m_mutex );
+    if ( m_clients.size() >= STREAM_SERVER_MAX_CLIENTS ) {
+        std::cerr << "Stream server full, TCP client refused" << std::endl;
+        ::close(fd);
+        return;
+    }
+    m_clients.push_back(client);
+}
+
+/**
+ * @brief StreamServer::resync
+ * Move a late client to the last IDR frame of the ring when it is after its position, else drop
+ * its data until the next IDR frame. A NAL unit partly sent is completed first.
+ */
+void StreamServer::resync(CLIENT &client)
+{
+    uint64_t keyframe = m_ring.findKeyframe(std::chrono::microseconds(0));
+    client.wait_keyframe = true;
+    client.next = keyframe != m_ring.end() && keyframe > client.next ? keyframe : m_ring.end();
+    m_resyncs++;
+}
+
+/**
+ * @brief StreamServer::serve
+ * Send a client the NAL units it hasn't received yet, until its socket is full.
+ * Called with m_mutex locked.
+ */
+void StreamServer::serve(CLIENT &client)
+{
+    if ( client.fd < 0 && m_udp_fd < 0 ) return;
+    if ( client.blocked && !client.wait_keyframe && client.next >= m_ring.begin() && client.next < m_ring.end() ) {
+        // checked on each new frame, a blocked client doesn't wait for its data to leave the ring
+        uint64_t keyframe = m_ring.findKeyframe(std::chrono::microseconds(0));
+        int64_t pts = m_ring.entry(client.next).pts;
+        int64_t last_pts = m_ring.entry(m_ring.end() - 1).pts;
+        bool lagging = pts != MMAL_TIME_UNKNOWN && last_pts != MMAL_TIME_UNKNOWN && last_pts - pts >= STREAM_SERVER_MAX_LAG_US;
+        if ( ( keyframe != m_ring.end() && keyframe > client.next ) || lagging ) resync(client);
+    }
+    while ( !client.closed && !client.blocked ) {
+        if ( !client.pending.empty() ) {
+            if ( !flushPending(client) ) return;
+            continue;
+        }
+        if ( !client.wait_keyframe && client.next < m_ring.begin() ) resync(client);
+        if ( client.wait_keyframe ) {
+            uint64_t keyframe = m_ring.findKeyframe(std::chrono::microseconds(0));
+            if ( keyframe == m_ring.end() || keyframe < client.next ) return;
+            client.next = keyframe;
+            client.wait_keyframe = false;
+            client.send_config = true;
+        }
+        if ( client.next >= m_ring.end() ) return;
+
+        const ENCODED_ENTRY &entry = m_ring.entry(client.next);
+        if ( client.send_config ) {
+            bool sent = true;
+            if ( !m_config.empty() ) {
+                if ( client.fd >= 0 ) sent = sendTcp(client, m_config.data(), m_config.size());
+                else sent = sendRtp(client, m_sps.data(), m_sps.size(), entry.pts, false) &&
+                            sendRtp(client, m_pps.data(), m_pps.size(), entry.pts, false);
+            }
+            if ( !sent ) return;
+            client.send_config = false;
+            continue;
+        }
+        if ( !sendNal(client, m_ring.data(client.next), entry.size, entry.pts,
+                      ( entry.flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END ) != 0 ) ) return;
+        if ( !client.wait_keyframe ) client.next++;
+    }
+}
+
+bool StreamServer::sendNal(CLIENT &client, const unsigned char *data, size_t size, int64_t pts, bool marker)
+{
+    if ( client.fd >= 0 ) return sendTcp(client, data, size);
+    return sendRtp(client, data, size, pts, marker);
+}
+
+/**
+ * @brief StreamServer::sendTcp
+ * Send a NAL unit with its start code. What the socket doesn't take is kept in the client.
+ * @return false if nothing was sent (the socket is full) or the connection is lost
+ */
+bool StreamServer::sendTcp(CLIENT &client, const unsigned char *data, size_t size)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) start_code;
+    iov[0].iov_len = sizeof(start_code);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = size;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+
+    ssize_t sent;
+    do sent = sendmsg(client.fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while ( sent < 0 && errno == EINTR );
+    if ( sent < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) client.blocked = true;
+        else closeClient(client);
+        return false;
+    }
+    m_bytes_sent += sent;
+
+    size_t total = sizeof(start_code) + size;
+    if ( (size_t) sent < total ) {
+        // only a slow client copies, the rest of the NAL unit must follow before anything else
+        client.pending.clear();
+        if ( (size_t) sent < sizeof(start_code) )
+            client.pending.insert(client.pending.end(), start_code + sent, start_code + sizeof(start_code));
+        size_t offset = (size_t) sent > sizeof(start_code) ? sent - sizeof(start_code) : 0;
+        client.pending.insert(client.pending.end(), data + offset, data + size);
+        client.pending_offset = 0;
+        client.blocked = true;
+    }
+    return true;
+}
+
+bool StreamServer::flushPending(CLIENT &client)
+{
+    ssize_t sent;
+    do sent = send(client.fd, client.pending.data() + client.pending_offset, client.pending.size() - client.pending_offset,
+                   MSG_NOSIGNAL | MSG_DONTWAIT);
+    while ( sent < 0 && errno == EINTR );
+    if ( sent < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) client.blocked = true;
+        else closeClient(client);
+        return false;
+    }
+    m_bytes_sent += sent;
+    client.pending_offset += sent;
+    if ( client.pending_offset < client.pending.size() ) {
+        client.blocked = true;
+        return false;
+    }
+    client.pending.clear();
+    client.pending_offset = 0;
+    return true;
+}
+
+/**
+ * @brief StreamServer::sendRtp
+ * Send a NAL unit in a RTP packet, or in FU-A fragments when it is bigger than a packet.
+ * A full socket buffer drops the client to the next IDR frame.
+ * @return false if the client was resynced
+ */
+bool StreamServer::sendRtp(CLIENT &client, const unsigned char *data, size_t size, int64_t pts, bool marker)
+{
+    if ( !size ) return true;
+    if ( pts != MMAL_TIME_UNKNOWN ) client.last_pts = pts;
+    uint32_t timestamp = (uint32_t) ( client.last_pts * 9 / 100 );   // 90 kHz
+
+    const size_t payload_size = STREAM_SERVER_RTP_PACKET_SIZE - RTP_HEADER_SIZE;
+    bool fragmented = size > payload_size;
+    unsigned char fu[2];
+    fu[0] = ( data[0] & 0xe0 ) | NAL_TYPE_FU_A;
+    size_t offset = fragmented ? 1 : 0;   // the FU indicator and header replace the NAL header
+
+    while ( offset < size ) {
+        size_t length = size - offset;
+        if ( fragmented && length > payload_size - sizeof(fu) ) length = payload_size - sizeof(fu);
+        bool last = offset + length == size;
+
+        unsigned char header[RTP_HEADER_SIZE];
+        header[0] = 0x80;   // version 2
+        header[1] = ( marker && last ? 0x80 : 0 ) | STREAM_SERVER_RTP_PAYLOAD_TYPE;
+        header[2] = client.sequence >> 8;
+        header[3] = client.sequence & 0xff;
+        header[4] = timestamp >> 24;
+        header[5] = timestamp >> 16;
+        header[6] = timestamp >> 8;
+        header[7] = timestamp;
+        header[8] = client.ssrc >> 24;
+        header[9] = client.ssrc >> 16;
+        header[10] = client.ssrc >> 8;
+        header[11] = client.ssrc;
+
+        struct iovec iov[3];
+        int iov_num = 0;
+        iov[iov_num].iov_base = header;
+        iov[iov_num++].iov_len = sizeof(header);
+        if ( fragmented ) {
+            fu[1] = ( offset == 1 ? 0x80 : 0 ) | ( last ? 0x40 : 0 ) | ( data[0] & 0x1f );
+            iov[iov_num].iov_base = fu;
+            iov[iov_num++].iov_len = sizeof(fu);
+        }
+        iov[iov_num].iov_base = (void *) ( data + offset );
+        iov[iov_num++].iov_len = length;
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_name = &client.address;
+        message.msg_namelen = client.address_len;
+        message.msg_iov = iov;
+        message.msg_iovlen = iov_num;
+        ssize_t sent;
+        do sent = sendmsg(m_udp_fd, &message, MSG_DONTWAIT);
+        while ( sent < 0 && errno == EINTR );
+        if ( sent < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ) ) {
+            resync(client);
+            return false;
+        }
+        // other errors (no route, refused) lose the packet like the network would
+        if ( sent > 0 ) m_bytes_sent += sent;
+        client.sequence++;
+        offset += length;
+    }
+    return true;
+}
+
+void StreamServer::closeClient(CLIENT &client)
+{
+    if ( client.fd >= 0 ) ::close(client.fd);
+    client.fd = -1;
+    client.closed = true;
+    client.blocked = false;
+}
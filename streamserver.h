@@ -0,0 +1,119 @@
+#ifndef STREAMSERVER_H
+#define STREAMSERVER_H
+
+#include "encodedsink.h"
+#include "encodedring.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define STREAM_SERVER_RING_SIZE (8 << 20)     /// Bytes of NAL units shared by the clients
+#define STREAM_SERVER_RTP_PACKET_SIZE 1400    /// Largest RTP packet, fits an Ethernet MTU
+#define STREAM_SERVER_RTP_PAYLOAD_TYPE 96
+#define STREAM_SERVER_MAX_CLIENTS 16
+#define STREAM_SERVER_MAX_LAG_US 1000000      /// Lag of a blocked client before it drops its data until the next IDR frame
+
+/** Counters of a stream server
+*/
+struct STREAM_SERVER_STATS
+{
+    unsigned int tcp_clients;
+    unsigned int rtp_clients;
+    uint64_t bytes_sent;        /// Sent to all the clients
+    uint64_t resyncs;           /// Times a client too slow skipped to an IDR frame
+    size_t ring_bytes;          /// Bytes of NAL units in the ring
+};
+
+/**
+ * @brief The StreamServer class
+ * Serves the H.264 stream to local or LAN clients: raw Annex B over TCP to every client connected
+ * to its port, and RTP (RFC 6184, single NAL unit and FU-A packets) over UDP to the added
+ * destinations. As an EncodedSink, it is fed by a video record (startVideoRecord or
+ * startVideoSubstream with the server as sink) or by any encoded source.
+ * The NAL units are copied once in a ring shared by the clients, each client only keeps its
+ * position in it, so the encoder is never blocked. A client whose socket is full skips to the
+ * last IDR frame of the ring as soon as one is newer than its position, or drops its data until
+ * the next one when it is STREAM_SERVER_MAX_LAG_US late; a client whose data left the ring does
+ * the same. A client starts on the last IDR frame of the ring, after the SPS/PPS.
+ */
+class StreamServer : public EncodedSink
+{
+public:
+    StreamServer(size_t ring_bytes = STREAM_SERVER_RING_SIZE);
+    ~StreamServer();
+
+    StreamServer(const StreamServer&) = delete;
+    StreamServer& operator=(const StreamServer&) = delete;
+
+    bool start(unsigned short tcp_port, const std::string &address = "0.0.0.0");
+    void stop();
+    bool isRunning() const { return m_running; }
+    unsigned short getTcpPort() const { return m_tcp_port; }
+
+    bool addRtpClient(const std::string &host, unsigned short port);
+    void removeRtpClient(const std::string &host, unsigned short port);
+    std::string getSdp(const std::string &host, unsigned short port);
+
+    bool open();
+    void write(const ENCODED_CHUNK &chunk);
+
+    STREAM_SERVER_STATS getStats();
+
+private:
+    struct CLIENT
+    {
+        int fd;                               /// TCP socket, -1 for a RTP destination
+        bool closed;                          /// Removed by the server thread
+        struct sockaddr_storage address;      /// RTP destination
+        socklen_t address_len;
+        uint64_t next;                        /// Next ring entry to send
+        bool wait_keyframe;                   /// Waits for an IDR frame at or after 'next'
+        bool send_config;                     /// SPS/PPS to send before the next NAL unit
+        bool blocked;                         /// The TCP socket is full, waits for POLLOUT
+        std::vector<unsigned char> pending;   /// Rest of a NAL unit only partly taken by the TCP socket
+        size_t pending_offset;
+        uint16_t sequence;
+        uint32_t ssrc;
+        int64_t last_pts;
+    };
+
+    void run();
+    void acceptClient();
+    void addFrame();
+    void serve(CLIENT &client);
+    void resync(CLIENT &client);
+    bool sendNal(CLIENT &client, const unsigned char *data, size_t size, int64_t pts, bool marker);
+    bool sendTcp(CLIENT &client, const unsigned char *data, size_t size);
+    bool flushPending(CLIENT &client);
+    bool sendRtp(CLIENT &client, const unsigned char *data, size_t size, int64_t pts, bool marker);
+    void closeClient(CLIENT &client);
+    void wake();
+
+    std::mutex m_mutex;                    /// Protects the ring, the parameter sets and the clients
+    EncodedRing m_ring;                    /// One entry per NAL unit, without start code
+    std::vector<unsigned char> m_sps;
+    std::vector<unsigned char> m_pps;
+    std::vector<unsigned char> m_config;   /// SPS and PPS in Annex B, sent at once to the TCP clients
+    std::vector<unsigned char> m_frame;    /// Annex B data of the frame being received
+    bool m_frame_keyframe;
+    int64_t m_frame_pts;
+    std::vector<CLIENT> m_clients;
+
+    int m_listen_fd;
+    int m_udp_fd;
+    int m_wake_fd;                         /// eventfd waking the server thread
+    unsigned short m_tcp_port;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    uint64_t m_bytes_sent;
+    uint64_t m_resyncs;
+};
+
+#endif // STREAMSERVER_H
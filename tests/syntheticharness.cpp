@@ -0,0 +1,612 @@
+/**
+ * Synthetic source harness, built with -DBUILD_SYNTHETIC_TESTS=ON and run by ctest.
+ * It feeds generated data to the parts of the library that don't need a camera, so their
+ * behaviour can be reproduced on any Linux machine:
+ *   syntheticharness record_file <directory>...   RecordFile in the three modes, data read back
+ *   syntheticharness record_writer <directory>... RecordWriter, H.264 and MP4 records of the synthetic stream
+ *                                                 in the three modes, to a new and to an existing file
+ *   syntheticharness stream_server                StreamServer over loopback, TCP Annex B and RTP
+ */
+#include "recordfile.h"
+#include "recordwriter.h"
+#include "streamserver.h"
+#include "mp4muxer.h"
+#include "mmal/mmal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define HARNESS_RECORD_BYTES (24 << 20)   /// Bytes written to each record file
+#define HARNESS_RECORD_PREFIX "header\n"   /// Content of the existing file a record is appended to, not aligned
+#define HARNESS_RECORD_POOL_SIZE 16       /// Encoder buffers that can wait for the record writer
+#define HARNESS_STREAM_FRAMES 90          /// Frames of the synthetic H.264 stream
+#define HARNESS_STREAM_GOP 30             /// Frames between two IDR frames
+#define HARNESS_STREAM_SLICES 2           /// NAL units per frame, the last one ends the frame
+#define HARNESS_FRAME_PERIOD_US 33333
+
+typedef std::vector<unsigned char> NAL_T;
+
+/** Frame of the synthetic stream
+*/
+struct SYNTHETIC_FRAME
+{
+    std::vector<NAL_T> nals;   /// Without start code
+    bool keyframe;
+    int64_t pts;
+};
+
+static bool isDirectory(const std::string &directory)
+{
+    struct stat info;
+    return stat(directory.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static const char *modeName(RECORD_FILE_MODE_T mode)
+{
+    switch ( mode ) {
+    case RECORD_FILE_IO_URING: return "RECORD_FILE_IO_URING";
+    case RECORD_FILE_PWRITE: return "RECORD_FILE_PWRITE";
+    default: return "RECORD_FILE_BUFFERED";
+    }
+}
+
+/**
+ * @brief makeNal
+ * @return a NAL unit of 'size' bytes whose payload can't emulate a start code
+ */
+static NAL_T makeNal(int type, size_t size, std::mt19937 &random)
+{
+    NAL_T nal(size);
+    nal[0] = 0x60 | type;
+    for ( size_t i = 1; i < size; i++ ) nal[i] = 1 + random() % 255;
+    return nal;
+}
+
+/**
+ * @brief makeStream
+ * Synthetic H.264 stream: IDR frames large enough for FU-A, smaller P frames around the RTP packet size.
+ */
+static std::vector<SYNTHETIC_FRAME> makeStream(NAL_T &sps, NAL_T &pps)
+{
+    std::mt19937 random(2);
+    sps = makeNal(NAL_TYPE_SPS, 12, random);
+    pps = makeNal(NAL_TYPE_PPS, 4, random);
+    std::vector<SYNTHETIC_FRAME> frames(HARNESS_STREAM_FRAMES);
+    for ( unsigned int i = 0; i < frames.size(); i++ ) {
+        frames[i].keyframe = i % HARNESS_STREAM_GOP == 0;
+        frames[i].pts = (int64_t) i * HARNESS_FRAME_PERIOD_US;
+        for ( unsigned int slice = 0; slice < HARNESS_STREAM_SLICES; slice++ ) {
+            if ( frames[i].keyframe ) frames[i].nals.push_back(makeNal(NAL_TYPE_IDR, 4000 + random() % 4000, random));
+            else frames[i].nals.push_back(makeNal(1, 100 + random() % 2000, random));
+        }
+    }
+    return frames;
+}
+
+static void appendAnnexB(std::vector<unsigned char> &data, const NAL_T &nal)
+{
+    static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+    data.insert(data.end(), start_code, start_code + sizeof(start_code));
+    data.insert(data.end(), nal.begin(), nal.end());
+}
+
+/**
+ * @brief recordFileTest
+ * Write the same data in chunks of random sizes with a mode, then read the file back.
+ * @param directory : where the file is written, for instance a tmpfs and a disk
+ * @param mode : requested mode, the file may fall back to the next one
+ * @param data : content of the file
+ * @return false if the file can't be written or doesn't hold the data
+ */
+static bool recordFileTest(const std::string &directory, RECORD_FILE_MODE_T mode, const std::vector<unsigned char> &data)
+{
+    std::string filename = directory + "/syntheticharness_record.bin";
+    ::unlink(filename.c_str());
+
+    RecordFile file;
+    if ( !file.open(filename, mode) ) {
+        std::cerr << "record_file: unable to open " << filename << std::endl;
+        return false;
+    }
+    std::string backend = file.getBackendName();
+    std::mt19937 random(1);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t offset = 0;
+    bool written = true;
+    while ( written && offset < data.size() ) {
+        // encoder buffers are rarely aligned, odd sizes exercise the chunk gathering
+        size_t size = std::min<size_t>(1 + random() % ( 256 << 10 ), data.size() - offset);
+        written = file.write(data.data() + offset, size);
+        offset += size;
+    }
+    written = file.close() && written;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ifstream input(filename.c_str(), std::ios::binary);
+    std::vector<unsigned char> read_back(( std::istreambuf_iterator<char>(input) ), std::istreambuf_iterator<char>());
+    ::unlink(filename.c_str());
+    bool same = read_back == data;
+
+    std::cout << "record_file " << directory << " " << modeName(mode) << " (" << backend << "): "
+              << data.size() / ( seconds * ( 1 << 20 ) ) << " MiB/s, "
+              << ( !written ? "write error" : same ? "content ok" : "content differs" ) << std::endl;
+    return written && same;
+}
+
+static int recordFileTests(const std::vector<std::string> &directories)
+{
+    std::vector<unsigned char> data(HARNESS_RECORD_BYTES);
+    std::mt19937 random(0);
+    for ( unsigned char &byte : data ) byte = random();
+
+    bool passed = true;
+    const RECORD_FILE_MODE_T modes[] = { RECORD_FILE_IO_URING, RECORD_FILE_PWRITE, RECORD_FILE_BUFFERED };
+    for ( const std::string &directory : directories ) {
+        if ( !isDirectory(directory) ) {
+            std::cout << "record_file " << directory << ": skipped, no such directory" << std::endl;
+            continue;
+        }
+        for ( RECORD_FILE_MODE_T mode : modes ) passed = recordFileTest(directory, mode, data) && passed;
+    }
+    return passed ? 0 : 1;
+}
+
+static uint32_t get32(const std::vector<unsigned char> &data, size_t offset)
+{
+    return ( data[offset] << 24 ) | ( data[offset + 1] << 16 ) | ( data[offset + 2] << 8 ) | data[offset + 3];
+}
+
+/**
+ * @brief findBox
+ * Look for a box among the boxes between 'begin' and 'end'.
+ * @param payload : set to the range of its content
+ * @return false if there is no such box or a box overflows the range
+ */
+static bool findBox(const std::vector<unsigned char> &data, size_t begin, size_t end, const char *type,
+                    std::pair<size_t, size_t> &payload)
+{
+    while ( begin + 8 <= end ) {
+        size_t size = get32(data, begin);
+        if ( size < 8 || size > end - begin ) return false;
+        if ( !memcmp(&data[begin + 4], type, 4) ) {
+            payload = std::make_pair(begin + 8, begin + size);
+            return true;
+        }
+        begin += size;
+    }
+    return false;
+}
+
+/**
+ * @brief checkMp4
+ * The file must be ftyp, moov with the SPS/PPS in the avcC, moof/mdat fragments and the mfra.
+ * Each sample of the fragments must be a frame of the stream, in order, its NAL units length prefixed.
+ * @return false if the structure or a sample is wrong
+ */
+static bool checkMp4(const std::vector<unsigned char> &data, const NAL_T &sps, const NAL_T &pps,
+                     const std::vector<SYNTHETIC_FRAME> &frames, unsigned int loops, std::string &error)
+{
+    std::pair<size_t, size_t> box;
+    if ( data.size() < 8 || memcmp(&data[4], "ftyp", 4) ) {
+        error = "no ftyp at the start of the file";
+        return false;
+    }
+    if ( !findBox(data, 0, data.size(), "moov", box) ) {
+        error = "no moov";
+        return false;
+    }
+    size_t avcc = 0;
+    for ( size_t i = box.first; !avcc && i + 4 <= box.second; i++ )
+        if ( !memcmp(&data[i], "avcC", 4) ) avcc = i + 4;
+    if ( !avcc || avcc + 8 + sps.size() + 3 + pps.size() > box.second ||
+         (size_t) ( ( data[avcc + 6] << 8 ) | data[avcc + 7] ) != sps.size() ||
+         !std::equal(sps.begin(), sps.end(), data.begin() + avcc + 8) ||
+         (size_t) ( ( data[avcc + 9 + sps.size()] << 8 ) | data[avcc + 10 + sps.size()] ) != pps.size() ||
+         !std::equal(pps.begin(), pps.end(), data.begin() + avcc + 11 + sps.size()) ) {
+        error = "SPS/PPS missing from the avcC";
+        return false;
+    }
+
+    size_t offset = box.second, sample = 0, fragments = 0;
+    bool mfra = false;
+    while ( offset + 8 <= data.size() && !mfra ) {
+        size_t size = get32(data, offset);
+        if ( size < 8 || size > data.size() - offset ) break;
+        mfra = !memcmp(&data[offset + 4], "mfra", 4);
+        if ( mfra ) {
+            offset += size;
+            break;
+        }
+        std::pair<size_t, size_t> traf, trun, mdat;
+        if ( memcmp(&data[offset + 4], "moof", 4) || !findBox(data, offset + 8, offset + size, "traf", traf) ||
+             !findBox(data, traf.first, traf.second, "trun", trun) ||
+             !findBox(data, offset + size, data.size(), "mdat", mdat) || mdat.first != offset + size + 8 ) {
+            error = "broken moof/mdat at " + std::to_string(offset);
+            return false;
+        }
+        // version and flags, sample count, data offset, then duration, size and flags of each sample
+        uint32_t count = get32(data, trun.first + 4);
+        if ( get32(data, trun.first + 8) != size + 8 || trun.first + 12 + count * 12 > trun.second ) {
+            error = "broken trun at " + std::to_string(offset);
+            return false;
+        }
+        size_t position = mdat.first;
+        for ( uint32_t i = 0; i < count; i++, sample++ ) {
+            const SYNTHETIC_FRAME &frame = frames[sample % frames.size()];
+            size_t sample_size = get32(data, trun.first + 12 + i * 12 + 4);
+            bool sync = get32(data, trun.first + 12 + i * 12 + 8) == 0x02000000;
+            bool same = sample < frames.size() * loops && sync == frame.keyframe && position + sample_size <= mdat.second;
+            size_t nal_position = position;
+            for ( size_t n = 0; same && n < frame.nals.size(); n++ ) {
+                const NAL_T &nal = frame.nals[n];
+                same = nal_position + 4 + nal.size() <= position + sample_size && get32(data, nal_position) == nal.size() &&
+                       std::equal(nal.begin(), nal.end(), data.begin() + nal_position + 4);
+                nal_position += 4 + nal.size();
+            }
+            if ( !same || nal_position != position + sample_size ) {
+                error = "sample " + std::to_string(sample) + " differs from the stream";
+                return false;
+            }
+            position += sample_size;
+        }
+        if ( position != mdat.second ) {
+            error = "mdat at " + std::to_string(mdat.first) + " larger than its samples";
+            return false;
+        }
+        fragments++;
+        offset = mdat.second;
+    }
+    if ( !mfra || offset != data.size() || sample != frames.size() * loops ) {
+        error = std::to_string(sample) + " samples in " + std::to_string(fragments) + " fragments" +
+                ( mfra && offset == data.size() ? "" : ", the file doesn't end with the mfra" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief recordWriterTest
+ * Push the synthetic stream, looped to HARNESS_RECORD_BYTES, to a RecordWriter like the encoder
+ * callback does, the frames split in two buffers, then check the file.
+ * @param directory : where the file is written
+ * @param mode : requested mode of the RecordFile
+ * @param container : RECORD_CONTAINER_H264 or RECORD_CONTAINER_MP4
+ * @param existing : the file already holds HARNESS_RECORD_PREFIX, kept by a H.264 record and replaced by a MP4 one
+ * @return false if the record can't be written or the file doesn't hold the stream
+ */
+static bool recordWriterTest(const std::string &directory, RECORD_FILE_MODE_T mode, RECORD_CONTAINER_T container, bool existing,
+                             const NAL_T &sps, const NAL_T &pps, const std::vector<SYNTHETIC_FRAME> &frames)
+{
+    bool mp4 = container == RECORD_CONTAINER_MP4;
+    std::string filename = directory + ( mp4 ? "/syntheticharness_record.mp4" : "/syntheticharness_record.h264" );
+    ::unlink(filename.c_str());
+    std::vector<unsigned char> expected;
+    if ( existing ) {
+        std::ofstream output(filename.c_str(), std::ios::binary);
+        output << HARNESS_RECORD_PREFIX;
+        if ( !mp4 ) expected.assign(HARNESS_RECORD_PREFIX, HARNESS_RECORD_PREFIX + strlen(HARNESS_RECORD_PREFIX));
+    }
+
+    std::vector<unsigned char> config;
+    appendAnnexB(config, sps);
+    appendAnnexB(config, pps);
+    std::vector<std::vector<unsigned char> > frames_data(frames.size());
+    size_t stream_size = 0;
+    for ( size_t i = 0; i < frames.size(); i++ ) {
+        for ( const NAL_T &nal : frames[i].nals ) appendAnnexB(frames_data[i], nal);
+        stream_size += frames_data[i].size();
+    }
+    unsigned int loops = ( HARNESS_RECORD_BYTES + stream_size - 1 ) / stream_size;
+
+    MMAL_ES_SPECIFIC_FORMAT_T es;
+    memset(&es, 0, sizeof(es));
+    es.video.width = 1920;
+    es.video.height = 1080;
+    MMAL_ES_FORMAT_T format;
+    memset(&format, 0, sizeof(format));
+    format.es = &es;
+    MMAL_PORT_T port;
+    memset(&port, 0, sizeof(port));
+    port.format = &format;
+    MMAL_POOL_T pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.headers_num = HARNESS_RECORD_POOL_SIZE;
+    // a header per buffer, the writer gives them back to the port after the push returns
+    std::vector<MMAL_BUFFER_HEADER_T> headers(1 + 2 * frames.size() * loops);
+    size_t header = 0;
+    auto push = [&](RecordWriter &writer, unsigned char *data, size_t size, uint32_t flags, int64_t pts) {
+        MMAL_BUFFER_HEADER_T &buffer = headers[header++];
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.data = data;
+        buffer.alloc_size = buffer.length = size;
+        buffer.flags = flags;
+        buffer.pts = buffer.dts = pts;
+        writer.push(&buffer);
+    };
+
+    RecordWriter writer;
+    writer.setContainer(container);
+    writer.setFileMode(mode);
+    writer.setOverflowPolicy(RECORD_OVERFLOW_BLOCK);
+    if ( !writer.start(filename, &port, &pool) ) {
+        std::cerr << "record_writer: unable to open " << filename << std::endl;
+        return false;
+    }
+    std::string backend = writer.getStats().file_backend;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    push(writer, config.data(), config.size(), MMAL_BUFFER_HEADER_FLAG_CONFIG, MMAL_TIME_UNKNOWN);
+    expected.insert(expected.end(), config.begin(), config.end());
+    for ( unsigned int loop = 0; loop < loops; loop++ ) {
+        for ( size_t i = 0; i < frames.size(); i++ ) {
+            uint32_t flags = frames[i].keyframe ? MMAL_BUFFER_HEADER_FLAG_KEYFRAME : 0;
+            int64_t pts = frames[i].pts + (int64_t) loop * frames.size() * HARNESS_FRAME_PERIOD_US;
+            size_t half = frames_data[i].size() / 2;
+            push(writer, frames_data[i].data(), half, flags, pts);
+            push(writer, frames_data[i].data() + half, frames_data[i].size() - half, flags | MMAL_BUFFER_HEADER_FLAG_FRAME_END, pts);
+            if ( !mp4 ) expected.insert(expected.end(), frames_data[i].begin(), frames_data[i].end());
+        }
+    }
+    writer.stop();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ifstream input(filename.c_str(), std::ios::binary);
+    std::vector<unsigned char> read_back(( std::istreambuf_iterator<char>(input) ), std::istreambuf_iterator<char>());
+    ::unlink(filename.c_str());
+    std::string error;
+    bool same = mp4 ? checkMp4(read_back, sps, pps, frames, loops, error) : read_back == expected;
+    if ( !same && error.empty() ) error = "content differs";
+
+    std::cout << "record_writer " << directory << " " << modeName(mode) << " (" << backend << ") "
+              << ( mp4 ? "MP4" : "H.264" ) << ( existing ? " over an existing file: " : ": " )
+              << stream_size * loops / ( seconds * ( 1 << 20 ) ) << " MiB/s, " << read_back.size() << " bytes, "
+              << ( same ? "content ok" : error ) << std::endl;
+    return same;
+}
+
+static int recordWriterTests(const std::vector<std::string> &directories)
+{
+    NAL_T sps, pps;
+    std::vector<SYNTHETIC_FRAME> frames = makeStream(sps, pps);
+
+    bool passed = true;
+    const RECORD_FILE_MODE_T modes[] = { RECORD_FILE_IO_URING, RECORD_FILE_PWRITE, RECORD_FILE_BUFFERED };
+    const RECORD_CONTAINER_T containers[] = { RECORD_CONTAINER_H264, RECORD_CONTAINER_MP4 };
+    for ( const std::string &directory : directories ) {
+        if ( !isDirectory(directory) ) {
+            std::cout << "record_writer " << directory << ": skipped, no such directory" << std::endl;
+            continue;
+        }
+        for ( RECORD_FILE_MODE_T mode : modes ) {
+            for ( RECORD_CONTAINER_T container : containers ) {
+                passed = recordWriterTest(directory, mode, container, false, sps, pps, frames) && passed;
+                passed = recordWriterTest(directory, mode, container, true, sps, pps, frames) && passed;
+            }
+        }
+    }
+    return passed ? 0 : 1;
+}
+
+/**
+ * @brief checkSlices
+ * The received slices must be the ones of the stream from an IDR frame to the end, in order.
+ * @param ends : for each received slice, true if its last packet carried the RTP marker, NULL for TCP
+ * @return number of frames received, -1 if the slices don't match
+ */
+static int checkSlices(const char *name, const std::vector<NAL_T> &slices, const std::vector<bool> *ends,
+                       const std::vector<SYNTHETIC_FRAME> &frames)
+{
+    unsigned int first = 0;
+    while ( first < frames.size() && ( slices.empty() || !frames[first].keyframe || frames[first].nals[0] != slices[0] ) ) first++;
+    if ( first == frames.size() ) {
+        std::cout << name << ": the stream doesn't start on an IDR frame" << std::endl;
+        return -1;
+    }
+    size_t index = 0;
+    for ( unsigned int i = first; i < frames.size(); i++ ) {
+        for ( size_t slice = 0; slice < frames[i].nals.size(); slice++, index++ ) {
+            if ( index >= slices.size() || slices[index] != frames[i].nals[slice] ) {
+                std::cout << name << ": slice " << slice << " of frame " << i << " missing or different" << std::endl;
+                return -1;
+            }
+            if ( ends && (*ends)[index] != ( slice + 1 == frames[i].nals.size() ) ) {
+                std::cout << name << ": wrong RTP marker on slice " << slice << " of frame " << i << std::endl;
+                return -1;
+            }
+        }
+    }
+    if ( index != slices.size() ) {
+        std::cout << name << ": " << slices.size() - index << " unexpected NAL units" << std::endl;
+        return -1;
+    }
+    return frames.size() - first;
+}
+
+/**
+ * @brief checkTcp
+ * The TCP client gets the SPS/PPS then the slices in Annex B.
+ */
+static bool checkTcp(const std::vector<unsigned char> &data, const NAL_T &sps, const NAL_T &pps,
+                     const std::vector<SYNTHETIC_FRAME> &frames)
+{
+    std::vector<NAL_T> nals;
+    for ( const std::pair<size_t, size_t> &nal : Mp4Muxer::splitNals(data.data(), data.size()) )
+        nals.push_back(NAL_T(data.begin() + nal.first, data.begin() + nal.first + nal.second));
+    if ( nals.size() < 2 || nals[0] != sps || nals[1] != pps ) {
+        std::cout << "stream_server tcp: the stream doesn't start with the SPS/PPS" << std::endl;
+        return false;
+    }
+    int received = checkSlices("stream_server tcp", std::vector<NAL_T>(nals.begin() + 2, nals.end()), NULL, frames);
+    if ( received < 0 ) return false;
+    std::cout << "stream_server tcp: " << data.size() << " bytes, " << received << " frames, Annex B ok" << std::endl;
+    return true;
+}
+
+/**
+ * @brief checkRtp
+ * Depacketise the RTP packets (single NAL unit and FU-A) and check the header fields.
+ */
+static bool checkRtp(const std::vector<std::vector<unsigned char> > &packets, const NAL_T &sps, const NAL_T &pps,
+                     const std::vector<SYNTHETIC_FRAME> &frames)
+{
+    std::vector<NAL_T> nals;
+    std::vector<bool> ends;
+    NAL_T fragment;
+    unsigned int fragmented = 0;
+    for ( size_t i = 0; i < packets.size(); i++ ) {
+        const std::vector<unsigned char> &packet = packets[i];
+        if ( packet.size() < 14 || ( packet[0] >> 6 ) != 2 || ( packet[1] & 0x7f ) != STREAM_SERVER_RTP_PAYLOAD_TYPE ) {
+            std::cout << "stream_server rtp: malformed packet " << i << std::endl;
+            return false;
+        }
+        uint16_t sequence = ( packet[2] << 8 ) | packet[3];
+        if ( i && (uint16_t) ( ( ( packets[i - 1][2] << 8 ) | packets[i - 1][3] ) + 1 ) != sequence ) {
+            std::cout << "stream_server rtp: sequence gap before packet " << i << std::endl;
+            return false;
+        }
+        if ( memcmp(&packet[8], &packets[0][8], 4) ) {
+            std::cout << "stream_server rtp: SSRC changed at packet " << i << std::endl;
+            return false;
+        }
+        bool marker = ( packet[1] & 0x80 ) != 0;
+        const unsigned char *payload = packet.data() + 12;
+        size_t size = packet.size() - 12;
+        if ( ( payload[0] & 0x1f ) != 28 ) {
+            nals.push_back(NAL_T(payload, payload + size));
+            ends.push_back(marker);
+            continue;
+        }
+        bool start = ( payload[1] & 0x80 ) != 0, end = ( payload[1] & 0x40 ) != 0;
+        if ( start != fragment.empty() || ( marker && !end ) ) {
+            std::cout << "stream_server rtp: broken FU-A fragments at packet " << i << std::endl;
+            return false;
+        }
+        if ( start ) fragment.push_back(( payload[0] & 0xe0 ) | ( payload[1] & 0x1f ));
+        fragment.insert(fragment.end(), payload + 2, payload + size);
+        fragmented++;
+        if ( end ) {
+            nals.push_back(fragment);
+            ends.push_back(marker);
+            fragment.clear();
+        }
+    }
+    if ( nals.size() < 2 || nals[0] != sps || nals[1] != pps || ends[0] || ends[1] ) {
+        std::cout << "stream_server rtp: the stream doesn't start with the SPS/PPS" << std::endl;
+        return false;
+    }
+    std::vector<bool> slice_ends(ends.begin() + 2, ends.end());
+    int received = checkSlices("stream_server rtp", std::vector<NAL_T>(nals.begin() + 2, nals.end()), &slice_ends, frames);
+    if ( received < 0 ) return false;
+    std::cout << "stream_server rtp: " << packets.size() << " packets (" << fragmented << " FU-A), " << received
+              << " frames, depacketised ok" << std::endl;
+    return true;
+}
+
+/**
+ * @brief streamServerTest
+ * Feed the synthetic stream to a server with a TCP client and a RTP destination on loopback,
+ * the chunks split like the encoder buffers, and check what both receive.
+ */
+static int streamServerTest()
+{
+    NAL_T sps, pps;
+    std::vector<SYNTHETIC_FRAME> frames = makeStream(sps, pps);
+
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 8 << 20;
+    setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    if ( udp_fd < 0 || bind(udp_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+         getsockname(udp_fd, (struct sockaddr *) &address, &address_len) != 0 ) {
+        std::cerr << "stream_server: unable to create the RTP receiver" << std::endl;
+        return 1;
+    }
+
+    StreamServer server;
+    if ( !server.start(0, "127.0.0.1") || !server.addRtpClient("127.0.0.1", ntohs(address.sin_port)) ) return 1;
+
+    int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+    address.sin_port = htons(server.getTcpPort());
+    if ( tcp_fd < 0 || connect(tcp_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ) {
+        std::cerr << "stream_server: unable to connect to the server" << std::endl;
+        return 1;
+    }
+    for ( int i = 0; i < 200 && server.getStats().tcp_clients == 0; i++ ) usleep(10000);
+
+    std::vector<unsigned char> tcp_data;
+    std::thread tcp_reader([&]() {
+        unsigned char buffer[65536];
+        ssize_t length;
+        while ( ( length = recv(tcp_fd, buffer, sizeof(buffer), 0) ) > 0 ) tcp_data.insert(tcp_data.end(), buffer, buffer + length);
+    });
+    std::vector<std::vector<unsigned char> > rtp_packets;
+    std::atomic<bool> receiving(true);
+    std::thread rtp_reader([&]() {
+        unsigned char buffer[2048];
+        struct pollfd fd = { udp_fd, POLLIN, 0 };
+        while ( poll(&fd, 1, 200) > 0 || receiving ) {
+            ssize_t length = recv(udp_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if ( length > 0 ) rtp_packets.push_back(std::vector<unsigned char>(buffer, buffer + length));
+        }
+    });
+
+    server.open();
+    std::vector<unsigned char> config;
+    appendAnnexB(config, sps);
+    appendAnnexB(config, pps);
+    ENCODED_CHUNK chunk = { config.data(), config.size(), MMAL_BUFFER_HEADER_FLAG_CONFIG, MMAL_TIME_UNKNOWN };
+    server.write(chunk);
+    for ( const SYNTHETIC_FRAME &frame : frames ) {
+        std::vector<unsigned char> data;
+        for ( const NAL_T &nal : frame.nals ) appendAnnexB(data, nal);
+        // two encoder buffers per frame, the second one ends it
+        uint32_t flags = frame.keyframe ? MMAL_BUFFER_HEADER_FLAG_KEYFRAME : 0;
+        size_t half = data.size() / 2;
+        ENCODED_CHUNK first = { data.data(), half, flags, frame.pts };
+        ENCODED_CHUNK second = { data.data() + half, data.size() - half, flags | MMAL_BUFFER_HEADER_FLAG_FRAME_END, frame.pts };
+        server.write(first);
+        server.write(second);
+        usleep(2000);
+    }
+    usleep(200000);
+    STREAM_SERVER_STATS stats = server.getStats();
+    server.stop();
+    tcp_reader.join();
+    receiving = false;
+    rtp_reader.join();
+    ::close(tcp_fd);
+    ::close(udp_fd);
+
+    std::cout << "stream_server: " << stats.bytes_sent << " bytes sent, " << stats.resyncs << " resyncs" << std::endl;
+    bool passed = checkTcp(tcp_data, sps, pps, frames);
+    passed = checkRtp(rtp_packets, sps, pps, frames) && passed;
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    std::string test = argc > 1 ? argv[1] : "";
+    if ( test == "record_file" && argc > 2 ) return recordFileTests(std::vector<std::string>(argv + 2, argv + argc));
+    if ( test == "record_writer" && argc > 2 ) return recordWriterTests(std::vector<std::string>(argv + 2, argv + argc));
+    if ( test == "stream_server" ) return streamServerTest();
+
+    std::cerr << "Usage: " << argv[0] << " record_file <directory>... | record_writer <directory>... | stream_server" << std::endl;
+    return 2;
+}
@@ -1,5 +1,8 @@
 #include "videommalobject.h"
 
+#include <deque>
+#include <thread>
+
 
 /**
  * Initialize static attributes.
@@ -24,12 +27,28 @@ VideoMMALObject::VideoMMALObject():
     m_video_record_width(1920),
     m_video_record_height(1080),
     m_is_video_recording(false),
+    m_is_video_substream_recording(false),
     m_still_record_width(MAX_STILL_WIDTH),
     m_still_record_height(MAX_STILL_HEIGHT),
+    m_still_pipeline_persistent(false),
+    m_zero_shutter_lag(false),
     m_is_opened(false),
-    m_are_video_components_ready(false)
+    m_are_video_components_ready(false),
+    m_preview_grab_mode(PREVIEW_GRAB_NEXT_FRAME),
+    m_cpu_color_conversion(false),
+    camera_component(NULL),
+    splitter_component(NULL),
+    splitter_connection(NULL),
+    still_encoder_component(NULL),
+    still_encoder_connection(NULL),
+    still_encoder_pool(NULL),
+    still_preview_pool(NULL)
 {
     setDefaultsCamParams();
+    for (unsigned int i = 0; i < SPLITTER_OUTPUTS_NUM; i++) m_splitter_output_used[i] = false;
+    encoder_callback_data.sink = NULL;
+    encoder_callback_data.encoder_pool = NULL;
+    encoder_callback_data.capture_pending = false;
 
 }
 
@@ -74,6 +93,24 @@ void VideoMMALObject::setDefaultsCamParams()
     m_cam_params.shutterSpeed=0;//auto
     m_cam_params.awbg_red=0;
     m_cam_params.awbg_blue=0;
+
+    m_h264_config.bitrate = 17000000;
+    m_h264_config.profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+    m_h264_config.level = MMAL_VIDEO_LEVEL_H264_4;
+    m_h264_config.intraPeriod = 0;
+    m_h264_config.rateControl = MMAL_VIDEO_RATECONTROL_DEFAULT;
+    m_h264_config.initialQuant = 0;
+    m_h264_config.minQuant = 0;
+    m_h264_config.maxQuant = 0;
+    m_h264_config.inlineHeaders = false;
+    m_h264_config.lowLatency = false;
+    m_h264_config.separateNalBuffers = false;
+    m_h264_config.mbRowsPerSlice = 0;
+
+    m_video_substream.width = 640;
+    m_video_substream.height = 480;
+    m_video_substream.config = m_h264_config;
+    m_video_substream.config.bitrate = VIDEO_SUBSTREAM_DEFAULT_BITRATE;
 }
 
 
@@ -101,8 +138,32 @@ void VideoMMALObject::setStillPreviewSize(unsigned int record_width, unsigned in
 
 void VideoMMALObject::setStillRecordSize(unsigned int record_width, unsigned int record_height)
 {
+    if ( record_width == m_still_record_width && record_height == m_still_record_height ) return;
     m_still_record_width = record_width;
     m_still_record_height = record_height;
+    // a kept still pipeline is built again with the new size
+    if ( isStillPipelineReady() && !isStillRecording() ) {
+        destroyStillEncoderComponent();
+        if ( m_still_pipeline_persistent ) createStillEncoderComponent();
+    }
+}
+
+/**
+ * @brief VideoMMALObject::setStillPipelinePersistent
+ * Keep the still port format, the JPEG encoder, its connection and its pool between the captures:
+ * startStillRecord then only sets the sink and triggers the capture. The pipeline is built now,
+ * so the first capture is fast too.
+ * @param persistent : false destroys the pipeline, each capture builds its own again
+ */
+void VideoMMALObject::setStillPipelinePersistent(bool persistent)
+{
+    m_still_pipeline_persistent = persistent;
+    if ( isStillRecording() ) return;
+    if ( persistent && !isStillPipelineReady() ) {
+        if (!isOpened()) open();
+        createStillEncoderComponent();
+    }
+    else if ( !persistent && isStillPipelineReady() ) destroyStillEncoderComponent();
 }
 
 
@@ -117,9 +178,10 @@ void VideoMMALObject::startVideoPreview()
 void VideoMMALObject::stopVideoPreview()
 {
     if (!isOpened() || !areVideoComponentsReady() || !isVideoPreviewOpened()) return;
+    preview_callback_data.cancelWaiters();
     destroyVideoPreviewComponent();
     m_is_video_preview_opened = false;
-    if (!isVideoRecording() && areVideoComponentsReady()) destroyVideoComponents();
+    if (!isVideoRecording() && !isVideoSubstreamRecording() && !hasPreviewStreams() && areVideoComponentsReady()) destroyVideoComponents();
 }
 
 void VideoMMALObject::startStillPreview()
@@ -132,56 +194,397 @@ void VideoMMALObject::startStillPreview()
 void VideoMMALObject::stopStillPreview()
 {
     if (!isOpened() || !isStillPreviewOpened()) return;
+    preview_callback_data.cancelWaiters();
     destroyStillPreviewComponent();
     m_is_still_preview_opened = false;
 }
 
 void VideoMMALObject::startVideoRecord(std::string filename)
 {
+    openVideoRecord(filename, NULL);
+}
+
+/**
+ * @brief VideoMMALObject::startVideoRecord
+ * Start the video encoder and give its output to a sink instead of a file.
+ * @param sink : receiver of the H.264 stream, must live until stopVideoRecord
+ */
+void VideoMMALObject::startVideoRecord(EncodedSink *sink)
+{
+    openVideoRecord(std::string(), sink);
+}
+
+/**
+ * @brief VideoMMALObject::startVideoRecord
+ * Record in a file and give the same stream to a sink, for instance a StreamServer.
+ * @param filename : file of the record, see startVideoRecord
+ * @param sink : receiver of the H.264 stream, must live until stopVideoRecord
+ */
+void VideoMMALObject::startVideoRecord(std::string filename, EncodedSink *sink)
+{
+    openVideoRecord(filename, sink);
+}
+
+void VideoMMALObject::openVideoRecord(const std::string &filename, EncodedSink *sink)
+{
+    if (isVideoRecording()) stopVideoRecord();
+    if (!areVideoComponentsReady()) createVideoComponents();
+    m_video_record_filename = filename;
+    m_record_writer.setSink(sink);
+    m_record_writer.setEventRing(std::chrono::milliseconds(0), 0);
+    createVideoEncoderComponent();
+    m_is_video_recording = m_record_writer.isRunning();
+}
+
+/**
+ * @brief VideoMMALObject::startEventRing
+ * Start the video encoder without file: the last 'duration' of encoded video is kept in memory
+ * until triggerEventRecord writes it. Stopped by stopVideoRecord.
+ * @param duration : time kept before the events
+ * @param max_bytes : memory of the ring, 0 to size it from the encoder bitrate
+ */
+void VideoMMALObject::startEventRing(std::chrono::milliseconds duration, size_t max_bytes)
+{
+    if (isVideoRecording()) stopVideoRecord();
     if (!areVideoComponentsReady()) createVideoComponents();
-    if (encoder_callback_data.file) delete encoder_callback_data.file;
-    encoder_callback_data.file = new ofstream(filename, ios::out|ios::binary|ios::app);
+    m_video_record_filename.clear();
+    m_record_writer.setSink(NULL);
+    m_record_writer.setEventRing(duration, max_bytes);
     createVideoEncoderComponent();
-    m_is_video_recording = true;
+    m_is_video_recording = m_record_writer.isRunning();
+}
+
+/**
+ * @brief VideoMMALObject::triggerEventRecord
+ * Write the encoded video from 'pre' before now to 'post' after now in 'filename'.
+ * @return false if startEventRing was not called
+ */
+bool VideoMMALObject::triggerEventRecord(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post)
+{
+    if (!isVideoRecording()) return false;
+    return m_record_writer.trigger(filename, pre, post);
 }
 void VideoMMALObject::stopVideoRecord()
 {
     if (!isOpened() || !areVideoComponentsReady() || !isVideoRecording()) return;
     destroyVideoEncoderComponent();
-    if (encoder_callback_data.file->is_open())
-        encoder_callback_data.file->close();
 
     m_is_video_recording = false;
-    if (!isVideoPreviewOpened() && areVideoComponentsReady()) destroyVideoComponents();
+    if (!isVideoPreviewOpened() && !isVideoSubstreamRecording() && !hasPreviewStreams() && areVideoComponentsReady()) destroyVideoComponents();
+}
+
+/**
+ * @brief VideoMMALObject::startVideoSubstream
+ * Record a second, downscaled video in parallel of the main video record: a splitter output is resized
+ * by an ISP and encoded by its own H.264 encoder, with the settings of setVideoSubstreamEncoderConfig.
+ * @param filename : file of the substream, same naming as startVideoRecord
+ * @param width : width of the substream
+ * @param height : height of the substream
+ * @return false if no splitter output is free or the components can't be set up
+ */
+bool VideoMMALObject::startVideoSubstream(const std::string &filename, unsigned int width, unsigned int height)
+{
+    return openVideoSubstream(filename, NULL, width, height);
+}
+
+/**
+ * @brief VideoMMALObject::startVideoSubstream
+ * Same as startVideoSubstream with a file, the substream is given to a sink.
+ * @param sink : receiver of the H.264 substream, must live until stopVideoSubstream
+ */
+bool VideoMMALObject::startVideoSubstream(EncodedSink *sink, unsigned int width, unsigned int height)
+{
+    return openVideoSubstream(std::string(), sink, width, height);
+}
+
+bool VideoMMALObject::openVideoSubstream(const std::string &filename, EncodedSink *sink, unsigned int width, unsigned int height)
+{
+    if (isVideoSubstreamRecording()) stopVideoSubstream();
+    if (!areVideoComponentsReady()) createVideoComponents();
+    if (!areVideoComponentsReady()) return false;
+
+    m_video_substream.writer.setSink(sink);
+    m_video_substream.width = width;
+    m_video_substream.height = height;
+    if ( !createVideoSubstreamComponents(filename) ) {
+        if (!isVideoPreviewOpened() && !isVideoRecording() && !isVideoSubstreamRecording() && !hasPreviewStreams()) destroyVideoComponents();
+        return false;
+    }
+    m_is_video_substream_recording = true;
+    return true;
+}
+
+void VideoMMALObject::stopVideoSubstream()
+{
+    if (!isOpened() || !areVideoComponentsReady() || !isVideoSubstreamRecording()) return;
+    destroyVideoSubstreamComponents();
+
+    m_is_video_substream_recording = false;
+    if (!isVideoPreviewOpened() && !isVideoRecording() && !hasPreviewStreams() && areVideoComponentsReady()) destroyVideoComponents();
+}
+
+/**
+ * @brief VideoMMALObject::setVideoSubstreamBitrate
+ * Same as setVideoBitrate for the substream encoder.
+ */
+bool VideoMMALObject::setVideoSubstreamBitrate(unsigned int bitrate)
+{
+    return setEncoderBitrate(m_video_substream.encoder, m_video_substream.config, bitrate);
 }
 
 void VideoMMALObject::startStillRecord(std::string filename)
 {
+    FileSink sink(filename);
+    startStillRecord(&sink);
+}
+
+/**
+ * @brief VideoMMALObject::startStillRecord
+ * Capture a still image and give the encoded image to a sink, returns once the image is complete.
+ * The still pipeline is built for the capture, or reused when kept by setStillPipelinePersistent.
+ * @param sink : receiver of the encoded image
+ */
+void VideoMMALObject::startStillRecord(EncodedSink *sink)
+{
+    STILL_CAPTURE_RESULT result = captureStillAsync(sink).get();
+    if ( result.status != STILL_CAPTURE_SUCCESS ) cerr << "Still capture failed: " << result.status << endl;
+    finishStillCapture();
+}
+
+/**
+ * @brief VideoMMALObject::finishStillCapture
+ * Stop the capture on the still port and destroy the still pipeline when it is not persistent.
+ */
+void VideoMMALObject::finishStillCapture()
+{
+    if ( !isStillPipelineReady() ) return;
+    mmal_port_parameter_set_boolean ( camera_still_output_port, MMAL_PARAMETER_CAPTURE, 0 );
+    if ( !m_still_pipeline_persistent ) destroyStillEncoderComponent();
+}
+
+/**
+ * @brief VideoMMALObject::captureStillAsync
+ * Start the capture of a still image and return without waiting for it. The encoder callback gives
+ * the image to the sink, closes the sink and then makes the future ready, so the caller can prepare
+ * the next capture or process the previous image meanwhile. One capture at a time, a call from
+ * another thread during a capture gets STILL_CAPTURE_BUSY.
+ * Without setStillPipelinePersistent, the still pipeline is kept until startStillRecord,
+ * setStillPipelinePersistent(false) or release.
+ * @param sink : receiver of the encoded image, must live until the future is ready, NULL gives STILL_CAPTURE_SINK_ERROR
+ * @return future of the capture result, ready at once when the capture couldn't start
+ */
+std::future<STILL_CAPTURE_RESULT> VideoMMALObject::captureStillAsync(EncodedSink *sink)
+{
+    return startStillCapture(sink, MMAL_TIME_UNKNOWN, std::chrono::microseconds(0));
+}
+
+/**
+ * @brief VideoMMALObject::captureStillAt
+ * Same as captureStillAsync for a trigger that happened before the call, for instance stamped by
+ * getCameraTime in the handler of a hardware trigger. With setZeroShutterLag, the camera gives the
+ * last frame it captured when the request arrives instead of exposing a new one after a sensor mode
+ * switch, so the image is the one of the trigger when the request follows it within a frame. The
+ * frame is chosen by the camera firmware, the pts of the result tells how far it is from the trigger.
+ * @param sink : receiver of the encoded image, must live until the future is ready
+ * @param trigger : instant of the trigger in the camera clock (microseconds, see getCameraTime)
+ * @param look_back : oldest trigger still captured, an older one gives STILL_CAPTURE_MISSED without
+ * opening the sink
+ * @return future of the capture result
+ */
+std::future<STILL_CAPTURE_RESULT> VideoMMALObject::captureStillAt(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back)
+{
+    return startStillCapture(sink, trigger, look_back);
+}
+
+/**
+ * @brief VideoMMALObject::startStillCapture
+ * Start a capture for captureStillAsync and captureStillAt.
+ * @param trigger : MMAL_TIME_UNKNOWN for a capture without trigger
+ */
+std::future<STILL_CAPTURE_RESULT> VideoMMALObject::startStillCapture(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back)
+{
+    STILL_CAPTURE_RESULT result;
+    result.status = STILL_CAPTURE_SUCCESS;
+    result.size = 0;
+    result.pts = MMAL_TIME_UNKNOWN;
+    result.trigger = trigger;
+    result.requested = result.completed = std::chrono::steady_clock::now();
+    std::promise<STILL_CAPTURE_RESULT> promise;
+    std::future<STILL_CAPTURE_RESULT> future = promise.get_future();
+    if ( !sink ) {
+        cerr << "No still record sink" << endl;
+        result.status = STILL_CAPTURE_SINK_ERROR;
+        promise.set_value(result);
+        return future;
+    }
+
+    {
+        // reserved before the sink is opened, a concurrent capture finds it busy
+        std::unique_lock<std::mutex> lck ( encoder_callback_data.capture_mutex );
+        if ( encoder_callback_data.capture_pending ) result.status = STILL_CAPTURE_BUSY;
+        else {
+            encoder_callback_data.sink = NULL;
+            encoder_callback_data.capture_result = result;
+            encoder_callback_data.capture_promise = std::move(promise);
+            encoder_callback_data.capture_pending = true;
+        }
+    }
+    if ( result.status == STILL_CAPTURE_BUSY ) {
+        promise.set_value(result);
+        return future;
+    }
+
+    STILL_CAPTURE_STATUS_T status = STILL_CAPTURE_SUCCESS;
     if (!isOpened()) open();
-    //if (encoder_callback_data.file) delete encoder_callback_data.file;
-    encoder_callback_data.file = new ofstream(filename, ios::out|ios::binary|ios::app);
-    cerr << "Create still encoder" << endl;
-    createStillEncoderComponent();
-    m_is_still_recording = true;
-    cerr << "record encoded image" << endl;
+    if ( trigger != MMAL_TIME_UNKNOWN ) {
+        // checked before the sink is opened, a missed trigger leaves no empty file
+        int64_t now = getCameraTime();
+        if ( now == MMAL_TIME_UNKNOWN || now - trigger > look_back.count() ) {
+            cerr << "Still trigger older than the look-back" << endl;
+            status = STILL_CAPTURE_MISSED;
+        }
+    }
+    if ( status == STILL_CAPTURE_SUCCESS ) {
+        if ( !sink->open() ) {
+            cerr << "Unable to open the still record sink" << endl;
+            status = STILL_CAPTURE_SINK_ERROR;
+        }
+        else if ( !isStillPipelineReady() && !createStillEncoderComponent() ) {
+            sink->close();
+            status = STILL_CAPTURE_FAILED;
+        }
+    }
+    {
+        // the callback only handles a capture once its sink is set
+        std::unique_lock<std::mutex> lck ( encoder_callback_data.capture_mutex );
+        if ( status != STILL_CAPTURE_SUCCESS ) {
+            encoder_callback_data.completeCapture(status);
+            return future;
+        }
+        encoder_callback_data.sink = sink;
+    }
     if ( mmal_port_parameter_set_boolean ( camera_still_output_port, MMAL_PARAMETER_CAPTURE, 1 ) != MMAL_SUCCESS ) {
-        destroyStillEncoderComponent();
-        m_is_still_recording = false;
-        return;
+        cerr << "Unable to start the still capture" << endl;
+        std::unique_lock<std::mutex> lck ( encoder_callback_data.capture_mutex );
+        encoder_callback_data.completeCapture(STILL_CAPTURE_FAILED);
     }
+    return future;
+}
 
-    cerr << "waiting encoded image" << endl;
-    while(!encoder_callback_data.encode_completed){
-        vcos_sleep(10);
-    }
-    cerr << "end waiting encoded image" << endl;
-    mmal_port_parameter_set_boolean ( camera_still_output_port, MMAL_PARAMETER_CAPTURE, 0 );
+/**
+ * @brief VideoMMALObject::setZeroShutterLag
+ * Create the camera in zero shutter lag mode: the sensor stays in its still mode and keeps capturing,
+ * a still capture gives the last captured frame. Applied when the camera is opened, so it must be set
+ * before open() or followed by release() and open().
+ * @param enable : true for the zero shutter lag mode
+ */
+void VideoMMALObject::setZeroShutterLag(bool enable)
+{
+    m_zero_shutter_lag = enable;
+    if ( isOpened() ) cerr << "The zero shutter lag mode is applied when the camera is opened again" << endl;
+}
 
-    cerr << "stop record encoded image" << endl;
+/**
+ * @brief VideoMMALObject::getCameraTime
+ * Current time of the camera clock, the clock of the pts of the frames and images.
+ * @return microseconds, MMAL_TIME_UNKNOWN when the camera is not opened
+ */
+int64_t VideoMMALObject::getCameraTime()
+{
+    uint64_t stc;
+    if ( !camera_component || mmal_port_parameter_get_uint64 ( camera_component->control, MMAL_PARAMETER_SYSTEM_TIME, &stc ) != MMAL_SUCCESS )
+        return MMAL_TIME_UNKNOWN;
+    return ( int64_t ) stc;
+}
 
-    destroyStillEncoderComponent();
-    cerr << "destroy still encoder" << endl;
-    m_is_still_recording = false;
+/**
+ * @brief VideoMMALObject::captureBurst
+ * Capture still images with the camera in burst mode, so the sensor stays in its still mode between
+ * the images, and the still pipeline built once. Each image is encoded in memory, then given to its
+ * sink by a background writer while the next one is exposed. At most STILL_BURST_QUEUE_SIZE images
+ * wait for the writer, the captures wait when it is late. The burst stops on a failed capture.
+ * @param count : images to capture
+ * @param interval : time between the starts of two captures, 0 for as fast as possible
+ * @param sink_factory : gives the sink of each image, called on the writer thread
+ * @return result of each image, STILL_CAPTURE_SINK_ERROR when its sink couldn't be created or opened,
+ * all STILL_CAPTURE_FAILED when the camera couldn't be opened. Returns once all the images are written.
+ */
+std::vector<STILL_CAPTURE_RESULT> VideoMMALObject::captureBurst(unsigned int count, std::chrono::milliseconds interval, STILL_SINK_FACTORY_T sink_factory)
+{
+    STILL_CAPTURE_RESULT skipped;
+    skipped.status = STILL_CAPTURE_FAILED;
+    skipped.size = 0;
+    skipped.pts = MMAL_TIME_UNKNOWN;
+    skipped.trigger = MMAL_TIME_UNKNOWN;
+    skipped.requested = skipped.completed = std::chrono::steady_clock::now();
+    std::vector<STILL_CAPTURE_RESULT> results(count, skipped);
+    if ( !count ) return results;
+
+    if (!isOpened()) open();
+    if ( !isOpened() || !camera_component ) {
+        cerr << "Unable to open the camera for the burst" << endl;
+        return results;
+    }
+    if ( mmal_port_parameter_set_boolean(camera_component->control, MMAL_PARAMETER_CAMERA_BURST_CAPTURE, MMAL_TRUE) != MMAL_SUCCESS )
+        cerr << "Unable to set the camera burst mode" << endl;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<unsigned int, std::vector<unsigned char>>> queue;
+    bool capturing = true;
+
+    std::thread writer([&]() {
+        std::unique_lock<std::mutex> lck ( mutex );
+        while ( true ) {
+            cv.wait ( lck, [&]{ return !queue.empty() || !capturing; } );
+            if ( queue.empty() ) break;
+            std::pair<unsigned int, std::vector<unsigned char>> image = std::move(queue.front());
+            queue.pop_front();
+            int64_t pts = results[image.first].pts;
+            cv.notify_all();
+            lck.unlock();
+
+            std::unique_ptr<EncodedSink> sink = sink_factory(image.first);
+            bool written = sink && sink->open();
+            if ( written ) {
+                ENCODED_CHUNK chunk = { image.second.data(), image.second.size(), MMAL_BUFFER_HEADER_FLAG_FRAME_END, pts };
+                sink->write(chunk);
+                sink->close();
+            }
+            else cerr << "Unable to open the sink of the burst image " << image.first << endl;
+            lck.lock();
+            if ( !written ) results[image.first].status = STILL_CAPTURE_SINK_ERROR;
+        }
+    });
+
+    std::vector<unsigned char> image;
+    CallbackSink collector([&image](const ENCODED_CHUNK &chunk) { image.insert(image.end(), chunk.data, chunk.data + chunk.size); });
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    for ( unsigned int i = 0; i < count; i++ ) {
+        std::this_thread::sleep_until(next);
+        next += interval;
+        image.clear();
+        STILL_CAPTURE_RESULT result = captureStillAsync(&collector).get();
+        std::unique_lock<std::mutex> lck ( mutex );
+        results[i] = result;
+        if ( result.status != STILL_CAPTURE_SUCCESS ) {
+            cerr << "Burst stopped on image " << i << ": " << result.status << endl;
+            break;
+        }
+        cv.wait ( lck, [&]{ return queue.size() < STILL_BURST_QUEUE_SIZE; } );
+        queue.emplace_back(i, std::move(image));
+        cv.notify_all();
+    }
+    {
+        std::unique_lock<std::mutex> lck ( mutex );
+        capturing = false;
+    }
+    cv.notify_all();
+    writer.join();
+
+    mmal_port_parameter_set_boolean(camera_component->control, MMAL_PARAMETER_CAMERA_BURST_CAPTURE, MMAL_FALSE);
+    finishStillCapture();
+    return results;
 }
 
 /**
@@ -235,62 +638,549 @@ void VideoMMALObject::commitParameters()
  * @brief release : Release all the camera components.
  * Stop preview and recording if running
  */
-void VideoMMALObject::release()
+void VideoMMALObject::release()
+{
+    if (!isOpened()) return;
+    if (isVideoRecording()) stopVideoRecord();
+    if(areVideoComponentsReady()) destroyVideoComponents();
+    if (isStillPreviewOpened()) stopStillPreview();
+    if (isStillPipelineReady()) destroyStillEncoderComponent();
+    destroyCameraComponent();
+    m_is_opened = false;
+}
+
+bool VideoMMALObject::grab()
+{
+    return grab(GRAB_INFINITE) == GRAB_SUCCESS;
+}
+
+/**
+ * @brief VideoMMALObject::grab
+ * Wait for a preview frame and keep a copy of it for retrieve().
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_CANCELLED or GRAB_NOT_OPENED
+ */
+GRAB_STATUS_T VideoMMALObject::grab(std::chrono::milliseconds timeout)
+{
+    if ( !isOpened() || (!isStillPreviewOpened() && !isVideoPreviewOpened())) return GRAB_NOT_OPENED;
+    return grabFrom(preview_callback_data, timeout);
+}
+
+/**
+ * @brief VideoMMALObject::grabFrom
+ * Wait for a frame of a preview port and copy it in the frame ring of the port.
+ * @param pData : userdata of the preview port
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME or GRAB_CANCELLED
+ */
+GRAB_STATUS_T VideoMMALObject::grabFrom(PORT_PREVIEW_USERDATA &pData, std::chrono::milliseconds timeout)
+{
+    if ( m_preview_grab_mode == PREVIEW_GRAB_LATEST_FRAME ) {
+        MMAL_BUFFER_HEADER_T *buffer;
+        GRAB_STATUS_T status = pData.takeLatest(timeout, &buffer);
+        if ( status != GRAB_SUCCESS ) return status;
+        {
+            std::unique_lock<std::mutex> lck ( pData._mutex );
+            pData.storeInRing(buffer);
+        }
+        pData.releaseLease(buffer);
+        return GRAB_SUCCESS;
+    }
+    return pData.waitForFrame(timeout);
+}
+
+/**
+ * @brief VideoMMALObject::tryGrab
+ * Grab without waiting. In PREVIEW_GRAB_NEXT_FRAME mode, a failed try asks the callback to
+ * keep the next frame, which is then returned by the following try.
+ * @return GRAB_SUCCESS, GRAB_NO_FRAME or GRAB_NOT_OPENED
+ */
+GRAB_STATUS_T VideoMMALObject::tryGrab()
+{
+    if ( !isOpened() || (!isStillPreviewOpened() && !isVideoPreviewOpened())) return GRAB_NOT_OPENED;
+    if ( m_preview_grab_mode == PREVIEW_GRAB_LATEST_FRAME )
+        return grab(std::chrono::milliseconds(0));
+    return preview_callback_data.tryFrame();
+}
+
+/**
+ * @brief VideoMMALObject::cancelGrab
+ * Wake up all the threads waiting in grab() or grabLease(), they return GRAB_CANCELLED.
+ */
+void VideoMMALObject::cancelGrab()
+{
+    preview_callback_data.cancelWaiters();
+}
+
+/**
+ * @brief VideoMMALObject::setPreviewGrabMode
+ * Select the frame returned by grab() and grabLease(), for the preview and the preview streams.
+ * PREVIEW_GRAB_NEXT_FRAME waits for the frame following the call.
+ * PREVIEW_GRAB_LATEST_FRAME keeps the newest frame in a mailbox so that grabbing returns
+ * immediately once the preview produced a frame. The mailbox holds one preview buffer.
+ * @param mode
+ */
+void VideoMMALObject::setPreviewGrabMode(PREVIEW_GRAB_MODE_T mode)
+{
+    m_preview_grab_mode = mode;
+    preview_callback_data.mailbox_mode = ( mode == PREVIEW_GRAB_LATEST_FRAME );
+    if ( mode != PREVIEW_GRAB_LATEST_FRAME ) preview_callback_data.drainMailbox();
+    for ( auto &stream : m_preview_streams ) {
+        stream.second->callback_data.mailbox_mode = ( mode == PREVIEW_GRAB_LATEST_FRAME );
+        if ( mode != PREVIEW_GRAB_LATEST_FRAME ) stream.second->callback_data.drainMailbox();
+    }
+}
+
+/**
+ * @brief VideoMMALObject::getGrabbedFrameAge
+ * @return the time elapsed since the camera delivered the frame of the last grab()
+ */
+std::chrono::microseconds VideoMMALObject::getGrabbedFrameAge()
+{
+    std::unique_lock<std::mutex> lck ( preview_callback_data._mutex );
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - preview_callback_data.grabbed_stamp.receive_time);
+}
+
+/**
+ * @brief VideoMMALObject::getFrameInfo
+ * @return the pts, sequence number, drop count and latency of the frame of the last grab()
+ */
+FRAME_INFO VideoMMALObject::getFrameInfo()
+{
+    std::unique_lock<std::mutex> lck ( preview_callback_data._mutex );
+    return preview_callback_data.grabbed_info;
+}
+
+/**
+ * @brief VideoMMALObject::retrieve
+ * Retrieve the preview image data captured by the camera with the preview image format
+ * Supported formats are : I420, RGB24, BGR24, RGBA, BGRA, GREY (Y plane only)
+ * @param data : pointer to array that will be filled with image data
+ *
+ */
+void VideoMMALObject::retrieve(unsigned char *data)
+{
+    retrieve(data, 0);
+}
+
+/**
+ * @brief VideoMMALObject::retrieve
+ * Retrieve the preview image data into an array with its own line stride.
+ * Each plane is copied at its real offset and pitch, with one memcpy per plane when the
+ * strides of the preview and of the array match.
+ * @param data : pointer to array that will be filled with image data
+ * @param stride : line stride of data in bytes (of the Y plane for I420, chroma planes use
+ * half of it), 0 for lines without padding
+ */
+void VideoMMALObject::retrieve(unsigned char *data, unsigned int stride)
+{
+    retrieveFrom(preview_callback_data, data, stride);
+}
+
+/**
+ * @brief VideoMMALObject::retrieveFrom
+ * Copy, or convert, the last grabbed frame of a preview port.
+ * @param pData : userdata of the preview port
+ * @param data : pointer to array that will be filled with image data
+ * @param stride : line stride of data in bytes, 0 for lines without padding
+ */
+void VideoMMALObject::retrieveFrom(PORT_PREVIEW_USERDATA &pData, unsigned char *data, unsigned int stride)
+{
+    size_t buffer_length;
+    const unsigned char * imagePtr;
+    FRAME_LAYOUT layout;
+    int output_format;
+    {
+        std::unique_lock<std::mutex> lck ( pData._mutex );
+        imagePtr = pData.ring.latest(&buffer_length);
+        layout = pData.grabbed_layout;
+        output_format = pData.output_format;
+    }
+    if ( buffer_length == 0 ) return;
+
+    if ( output_format )
+        m_color_converter.convert ( imagePtr, layout, data, output_format, stride );
+    else
+        copyFrame ( imagePtr, layout, data, stride );
+}
+
+/**
+ * @brief VideoMMALObject::grabLease
+ * Wait for the next preview frame and keep its MMAL buffer instead of copying it.
+ * Works for both Video and Still preview.
+ * @return a lease on the frame buffer, invalid if no preview is opened
+ */
+FrameLease VideoMMALObject::grabLease()
+{
+    FrameLease lease;
+    grabLease(lease, GRAB_INFINITE);
+    return lease;
+}
+
+/**
+ * @brief VideoMMALObject::grabLease
+ * Wait for a preview frame and keep its MMAL buffer instead of copying it.
+ * @param lease : filled with the frame on success, released otherwise
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME, GRAB_CANCELLED or GRAB_NOT_OPENED
+ */
+GRAB_STATUS_T VideoMMALObject::grabLease(FrameLease &lease, std::chrono::milliseconds timeout)
+{
+    lease.release();
+    if ( !isOpened() || (!isStillPreviewOpened() && !isVideoPreviewOpened())) return GRAB_NOT_OPENED;
+    return grabLeaseFrom(preview_callback_data, lease, timeout);
+}
+
+/**
+ * @brief VideoMMALObject::grabLeaseFrom
+ * Wait for a frame of a preview port and keep its MMAL buffer.
+ * @param pData : userdata of the preview port
+ * @param lease : filled with the frame on success
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME or GRAB_CANCELLED
+ */
+GRAB_STATUS_T VideoMMALObject::grabLeaseFrom(PORT_PREVIEW_USERDATA &pData, FrameLease &lease, std::chrono::milliseconds timeout)
+{
+    MMAL_BUFFER_HEADER_T *buffer;
+    GRAB_STATUS_T status;
+    if ( m_preview_grab_mode == PREVIEW_GRAB_LATEST_FRAME )
+        status = pData.takeLatest(timeout, &buffer);
+    else
+        status = pData.waitForLease(timeout, &buffer);
+    if ( status == GRAB_SUCCESS ) {
+        uint64_t dropped = 0;
+        if ( buffer->user_data ) {
+            std::unique_lock<std::mutex> lck ( pData._mutex );
+            dropped = pData.grabDrops ( *( FRAME_STAMP * ) buffer->user_data );
+        }
+        lease = FrameLease(buffer, &pData, pData.layout, dropped);
+    }
+    return status;
+}
+
+/**
+ * @brief VideoMMALObject::retrieveBatch
+ * Collect consecutive preview frames directly into a caller buffer, for batch processing.
+ * The callback only keeps a reference on each frame in a dedicated ring, the copy is done
+ * on the calling thread. The ring holds up to 'count' frames, limited to the pool buffers the
+ * preview port can spare (PREVIEW_LEASE_BUFFERS_NUM or more): frames are lost only when the copy
+ * is slower than the camera for longer than the ring, or when the camera itself drops them.
+ * @param count : number of frames to collect
+ * @param data : destination of count frames, each one of the size of retrieve() output
+ * @param layout : BATCH_LAYOUT_NHWC (interleaved channels) or BATCH_LAYOUT_NCHW (one plane per channel)
+ * @param timestamps : if not NULL, filled with the pts of each frame (microseconds since the first frame of the preview)
+ * @param timeout : maximum wait for each frame
+ * @return GRAB_SUCCESS if the batch is complete, GRAB_FRAMES_LOST if it is complete but its frames
+ * are not consecutive (see the timestamps), the status of the failing wait otherwise
+ */
+GRAB_STATUS_T VideoMMALObject::retrieveBatch(unsigned int count, unsigned char *data, BATCH_LAYOUT_T layout,
+                                             std::vector<int64_t> *timestamps, std::chrono::milliseconds timeout)
+{
+    if ( !isOpened() || (!isStillPreviewOpened() && !isVideoPreviewOpened())) return GRAB_NOT_OPENED;
+
+    PORT_PREVIEW_USERDATA &pData = preview_callback_data;
+    std::unique_lock<std::mutex> batch_lck ( pData.batch_mutex );
+    FRAME_LAYOUT frame_layout = pData.layout;
+    int output_format = pData.output_format;
+    // layout of the frames written in data
+    FRAME_LAYOUT output_layout = output_format ? packedFrameLayout(output_format, frame_layout.width, frame_layout.height) : frame_layout;
+    size_t frame_size = packedFrameSize(output_layout);
+    if ( timestamps ) timestamps->clear();
+
+    // converted frames are deinterleaved from a scratch frame
+    std::vector<unsigned char> converted;
+    if ( output_format && layout == BATCH_LAYOUT_NCHW ) converted.resize(frame_size);
+
+    {
+        std::unique_lock<std::mutex> lck ( pData._mutex );
+        pData.resetBatch(count);
+        pData.batch_active = true;
+    }
+
+    GRAB_STATUS_T status = GRAB_SUCCESS;
+    // gaps in the frame sequence, the frames lost by the ring or before the callback
+    uint64_t lost = 0;
+    uint64_t previous_sequence = 0;
+    for ( unsigned int i = 0; i < count && status == GRAB_SUCCESS; i++ ) {
+        MMAL_BUFFER_HEADER_T *buffer = NULL;
+        {
+            std::unique_lock<std::mutex> lck ( pData._mutex );
+            status = pData.waitGrab ( lck, timeout, [&pData]{ return pData.batch_count > 0; } );
+            if ( status == GRAB_SUCCESS ) buffer = pData.popBatch();
+        }
+        if ( !buffer ) break;
+
+        FrameLease lease ( buffer, &pData, frame_layout );
+        const unsigned char *frame = buffer->data + buffer->offset;
+        if ( !output_format )
+            copyFramePacked ( frame, lease.getLayout(), data + i*frame_size, layout );
+        else if ( converted.empty() )
+            m_color_converter.convert ( frame, lease.getLayout(), data + i*frame_size, output_format, 0 );
+        else {
+            m_color_converter.convert ( frame, lease.getLayout(), converted.data(), output_format, 0 );
+            copyFramePacked ( converted.data(), output_layout, data + i*frame_size, layout );
+        }
+        FRAME_INFO info = lease.getInfo();
+        if ( i > 0 && info.sequence > previous_sequence + 1 ) lost += info.sequence - previous_sequence - 1;
+        previous_sequence = info.sequence;
+        if ( timestamps ) timestamps->push_back ( info.pts );
+    }
+
+    // give back the frames that arrived after the batch was complete
+    std::vector<MMAL_BUFFER_HEADER_T *> remaining;
+    {
+        std::unique_lock<std::mutex> lck ( pData._mutex );
+        pData.batch_active = false;
+        while ( pData.batch_count ) remaining.push_back ( pData.popBatch() );
+    }
+    for ( MMAL_BUFFER_HEADER_T *buffer : remaining ) pData.releaseLease ( buffer );
+
+    if ( status == GRAB_SUCCESS && lost ) {
+        cerr << "retrieveBatch: " << lost << " frames lost within the batch" << endl;
+        status = GRAB_FRAMES_LOST;
+    }
+    return status;
+}
+
+/**
+ * @brief VideoMMALObject::subscribeFrames
+ * Register a consumer that is pushed every preview frame on its own delivery thread.
+ * Frames are delivered as leases on the preview buffers, without copy.
+ * The subscription survives preview restarts, queued frames are dropped when a preview stops.
+ * @param callback : function called for each frame on the delivery thread of the subscriber
+ * @param policy : behaviour when the subscriber queue is full
+ * @param queue_depth : number of frames that can wait for delivery
+ * @return the id of the subscriber, used to unsubscribe
+ */
+int VideoMMALObject::subscribeFrames(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth)
+{
+    std::unique_lock<std::mutex> lck ( preview_callback_data.subscribers_mutex );
+    int id = preview_callback_data.next_subscriber_id++;
+    preview_callback_data.subscribers[id] = std::make_shared<FrameSubscriber>(callback, policy, queue_depth);
+    return id;
+}
+
+/**
+ * @brief VideoMMALObject::unsubscribeFrames
+ * Stop the delivery thread of a subscriber and give back its queued frames.
+ * @param subscriber_id : id returned by subscribeFrames
+ */
+void VideoMMALObject::unsubscribeFrames(int subscriber_id)
+{
+    std::shared_ptr<FrameSubscriber> subscriber;
+    {
+        std::unique_lock<std::mutex> lck ( preview_callback_data.subscribers_mutex );
+        auto it = preview_callback_data.subscribers.find(subscriber_id);
+        if ( it == preview_callback_data.subscribers.end() ) return;
+        subscriber = std::move(it->second);
+        preview_callback_data.subscribers.erase(it);
+    }
+    subscriber->stop();
+}
+
+/**
+ * @brief VideoMMALObject::setCpuColorConversion
+ * Convert the preview frames on the CPU instead of the ISP. The preview port then produces
+ * I420 and retrieve() and retrieveBatch() convert the frames to the preview image format
+ * with the NEON (or SSE2) kernels, which lifts the ISP limit on RGB preview sizes.
+ * Leases and subscribers get the I420 frames. Formats that can't be converted still go through the ISP.
+ * /!\ Only applied when a preview is started.
+ * @param enable : true to convert on the CPU
+ * @param matrix : matrix used by the camera for the I420 frames and by the conversion
+ * @param range : range of the I420 frames
+ */
+void VideoMMALObject::setCpuColorConversion(bool enable, COLOR_MATRIX_T matrix, COLOR_RANGE_T range)
+{
+    m_cpu_color_conversion = enable;
+    m_color_converter.setMatrix(matrix, range);
+}
+
+/**
+ * @brief VideoMMALObject::previewPortFormat
+ * @param preview_format : format requested for the preview
+ * @return the format the preview port must produce
+ */
+int VideoMMALObject::previewPortFormat(int preview_format)
+{
+    // GREY previews are the Y plane of I420 frames
+    if ( preview_format == MMAL_ENCODING_GREY ) return MMAL_ENCODING_I420;
+    if ( m_cpu_color_conversion && ColorConverter::isSupported(preview_format) ) return MMAL_ENCODING_I420;
+    return preview_format;
+}
+
+/**
+ * @brief VideoMMALObject::setPreviewLayout
+ * Describe the frames of the preview port for the grabs and leases, and select the
+ * conversion done by retrieve().
+ * @param pData : userdata of the preview port
+ * @param port : preview port, with its format committed
+ * @param preview_format : format requested for the preview
+ */
+void VideoMMALObject::setPreviewLayout(PORT_PREVIEW_USERDATA &pData, MMAL_PORT_T *port, int preview_format)
+{
+    FRAME_LAYOUT layout = computeFrameLayout(port->format);
+    int output_format = 0;
+    if ( preview_format == MMAL_ENCODING_GREY ) layout = lumaFrameLayout(layout);
+    else if ( (int) port->format->encoding != preview_format ) output_format = preview_format;
+
+    pData.layout = layout;
+    pData.output_format = output_format;
+}
+
+/**
+ * @brief VideoMMALObject::startPreviewStream
+ * Open a named preview stream, resized and converted by its own ISP on a free output of the
+ * video splitter, in parallel of the video preview and the video record.
+ * Each stream has its own buffers and is grabbed with grabStream(), retrieveStream() and grabStreamLease().
+ * @param name : name of the stream
+ * @param width : width of the stream
+ * @param height : height of the stream
+ * @param mmal_image_format : format of the stream, same formats as the video preview
+ * @return false if the name is used, no splitter output is free or the ISP can't be set up
+ */
+bool VideoMMALObject::startPreviewStream(const std::string &name, unsigned int width, unsigned int height, int mmal_image_format)
+{
+    if ( m_preview_streams.count(name) ) {
+        cerr << "Preview stream " << name << " is already opened" << endl;
+        return false;
+    }
+    if (!areVideoComponentsReady()) createVideoComponents();
+    if (!areVideoComponentsReady()) return false;
+
+    MMAL_PORT_T *splitter_port = acquireSplitterOutput();
+    if ( !splitter_port ) {
+        cerr << "No free splitter output for preview stream " << name << endl;
+        if (!isVideoPreviewOpened() && !isVideoRecording() && !isVideoSubstreamRecording() && !hasPreviewStreams()) destroyVideoComponents();
+        return false;
+    }
+
+    std::unique_ptr<PREVIEW_STREAM> stream(new PREVIEW_STREAM());
+    stream->width = width;
+    stream->height = height;
+    stream->format = mmal_image_format;
+    cerr << "Setup preview stream " << name << ": " << width << ", " << height << endl;
+    if ( !createResizer(stream->resizer, stream->callback_data, splitter_port, width, height, mmal_image_format) ) {
+        releaseSplitterOutput(splitter_port);
+        if (!isVideoPreviewOpened() && !isVideoRecording() && !isVideoSubstreamRecording() && !hasPreviewStreams()) destroyVideoComponents();
+        return false;
+    }
+    m_preview_streams[name] = std::move(stream);
+    return true;
+}
+
+/**
+ * @brief VideoMMALObject::stopPreviewStream
+ * Close a named preview stream and free its splitter output.
+ * /!\ Leases on the frames of the stream must be released before.
+ * @param name : name of the stream
+ */
+void VideoMMALObject::stopPreviewStream(const std::string &name)
+{
+    auto it = m_preview_streams.find(name);
+    if ( it == m_preview_streams.end() ) return;
+
+    PREVIEW_STREAM &stream = *it->second;
+    stream.callback_data.cancelWaiters();
+    MMAL_PORT_T *splitter_port = stream.resizer.splitter_port;
+    destroyResizer(stream.resizer, stream.callback_data);
+    releaseSplitterOutput(splitter_port);
+    m_preview_streams.erase(it);
+    cerr << "Destroy preview stream " << name << endl;
+
+    if (!isVideoPreviewOpened() && !isVideoRecording() && !isVideoSubstreamRecording() && !hasPreviewStreams() && areVideoComponentsReady()) destroyVideoComponents();
+}
+
+/**
+ * @brief VideoMMALObject::findPreviewStream
+ * @param name : name of the stream
+ * @return the stream, NULL if it isn't opened
+ */
+PREVIEW_STREAM *VideoMMALObject::findPreviewStream(const std::string &name)
+{
+    auto it = m_preview_streams.find(name);
+    return it == m_preview_streams.end() ? NULL : it->second.get();
+}
+
+/**
+ * @brief VideoMMALObject::grabStream
+ * Same as grab() for a named preview stream.
+ * @param name : name of the stream
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME, GRAB_CANCELLED or GRAB_NOT_OPENED
+ */
+GRAB_STATUS_T VideoMMALObject::grabStream(const std::string &name, std::chrono::milliseconds timeout)
+{
+    PREVIEW_STREAM *stream = findPreviewStream(name);
+    if ( !stream ) return GRAB_NOT_OPENED;
+    return grabFrom(stream->callback_data, timeout);
+}
+
+/**
+ * @brief VideoMMALObject::retrieveStream
+ * Same as retrieve() for a named preview stream.
+ * @param name : name of the stream
+ * @param data : pointer to array that will be filled with image data
+ * @param stride : line stride of data in bytes, 0 for lines without padding
+ */
+void VideoMMALObject::retrieveStream(const std::string &name, unsigned char *data, unsigned int stride)
+{
+    PREVIEW_STREAM *stream = findPreviewStream(name);
+    if ( stream ) retrieveFrom(stream->callback_data, data, stride);
+}
+
+/**
+ * @brief VideoMMALObject::grabStreamLease
+ * Same as grabLease() for a named preview stream.
+ * @param name : name of the stream
+ * @param lease : filled with the frame on success, released otherwise
+ * @param timeout : maximum wait, GRAB_INFINITE to wait until a frame arrives
+ * @return GRAB_SUCCESS, GRAB_TIMEOUT, GRAB_NO_FRAME, GRAB_CANCELLED or GRAB_NOT_OPENED
+ */
+GRAB_STATUS_T VideoMMALObject::grabStreamLease(const std::string &name, FrameLease &lease, std::chrono::milliseconds timeout)
 {
-    if (!isOpened()) return;
-    if (isVideoRecording()) stopVideoRecord();
-    if(areVideoComponentsReady()) destroyVideoComponents();
-    if (isStillPreviewOpened()) stopStillPreview();
-    destroyCameraComponent();
-    m_is_opened = false;
+    lease.release();
+    PREVIEW_STREAM *stream = findPreviewStream(name);
+    if ( !stream ) return GRAB_NOT_OPENED;
+    return grabLeaseFrom(stream->callback_data, lease, timeout);
 }
 
-bool VideoMMALObject::grab()
+/**
+ * @brief VideoMMALObject::getStreamFrameInfo
+ * @param name : name of the stream
+ * @return the metadata of the frame of the last grabStream()
+ */
+FRAME_INFO VideoMMALObject::getStreamFrameInfo(const std::string &name)
 {
-    if ( !isOpened() || (!isStillPreviewOpened() && !isVideoPreviewOpened())) return false;
-    preview_callback_data.waitForFrame();
-    return true;
+    PREVIEW_STREAM *stream = findPreviewStream(name);
+    if ( !stream ) return FRAME_INFO();
+    std::unique_lock<std::mutex> lck ( stream->callback_data._mutex );
+    return stream->callback_data.grabbed_info;
 }
 
 /**
- * @brief VideoMMALObject::retrieve
- * Retrieve the preview image data captured by the camera with the preview image format
- * Supported formats are : YUV420, I420
- * @param data : pointer to array that will be filled with image data
- *
+ * @brief VideoMMALObject::acquireSplitterOutput
+ * Reserve a free output of the video splitter, outputs 0 and 1 belong to the video preview and the encoder.
+ * @return the splitter output, NULL if all of them are used
  */
-void VideoMMALObject::retrieve(unsigned char *data)
+MMAL_PORT_T *VideoMMALObject::acquireSplitterOutput()
 {
-    if ( preview_callback_data.buffer_length == 0 ) return;
-    unsigned int width, height;
-    int buffer_format;
-    if (isStillPreviewOpened()){
-        width = m_still_preview_width;
-        height = m_still_preview_height;
-        buffer_format = m_still_preview_format;
-    } else {
-        width = m_video_preview_width;
-        height = m_video_preview_height;
-        buffer_format = m_video_preview_format;
-    }
-
-    unsigned char * imagePtr=preview_callback_data.buffer_data;
-    if(  buffer_format  == MMAL_ENCODING_I420){
-        for(unsigned int i=0;i<width+height/2;i++) {
-            memcpy ( data,imagePtr,width);
-            data+=width;
-            imagePtr+=VCOS_ALIGN_UP(width, 32);//line stride
-        }
-
-    }
-    else if(  buffer_format  == MMAL_ENCODING_BGR24 || buffer_format  == MMAL_ENCODING_RGB24 ){
-        for(unsigned int i=0;i<height;i++) {
-            memcpy ( data,imagePtr,width*3);
-            data+=width*3;
-            imagePtr+=VCOS_ALIGN_UP(width, 32)*3;//line stride
+    if ( !splitter_component ) return NULL;
+    for ( unsigned int i = SPLITTER_RESERVED_OUTPUTS_NUM; i < splitter_component->output_num && i < SPLITTER_OUTPUTS_NUM; i++ ) {
+        if ( !m_splitter_output_used[i] ) {
+            m_splitter_output_used[i] = true;
+            return splitter_component->output[i];
         }
     }
-    delete preview_callback_data.buffer_data;
+    return NULL;
+}
+
+/**
+ * @brief VideoMMALObject::releaseSplitterOutput
+ * @param port : splitter output given by acquireSplitterOutput
+ */
+void VideoMMALObject::releaseSplitterOutput(MMAL_PORT_T *port)
+{
+    if ( port && port->index < SPLITTER_OUTPUTS_NUM ) m_splitter_output_used[port->index] = false;
 }
 
 /**
@@ -368,6 +1258,17 @@ void VideoMMALObject::createCameraComponent() {
     camera_preview_output_port = camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
     camera_still_output_port = camera_component->output[MMAL_CAMERA_STILL_PORT];
 
+    if ( m_zero_shutter_lag ) {
+        // the sensor keeps streaming in the still mode, a capture takes the last frame instead of switching mode
+        MMAL_PARAMETER_ZEROSHUTTERLAG_T zsl;
+        zsl.hdr.id = MMAL_PARAMETER_ZERO_SHUTTER_LAG;
+        zsl.hdr.size = sizeof ( zsl );
+        zsl.zero_shutter_lag_mode = MMAL_TRUE;
+        zsl.concurrent_capture = MMAL_TRUE;
+        if ( mmal_port_parameter_set ( camera_component->control, &zsl.hdr ) != MMAL_SUCCESS )
+            cerr << "Unable to set the zero shutter lag mode" << endl;
+    }
+
     //  set up the camera configuration
 
     MMAL_PARAMETER_CAMERA_CONFIG_T cam_config;
@@ -380,9 +1281,11 @@ void VideoMMALObject::createCameraComponent() {
     cam_config.max_preview_video_w = MAX_STILL_WIDTH/2;
     cam_config.max_preview_video_h = MAX_STILL_HEIGHT/2;
     cam_config.num_preview_video_frames = 3 + vcos_max(0, (m_cam_params.framerate-30)/10);
+    // height of the strip buffer of the stills processing, not a frame history: the zero shutter lag doesn't use it
     cam_config.stills_capture_circular_buffer_height = 0;
     cam_config.fast_preview_resume = 0;
-    cam_config.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC;
+    // raw STC, so that the preview callback can compare the pts with the current STC
+    cam_config.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC;
     mmal_port_parameter_set ( camera_component->control, &cam_config.hdr );
 
 
@@ -405,17 +1308,34 @@ void VideoMMALObject::createCameraComponent() {
  */
 void VideoMMALObject::destroyVideoComponents() {
 
-    if (isVideoPreviewOpened()) stopVideoPreview();
-    if (isVideoRecording()) stopVideoRecord();
+    // the outputs stopped below must not destroy the video components themselves
+    m_are_video_components_ready = false;
+    while (hasPreviewStreams()) stopPreviewStream(m_preview_streams.begin()->first);
+    if (isVideoPreviewOpened()) {
+        preview_callback_data.cancelWaiters();
+        destroyVideoPreviewComponent();
+        m_is_video_preview_opened = false;
+    }
+    if (isVideoRecording()) {
+        destroyVideoEncoderComponent();
+        m_is_video_recording = false;
+    }
+    if (isVideoSubstreamRecording()) {
+        destroyVideoSubstreamComponents();
+        m_is_video_substream_recording = false;
+    }
 
 
-    if (splitter_connection )
+    if (splitter_connection ) {
         destroyConnection(splitter_connection);
+        splitter_connection = NULL;
+    }
 
     if ( splitter_component ) {
         mmal_component_destroy ( splitter_component );
         splitter_component = NULL;
     }
+    for (unsigned int i = 0; i < SPLITTER_OUTPUTS_NUM; i++) m_splitter_output_used[i] = false;
 
     m_are_video_components_ready = false;
 
@@ -553,6 +1473,17 @@ void VideoMMALObject::destroyStillPreviewComponent()
         mmal_port_disable ( camera_preview_output_port );
     }
 
+    preview_callback_data.flushSubscribers();
+    preview_callback_data.drainMailbox();
+    preview_callback_data.detachPort();
+    preview_callback_data.waitLeasesReleased(PREVIEW_LEASE_TIMEOUT_MS);
+
+    if ( still_preview_pool ) {
+        mmal_port_pool_destroy ( camera_preview_output_port, still_preview_pool );
+        still_preview_pool = NULL;
+    }
+    preview_callback_data.ring.deallocate();
+
     cerr << "Destroy Still preview"<< endl;
 }
 
@@ -579,8 +1510,8 @@ void VideoMMALObject::createStillPreviewComponent()
     // Set the Camera format on the video port
 
     format = camera_preview_output_port->format;
-    format->encoding_variant = m_still_preview_format;
-    format->encoding = m_still_preview_format;
+    format->encoding_variant = previewPortFormat(m_still_preview_format);
+    format->encoding = previewPortFormat(m_still_preview_format);
     format->es->video.width = VCOS_ALIGN_UP(m_still_preview_width, 32);
     format->es->video.height = VCOS_ALIGN_UP(m_still_preview_height, 16);
     //format->es->video.width = VCOS_ALIGN_UP(MAX_VIDEO_WIDTH, 32);
@@ -594,6 +1525,8 @@ void VideoMMALObject::createStillPreviewComponent()
     format->es->video.frame_rate.num =  m_cam_params.framerate;
     format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
     format->es->video.color_space = MMAL_COLOR_SPACE_ITUR_BT601;
+    if ( (int) format->encoding != m_still_preview_format && m_still_preview_format != MMAL_ENCODING_GREY )
+        format->es->video.color_space = m_color_converter.getColorSpace();
 
     status = mmal_port_format_commit ( camera_preview_output_port );
     if ( status ) {
@@ -603,14 +1536,20 @@ void VideoMMALObject::createStillPreviewComponent()
     }
 
     cerr << "Commit preview Still format port" << endl;
+    setPreviewLayout(preview_callback_data, camera_preview_output_port, m_still_preview_format);
+    preview_callback_data.resetSequence(m_cam_params.framerate > 0 ? 1000000 / m_cam_params.framerate : 0);
 
     camera_preview_output_port->buffer_num = camera_preview_output_port->buffer_num_recommended;
     if (camera_preview_output_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
          camera_preview_output_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+    camera_preview_output_port->buffer_num += PREVIEW_LEASE_BUFFERS_NUM;
     camera_preview_output_port->buffer_size = camera_preview_output_port->buffer_size_recommended;
     if (camera_preview_output_port->buffer_size < camera_preview_output_port->buffer_size_min)
          camera_preview_output_port->buffer_size = camera_preview_output_port->buffer_size_min;
 
+    if ( !preview_callback_data.ring.allocate(FRAME_RING_SLOTS_NUM, camera_preview_output_port->buffer_size) )
+        cerr << "Unable to allocate the still preview frame ring" << endl;
+
 
     status = mmal_port_enable ( camera_preview_output_port,preview_buffer_callback );
     if ( status )
@@ -632,6 +1571,8 @@ void VideoMMALObject::createStillPreviewComponent()
 
     cerr << "preview pool " << endl;
     preview_callback_data.pool = still_preview_pool;
+    preview_callback_data.attachStamps(still_preview_pool);
+    preview_callback_data.port = camera_preview_output_port;
 
 
     int num = mmal_queue_length ( still_preview_pool->queue );
@@ -653,198 +1594,237 @@ void VideoMMALObject::createStillPreviewComponent()
 
 
 /**
- * @brief VideoMMALObject::destroyPreviewComponent
- * Destroy the Preview(Resizer) component and clean involved objects
+ * @brief VideoMMALObject::destroyResizer
+ * Destroy an ISP fed by a splitter output and give its buffers back.
+ * @param resizer : components of the preview
+ * @param pData : userdata of the preview output port
  */
-void VideoMMALObject::destroyVideoPreviewComponent()
+void VideoMMALObject::destroyResizer(PREVIEW_RESIZER &resizer, PORT_PREVIEW_USERDATA &pData)
 {
     // Disable resizer port
-    if ( resizer_output_port && resizer_output_port->is_enabled ) {
-        mmal_port_disable ( resizer_output_port );
-        resizer_output_port = NULL;
+    if ( resizer.output_port && resizer.output_port->is_enabled )
+        mmal_port_disable ( resizer.output_port );
+    if ( resizer.connection ) {
+        destroyConnection(resizer.connection);
+        resizer.connection = NULL;
     }
-    if (resizer_connection )
-        destroyConnection(resizer_connection);
-
-    if ( resize_pool )
-        mmal_port_pool_destroy ( resizer_component->output[0], resize_pool );
 
-    // Disable all our ports that are not handled by connections
-    if ( resizer_component )
-        mmal_component_disable ( resizer_component );
+    pData.flushSubscribers();
+    pData.drainMailbox();
+    pData.detachPort();
+    pData.waitLeasesReleased(PREVIEW_LEASE_TIMEOUT_MS);
 
-    if ( resizer_component ) {
-        mmal_component_destroy ( resizer_component );
-        resizer_component = NULL;
+    if ( resizer.pool ) {
+        mmal_port_pool_destroy ( resizer.output_port, resizer.pool );
+        resizer.pool = NULL;
     }
+    pData.ring.deallocate();
 
-    cerr << "Destroy video preview"<< endl;
+    // Disable all our ports that are not handled by connections
+    if ( resizer.component ) {
+        mmal_component_disable ( resizer.component );
+        mmal_component_destroy ( resizer.component );
+        resizer.component = NULL;
+    }
+    resizer.input_port = NULL;
+    resizer.output_port = NULL;
+    resizer.splitter_port = NULL;
 }
 
 /**
- * @brief VideoMMALObject::createPreviewComponent
- * Create the Preview (Resizer) component.
+ * @brief VideoMMALObject::createResizer
+ * Create an ISP on a splitter output that resizes and converts the video frames for a preview.
+ * On failure the components already created are destroyed.
+ * @param resizer : filled with the components of the preview
+ * @param pData : userdata of the preview output port
+ * @param splitter_port : splitter output feeding the ISP
+ * @param width : width of the preview
+ * @param height : height of the preview
+ * @param preview_format : format of the preview
+ * @return true if the preview is running
  */
-void VideoMMALObject::createVideoPreviewComponent()
+bool VideoMMALObject::createResizer(PREVIEW_RESIZER &resizer, PORT_PREVIEW_USERDATA &pData, MMAL_PORT_T *splitter_port,
+                                    unsigned int width, unsigned int height, int preview_format)
 {
-    if (!areVideoComponentsReady())
-    {
-        createVideoComponents();
-    }
-
     MMAL_ES_FORMAT_T *format;
     MMAL_STATUS_T status;
 
-    cerr << "Setup Preview Video: " << m_video_preview_width << ", "<< m_video_preview_height << endl;
-    status = mmal_component_create ( "vc.ril.isp", &resizer_component );
+    status = mmal_component_create ( "vc.ril.isp", &resizer.component );
 
     if ( status != MMAL_SUCCESS ) {
         cerr<< ( "Failed to create resizer component" );
-        destroyVideoPreviewComponent();
-        return;
+        destroyResizer(resizer, pData);
+        return false;
     }
 
-    resizer_input_port = resizer_component->input[0];
-    resizer_output_port = resizer_component->output[0];
+    resizer.splitter_port = splitter_port;
+    resizer.input_port = resizer.component->input[0];
+    resizer.output_port = resizer.component->output[0];
 
-    resizer_output_port->userdata = ( struct MMAL_PORT_USERDATA_T * ) &preview_callback_data;
+    resizer.output_port->userdata = ( struct MMAL_PORT_USERDATA_T * ) &pData;
 
 
-    mmal_format_copy(resizer_input_port->format, splitter_output_video_port->format);
+    mmal_format_copy(resizer.input_port->format, splitter_port->format);
 
-    resizer_input_port->buffer_num = resizer_input_port->buffer_num_recommended;
-    if (resizer_input_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
-        resizer_input_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
-    resizer_input_port->buffer_size = resizer_input_port->buffer_size_recommended;
-    if (resizer_input_port->buffer_size < resizer_input_port->buffer_size_min)
-        resizer_input_port->buffer_size = resizer_input_port->buffer_size_min;
-    status = mmal_port_format_commit(resizer_input_port);
+    resizer.input_port->buffer_num = resizer.input_port->buffer_num_recommended;
+    if (resizer.input_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+        resizer.input_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+    resizer.input_port->buffer_size = resizer.input_port->buffer_size_recommended;
+    if (resizer.input_port->buffer_size < resizer.input_port->buffer_size_min)
+        resizer.input_port->buffer_size = resizer.input_port->buffer_size_min;
+    status = mmal_port_format_commit(resizer.input_port);
 
     cerr << "preview video input port format commit " << endl;
 
-    mmal_format_copy(resizer_output_port->format, resizer_input_port->format);
+    mmal_format_copy(resizer.output_port->format, resizer.input_port->format);
 
-    format = resizer_output_port->format;
-    format->encoding_variant = m_video_preview_format;
-    format->encoding = m_video_preview_format;
-    format->es->video.width = VCOS_ALIGN_UP(m_video_preview_width, 32);
-    format->es->video.height = VCOS_ALIGN_UP(m_video_preview_height, 16);
+    format = resizer.output_port->format;
+    format->encoding_variant = previewPortFormat(preview_format);
+    format->encoding = previewPortFormat(preview_format);
+    format->es->video.width = VCOS_ALIGN_UP(width, 32);
+    format->es->video.height = VCOS_ALIGN_UP(height, 16);
     format->es->video.crop.x = 0;
     format->es->video.crop.y = 0;
-    format->es->video.crop.width = m_video_preview_width;
-    format->es->video.crop.height = m_video_preview_height;
+    format->es->video.crop.width = width;
+    format->es->video.crop.height = height;
     format->es->video.frame_rate.num = 0;
     format->es->video.frame_rate.den = 1;
+    if ( (int) format->encoding != preview_format && preview_format != MMAL_ENCODING_GREY )
+        format->es->video.color_space = m_color_converter.getColorSpace();
 
 
-    status = mmal_port_format_commit(resizer_output_port);
+    status = mmal_port_format_commit(resizer.output_port);
     cerr << "preview video output port format commit " << endl;
+    setPreviewLayout(pData, resizer.output_port, preview_format);
+    pData.resetSequence(m_cam_params.framerate > 0 ? 1000000 / m_cam_params.framerate : 0);
+
+    resizer.output_port->buffer_size = resizer.output_port->buffer_size_recommended;
+    resizer.output_port->buffer_num = resizer.output_port->buffer_num_recommended;
+
+    if (resizer.output_port->buffer_size < resizer.output_port->buffer_size_min)
+        resizer.output_port->buffer_size = resizer.output_port->buffer_size_min;
 
 
+    if (resizer.output_port->buffer_num < resizer.output_port->buffer_num_min)
+        resizer.output_port->buffer_num = resizer.output_port->buffer_num_min;
+    resizer.output_port->buffer_num += PREVIEW_LEASE_BUFFERS_NUM;
 
+    if ( !pData.ring.allocate(FRAME_RING_SLOTS_NUM, resizer.output_port->buffer_size) )
+        cerr << "Unable to allocate the video preview frame ring" << endl;
 
-    status = connectPorts( splitter_output_video_port, resizer_input_port, &resizer_connection  );
+
+
+
+    status = connectPorts( splitter_port, resizer.input_port, &resizer.connection  );
     if ( status )
     {
         cerr<< ( "splitter resizer port connection error" );
-        destroyVideoPreviewComponent();
-        return;
+        resizer.connection = NULL;
+        destroyResizer(resizer, pData);
+        return false;
     }
     cerr << "preview video connect ports" << endl;
 
 
 
-    status = mmal_port_enable ( resizer_output_port,preview_buffer_callback );
+    status = mmal_port_enable ( resizer.output_port,preview_buffer_callback );
     if ( status )
     {
         cerr<< ( " Resizer (Preview) callback link error" );
-        destroyVideoPreviewComponent();
-        return;
+        destroyResizer(resizer, pData);
+        return false;
     }
     cerr << "preview video output port enable" << endl;
 
 
-    resizer_output_port->buffer_size = resizer_output_port->buffer_size_recommended;
-    resizer_output_port->buffer_num = resizer_output_port->buffer_num_recommended;
-
-    if (resizer_output_port->buffer_size < resizer_output_port->buffer_size_min)
-        resizer_output_port->buffer_size = resizer_output_port->buffer_size_min;
-
-
-    if (resizer_output_port->buffer_num < resizer_output_port->buffer_num_min)
-        resizer_output_port->buffer_num = resizer_output_port->buffer_num_min;
-
-
-    resize_pool = mmal_port_pool_create ( resizer_output_port, resizer_output_port->buffer_num, resizer_output_port->buffer_size );
-    if ( !resize_pool )
+    resizer.pool = mmal_port_pool_create ( resizer.output_port, resizer.output_port->buffer_num, resizer.output_port->buffer_size );
+    if ( !resizer.pool )
     {
            cerr<< ( "Failed to create buffer header pool for video output port" );
-           destroyVideoPreviewComponent();
-           return;
+           destroyResizer(resizer, pData);
+           return false;
     }
-    preview_callback_data.pool = resize_pool;
+    pData.pool = resizer.pool;
+    pData.attachStamps(resizer.pool);
+    pData.port = resizer.output_port;
+    pData.mailbox_mode = ( m_preview_grab_mode == PREVIEW_GRAB_LATEST_FRAME );
 
     cerr << "preview video pool created" << endl;
 
 
 
        // Enable resizer (preview) components
-    status = mmal_component_enable ( resizer_component );
+    status = mmal_component_enable ( resizer.component );
 
     if ( status )
     {
         cerr<< ( "resizer component couldn't be enabled" );
-        destroyVideoPreviewComponent();
-        return;
+        destroyResizer(resizer, pData);
+        return false;
     }
     cerr << "preview video component enable" << endl;
 
 
-    int num = mmal_queue_length ( resize_pool->queue );
+    int num = mmal_queue_length ( resizer.pool->queue );
     int q;
     for ( q=0; q<num; q++ ) {
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get ( resize_pool->queue );
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get ( resizer.pool->queue );
 
         if ( !buffer )
             cerr<<"Unable to get a required buffer"<<q<<" from pool queue"<<endl;
 
-        if ( mmal_port_send_buffer ( resizer_output_port, buffer ) != MMAL_SUCCESS )
+        if ( mmal_port_send_buffer ( resizer.output_port, buffer ) != MMAL_SUCCESS )
             cerr<<"Unable to send a buffer to preview output port "<< q<<endl;
     }
-
-    cerr << "preview video setup end" << endl;
+    return true;
 }
 
 /**
- * @brief VideoMMALObject::destroyVideoEncoderComponent
- * Destroy the Record (Video Encoder) component and clean involved objects
+ * @brief VideoMMALObject::destroyPreviewComponent
+ * Destroy the Preview(Resizer) component and clean involved objects
  */
-void VideoMMALObject::destroyVideoEncoderComponent() {
-
-    // Disable video_encoder_output_port
-    if ( video_encoder_output_port && video_encoder_output_port->is_enabled ) {
-        mmal_port_disable ( video_encoder_output_port );
-        video_encoder_output_port = NULL;
-    }
-    //Destroy video_encoder connection
-    if (video_encoder_connection)
-        destroyConnection(video_encoder_connection);
-
+void VideoMMALObject::destroyVideoPreviewComponent()
+{
+    destroyResizer(video_preview_resizer, preview_callback_data);
+    cerr << "Destroy video preview"<< endl;
+}
 
-    if ( video_encoder_pool ) {
-        mmal_port_pool_destroy ( video_encoder_component->output[0], video_encoder_pool );
+/**
+ * @brief VideoMMALObject::createPreviewComponent
+ * Create the Preview (Resizer) component.
+ */
+void VideoMMALObject::createVideoPreviewComponent()
+{
+    if (!areVideoComponentsReady())
+    {
+        createVideoComponents();
     }
 
-    // Disable all our ports that are not handled by connections
-    if ( video_encoder_component )
-        mmal_component_disable ( video_encoder_component );
-
+    cerr << "Setup Preview Video: " << m_video_preview_width << ", "<< m_video_preview_height << endl;
+    if ( createResizer(video_preview_resizer, preview_callback_data, splitter_output_video_port,
+                       m_video_preview_width, m_video_preview_height, m_video_preview_format) )
+        cerr << "preview video setup end" << endl;
+}
 
-    if ( video_encoder_component ) {
-        mmal_component_destroy ( video_encoder_component );
-        video_encoder_component = NULL;
+/**
+ * @brief clampH264Bitrate
+ * The encoder refuses a bitrate above the maximum of the level 4 and below.
+ */
+static unsigned int clampH264Bitrate(unsigned int bitrate, MMAL_VIDEO_LEVEL_T level)
+{
+    if ( level <= MMAL_VIDEO_LEVEL_H264_4 && bitrate > H264_LEVEL4_MAX_BITRATE ) {
+        cerr << "Bitrate " << bitrate << " too high for the H.264 level, using " << H264_LEVEL4_MAX_BITRATE << endl;
+        return H264_LEVEL4_MAX_BITRATE;
     }
+    return bitrate;
+}
 
+/**
+ * @brief VideoMMALObject::destroyVideoEncoderComponent
+ * Destroy the Record (Video Encoder) component and clean involved objects
+ */
+void VideoMMALObject::destroyVideoEncoderComponent() {
+    destroyEncoder(video_encoder, m_record_writer);
 }
 
 /**
@@ -858,86 +1838,152 @@ void VideoMMALObject::createVideoEncoderComponent() {
     }
 
     cerr << "Setup Record : " << m_video_record_width << ", "<< m_video_record_height << endl;
+    createEncoder(video_encoder, m_record_writer, splitter_output_record_port, m_h264_config, m_video_record_filename);
+}
 
+/**
+ * @brief VideoMMALObject::destroyEncoder
+ * Destroy a video encoder, the record writer writes the buffers already received.
+ * @param encoder : components of the encoder
+ * @param writer : record writer of the encoder output
+ */
+void VideoMMALObject::destroyEncoder(VIDEO_ENCODER &encoder, RecordWriter &writer)
+{
+    // Disable the encoder output port
+    if ( encoder.output_port && encoder.output_port->is_enabled )
+        mmal_port_disable ( encoder.output_port );
+    // Destroy the encoder connection
+    if ( encoder.connection ) {
+        destroyConnection(encoder.connection);
+        encoder.connection = NULL;
+    }
 
-    if ( mmal_component_create ( MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &video_encoder_component ) ) {
-        cerr  << ": Could not create video_encoder component.\n";
-        destroyVideoEncoderComponent();
-        return;
+    // the port is disabled, the writer gets no more buffers and writes the queued ones
+    writer.stop();
+
+    if ( encoder.pool ) {
+        mmal_port_pool_destroy ( encoder.output_port, encoder.pool );
+        encoder.pool = NULL;
     }
 
+    // Disable all our ports that are not handled by connections
+    if ( encoder.component ) {
+        mmal_component_disable ( encoder.component );
+        mmal_component_destroy ( encoder.component );
+        encoder.component = NULL;
+    }
+    encoder.input_port = NULL;
+    encoder.output_port = NULL;
+}
 
+/**
+ * @brief VideoMMALObject::createEncoder
+ * Create a H.264 encoder on a source port, its output is written by a record writer.
+ * On failure the components already created are destroyed.
+ * @param encoder : filled with the components of the encoder
+ * @param writer : record writer of the encoder output
+ * @param source_port : splitter or ISP output feeding the encoder
+ * @param config : settings of the encoder
+ * @param filename : file of the record, empty to only fill the event ring of the writer
+ * @return true if the encoder is running
+ */
+bool VideoMMALObject::createEncoder(VIDEO_ENCODER &encoder, RecordWriter &writer, MMAL_PORT_T *source_port,
+                                    const H264_ENCODER_CONFIG &config, const std::string &filename)
+{
+    if ( mmal_component_create ( MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder.component ) ) {
+        cerr  << ": Could not create video_encoder component.\n";
+        destroyEncoder(encoder, writer);
+        return false;
+    }
 
-    if ( !video_encoder_component->input_num || !video_encoder_component->output_num ) {
+    if ( !encoder.component->input_num || !encoder.component->output_num ) {
         cerr  << ": Video Encoder does not have input/output ports.\n";
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
     }
-    video_encoder_input_port = video_encoder_component->input[0];
-    video_encoder_output_port = video_encoder_component->output[0];
+    encoder.input_port = encoder.component->input[0];
+    encoder.output_port = encoder.component->output[0];
+
+    encoder.output_port->userdata = ( struct MMAL_PORT_USERDATA_T * ) &writer;
 
-    video_encoder_output_port->userdata = ( struct MMAL_PORT_USERDATA_T * ) &encoder_callback_data;
+    // the connection sets the same format, it is committed here for the size seen by the writer
+    mmal_format_copy ( encoder.input_port->format, source_port->format );
+    if ( mmal_port_format_commit(encoder.input_port) )
+        cerr << "Could not set format on video_encoder input port.\n";
 
-    mmal_format_copy ( video_encoder_output_port->format, video_encoder_input_port->format );
-    video_encoder_output_port->format->encoding = MMAL_ENCODING_H264; // encode to H264
-    video_encoder_output_port->format->bitrate = 17000000;
-    video_encoder_output_port->buffer_size = video_encoder_output_port->buffer_size_recommended;
+    mmal_format_copy ( encoder.output_port->format, encoder.input_port->format );
+    encoder.output_port->format->encoding = MMAL_ENCODING_H264; // encode to H264
+    encoder.output_port->format->bitrate = clampH264Bitrate(config.bitrate, config.level);
+    encoder.output_port->buffer_size = encoder.output_port->buffer_size_recommended;
 
-    if ( video_encoder_output_port->buffer_size < video_encoder_output_port->buffer_size_min )
-        video_encoder_output_port->buffer_size = video_encoder_output_port->buffer_size_min;
-    video_encoder_output_port->buffer_num = video_encoder_output_port->buffer_num_recommended;
-    if ( video_encoder_output_port->buffer_num < video_encoder_output_port->buffer_num_min )
-        video_encoder_output_port->buffer_num = video_encoder_output_port->buffer_num_min;
+    if ( encoder.output_port->buffer_size < encoder.output_port->buffer_size_min )
+        encoder.output_port->buffer_size = encoder.output_port->buffer_size_min;
+    encoder.output_port->buffer_num = encoder.output_port->buffer_num_recommended;
+    if ( encoder.output_port->buffer_num < encoder.output_port->buffer_num_min )
+        encoder.output_port->buffer_num = encoder.output_port->buffer_num_min;
+    // buffers waiting for the record writer are not available to the encoder
+    encoder.output_port->buffer_num += RECORD_WRITER_BUFFERS_NUM;
 
     MMAL_PARAMETER_VIDEO_PROFILE_T  param;
     param.hdr.id = MMAL_PARAMETER_PROFILE;
     param.hdr.size = sizeof(param);
-    param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;
-    param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+    param.profile[0].profile = config.profile;
+    param.profile[0].level = config.level;
 
 
-    if (mmal_port_parameter_set(video_encoder_output_port, &param.hdr) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set(encoder.output_port, &param.hdr) != MMAL_SUCCESS)
     {
         cerr << "Unable to set H264 profile" << endl;
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
      }
 
     // We need to set the frame rate on output to 0, to ensure it gets
     // updated correctly from the input framerate when port connected
-    video_encoder_output_port->format->es->video.frame_rate.num = 0;
-    video_encoder_output_port->format->es->video.frame_rate.den = 1;
+    encoder.output_port->format->es->video.frame_rate.num = 0;
+    encoder.output_port->format->es->video.frame_rate.den = 1;
 
-    if ( mmal_port_format_commit(video_encoder_output_port) ) {
+    if ( mmal_port_format_commit(encoder.output_port) ) {
         cerr  << "Could not set format on video_encoder output port.\n";
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
     }
 
+    commitH264EncoderConfig(encoder.output_port, config);
+    // the motion vectors come in side information buffers, parsed by the writer
+    if ( writer.hasMotionCallback() &&
+         mmal_port_parameter_set_boolean(encoder.output_port, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, MMAL_TRUE) != MMAL_SUCCESS )
+        cerr << "Unable to enable the motion vectors" << endl;
 
 
-    video_encoder_pool = mmal_port_pool_create ( video_encoder_output_port, video_encoder_output_port->buffer_num, video_encoder_output_port->buffer_size );
-    if ( ! ( video_encoder_pool ) ) {
+
+    encoder.pool = mmal_port_pool_create ( encoder.output_port, encoder.output_port->buffer_num, encoder.output_port->buffer_size );
+    if ( ! ( encoder.pool ) ) {
         cerr  << "Failed to create buffer header pool for video_encoder output port.\n";
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
+    }
+
+    if ( !writer.start(filename, encoder.output_port, encoder.pool) ) {
+        destroyEncoder(encoder, writer);
+        return false;
     }
-    encoder_callback_data.encoder_pool = video_encoder_pool;
 
 
-    if (connectPorts(splitter_output_record_port,video_encoder_input_port,&video_encoder_connection) != MMAL_SUCCESS)
+    if (connectPorts(source_port, encoder.input_port, &encoder.connection) != MMAL_SUCCESS)
     {
         cerr  << "Could not connect record resizer output port to video_encoder input port.\n";
-        destroyVideoEncoderComponent();
-        return;
+        encoder.connection = NULL;
+        destroyEncoder(encoder, writer);
+        return false;
     }
 
 
 
-    if ( mmal_component_enable(video_encoder_component)) {
+    if ( mmal_component_enable(encoder.component)) {
         cerr << "Could not enable video_encoder component.\n";
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
     }
 
 
@@ -945,25 +1991,196 @@ void VideoMMALObject::createVideoEncoderComponent() {
     // -----------
 
 
-    if ( mmal_port_enable(video_encoder_output_port, encoder_buffer_callback) != MMAL_SUCCESS)
+    if ( mmal_port_enable(encoder.output_port, video_encoder_buffer_callback) != MMAL_SUCCESS)
     {
         cout << "Failed to enable video_encoder output port.\n";
-        destroyVideoEncoderComponent();
-        return;
+        destroyEncoder(encoder, writer);
+        return false;
+    }
+
+    // give all the pool to the encoder, the queue length decreases while the buffers are sent
+    writer.refillPort();
+    return true;
+}
+
+/**
+ * @brief VideoMMALObject::commitH264EncoderConfig
+ * Apply the optional settings of an encoder configuration to the encoder output port, after its format
+ * is committed. The settings refused by the firmware are reported and skipped.
+ * @param port : encoder output port
+ * @param config : settings of the encoder
+ */
+void VideoMMALObject::commitH264EncoderConfig(MMAL_PORT_T *port, const H264_ENCODER_CONFIG &config)
+{
+    if ( config.intraPeriod &&
+         mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_INTRAPERIOD, config.intraPeriod) != MMAL_SUCCESS )
+        cerr << "Unable to set the intra period" << endl;
+
+    if ( config.rateControl != MMAL_VIDEO_RATECONTROL_DEFAULT ) {
+        MMAL_PARAMETER_VIDEO_RATECONTROL_T param = {{ MMAL_PARAMETER_RATECONTROL, sizeof(param)}, config.rateControl};
+        if ( mmal_port_parameter_set(port, &param.hdr) != MMAL_SUCCESS )
+            cerr << "Unable to set the rate control" << endl;
     }
 
-    for (unsigned int q=0; q < mmal_queue_length ( video_encoder_pool->queue ); q++ ) {
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get ( video_encoder_pool->queue );
+    if ( config.initialQuant &&
+         mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT, config.initialQuant) != MMAL_SUCCESS )
+        cerr << "Unable to set the initial quantisation" << endl;
+    if ( config.minQuant &&
+         mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, config.minQuant) != MMAL_SUCCESS )
+        cerr << "Unable to set the minimum quantisation" << endl;
+    if ( config.maxQuant &&
+         mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, config.maxQuant) != MMAL_SUCCESS )
+        cerr << "Unable to set the maximum quantisation" << endl;
 
-        if ( !buffer )
-            cerr<<"Unable to get a required buffer"<<q<<" from pool queue"<<endl;
+    if ( mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, config.inlineHeaders) != MMAL_SUCCESS )
+        cerr << "Unable to set the inline headers" << endl;
+    if ( mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_VIDEO_ENCODE_H264_LOW_LATENCY, config.lowLatency) != MMAL_SUCCESS )
+        cerr << "Unable to set the low latency mode" << endl;
+    if ( mmal_port_parameter_set_boolean(port, MMAL_PARAMETER_VIDEO_ENCODE_SEPARATE_NAL_BUFS, config.separateNalBuffers) != MMAL_SUCCESS )
+        cerr << "Unable to set the separate NAL buffers" << endl;
 
-        if ( mmal_port_send_buffer ( video_encoder_output_port, buffer ) != MMAL_SUCCESS )
-            cerr<<"Unable to send a buffer to video_encoder output port "<< q<<endl;
+    if ( config.mbRowsPerSlice &&
+         mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_MB_ROWS_PER_SLICE, config.mbRowsPerSlice) != MMAL_SUCCESS )
+        cerr << "Unable to set the macroblock rows per slice" << endl;
+}
+
+/**
+ * @brief VideoMMALObject::setVideoBitrate
+ * Change the bitrate of the video encoder, applied immediately when a video record runs.
+ * @param bitrate : bits per second
+ * @return false if the running encoder refused the bitrate
+ */
+bool VideoMMALObject::setVideoBitrate(unsigned int bitrate)
+{
+    return setEncoderBitrate(video_encoder, m_h264_config, bitrate);
+}
+
+/**
+ * @brief VideoMMALObject::setEncoderBitrate
+ * @param encoder : components of the encoder
+ * @param config : settings of the encoder, updated with the bitrate
+ * @param bitrate : bits per second
+ * @return false if the running encoder refused the bitrate
+ */
+bool VideoMMALObject::setEncoderBitrate(VIDEO_ENCODER &encoder, H264_ENCODER_CONFIG &config, unsigned int bitrate)
+{
+    config.bitrate = bitrate;
+    if ( !encoder.output_port || !encoder.output_port->is_enabled ) return true;
+    bitrate = clampH264Bitrate(bitrate, config.level);
+    if ( mmal_port_parameter_set_uint32(encoder.output_port, MMAL_PARAMETER_VIDEO_BIT_RATE, bitrate) != MMAL_SUCCESS ) {
+        cerr << "Unable to change the video bitrate to " << bitrate << endl;
+        return false;
     }
+    return true;
+}
+
+/**
+ * @brief VideoMMALObject::destroyVideoSubstreamComponents
+ * Destroy the ISP and the encoder of the video substream and free its splitter output
+ */
+void VideoMMALObject::destroyVideoSubstreamComponents()
+{
+    VIDEO_SUBSTREAM &sub = m_video_substream;
+    destroyEncoder(sub.encoder, sub.writer);
 
+    if ( sub.isp_connection ) {
+        destroyConnection(sub.isp_connection);
+        sub.isp_connection = NULL;
+    }
+    if ( sub.isp_component ) {
+        mmal_component_disable ( sub.isp_component );
+        mmal_component_destroy ( sub.isp_component );
+        sub.isp_component = NULL;
+    }
+    releaseSplitterOutput(sub.splitter_port);
+    sub.splitter_port = NULL;
+    cerr << "Destroy video substream" << endl;
 }
 
+/**
+ * @brief VideoMMALObject::createVideoSubstreamComponents
+ * Create the ISP downscaling a free splitter output to the substream size, and its encoder.
+ * On failure the components already created are destroyed.
+ * @param filename : file of the substream
+ * @return true if the substream is recording
+ */
+bool VideoMMALObject::createVideoSubstreamComponents(const std::string &filename)
+{
+    VIDEO_SUBSTREAM &sub = m_video_substream;
+    MMAL_ES_FORMAT_T *format;
+
+    sub.splitter_port = acquireSplitterOutput();
+    if ( !sub.splitter_port ) {
+        cerr << "No free splitter output for the video substream" << endl;
+        return false;
+    }
+
+    cerr << "Setup video substream: " << sub.width << ", " << sub.height << endl;
+    if ( mmal_component_create ( "vc.ril.isp", &sub.isp_component ) != MMAL_SUCCESS ) {
+        cerr << "Failed to create video substream ISP component" << endl;
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+    MMAL_PORT_T *isp_input_port = sub.isp_component->input[0];
+    MMAL_PORT_T *isp_output_port = sub.isp_component->output[0];
+
+    mmal_format_copy(isp_input_port->format, sub.splitter_port->format);
+    isp_input_port->buffer_num = isp_input_port->buffer_num_recommended;
+    if (isp_input_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+        isp_input_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+    isp_input_port->buffer_size = isp_input_port->buffer_size_recommended;
+    if (isp_input_port->buffer_size < isp_input_port->buffer_size_min)
+        isp_input_port->buffer_size = isp_input_port->buffer_size_min;
+    if ( mmal_port_format_commit(isp_input_port) ) {
+        cerr << "Could not set format on video substream ISP input port" << endl;
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+
+    // the encoder reads I420 at the camera frame rate for its rate control
+    mmal_format_copy(isp_output_port->format, isp_input_port->format);
+    format = isp_output_port->format;
+    format->encoding = MMAL_ENCODING_I420;
+    format->encoding_variant = MMAL_ENCODING_I420;
+    format->es->video.width = VCOS_ALIGN_UP(sub.width, 32);
+    format->es->video.height = VCOS_ALIGN_UP(sub.height, 16);
+    format->es->video.crop.x = 0;
+    format->es->video.crop.y = 0;
+    format->es->video.crop.width = sub.width;
+    format->es->video.crop.height = sub.height;
+    format->es->video.frame_rate.num = m_cam_params.framerate;
+    format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+    if ( mmal_port_format_commit(isp_output_port) ) {
+        cerr << "Could not set format on video substream ISP output port" << endl;
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+    isp_output_port->buffer_num = isp_output_port->buffer_num_recommended;
+    if (isp_output_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+        isp_output_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+    isp_output_port->buffer_size = isp_output_port->buffer_size_recommended;
+    if (isp_output_port->buffer_size < isp_output_port->buffer_size_min)
+        isp_output_port->buffer_size = isp_output_port->buffer_size_min;
+
+    if ( connectPorts(sub.splitter_port, isp_input_port, &sub.isp_connection) != MMAL_SUCCESS ) {
+        cerr << "splitter video substream ISP connection error" << endl;
+        sub.isp_connection = NULL;
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+
+    if ( !createEncoder(sub.encoder, sub.writer, isp_output_port, sub.config, filename) ) {
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+
+    if ( mmal_component_enable ( sub.isp_component ) != MMAL_SUCCESS ) {
+        cerr << "video substream ISP component couldn't be enabled" << endl;
+        destroyVideoSubstreamComponents();
+        return false;
+    }
+    return true;
+}
 
 /**
  * @brief VideoMMALObject::destroyStillEncoderComponent
@@ -972,18 +2189,26 @@ void VideoMMALObject::createVideoEncoderComponent() {
 void VideoMMALObject::destroyStillEncoderComponent() {
 
     // Disable still_encoder_output_port
-    if ( still_encoder_output_port && still_encoder_output_port->is_enabled ) {
+    if ( still_encoder_output_port && still_encoder_output_port->is_enabled )
         mmal_port_disable ( still_encoder_output_port );
-        still_encoder_output_port = NULL;
+    {
+        // no more buffers, an armed capture won't complete
+        std::unique_lock<std::mutex> lck ( encoder_callback_data.capture_mutex );
+        if ( encoder_callback_data.sink ) encoder_callback_data.completeCapture(STILL_CAPTURE_CANCELLED);
     }
+    still_encoder_output_port = NULL;
+    still_encoder_input_port = NULL;
     //Destroy still_encoder connection
     if (still_encoder_connection)
         destroyConnection(still_encoder_connection);
+    still_encoder_connection = NULL;
 
 
-    if ( still_encoder_pool ) {
+    if ( still_encoder_pool && still_encoder_component ) {
         mmal_port_pool_destroy ( still_encoder_component->output[0], still_encoder_pool );
     }
+    still_encoder_pool = NULL;
+    encoder_callback_data.encoder_pool = NULL;
 
     // Disable all our ports that are not handled by connections
     if ( still_encoder_component )
@@ -1000,8 +2225,9 @@ void VideoMMALObject::destroyStillEncoderComponent() {
 /**
  * @brief VideoMMALObject::createStillEncoderComponent
  * Create the Record (Image Encoder) component.
+ * @return false if the still pipeline couldn't be built
  */
-void VideoMMALObject::createStillEncoderComponent() {
+bool VideoMMALObject::createStillEncoderComponent() {
     MMAL_ES_FORMAT_T *format;
 
     cerr << "Setup Still Record : " << m_still_record_width << ", "<< m_still_record_height << endl;
@@ -1029,7 +2255,7 @@ void VideoMMALObject::createStillEncoderComponent() {
     if ( mmal_port_format_commit ( camera_still_output_port ) != MMAL_SUCCESS ) {
         cerr<< ( "camera still format couldn't be set" );
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
     camera_still_output_port->buffer_num = camera_still_output_port->buffer_num_recommended;
@@ -1044,7 +2270,7 @@ void VideoMMALObject::createStillEncoderComponent() {
     if ( mmal_component_create ( MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &still_encoder_component ) ) {
         cerr  << ": Could not create jpeg encoder component.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
 
@@ -1052,7 +2278,7 @@ void VideoMMALObject::createStillEncoderComponent() {
     if ( !still_encoder_component->input_num || !still_encoder_component->output_num ) {
         cerr  << ": Still Encoder does not have input/output ports.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
     still_encoder_input_port = still_encoder_component->input[0];
     still_encoder_output_port = still_encoder_component->output[0];
@@ -1077,20 +2303,20 @@ void VideoMMALObject::createStillEncoderComponent() {
     if ( mmal_port_format_commit(still_encoder_output_port) ) {
         cerr  << "Could not set format on jpeg encoder output port.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
     if (  mmal_port_parameter_set_uint32(still_encoder_output_port, MMAL_PARAMETER_JPEG_Q_FACTOR, 85) ) {
         cerr << "Unable to set JPEG quality" << endl;
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
     still_encoder_pool = mmal_port_pool_create ( still_encoder_output_port, still_encoder_output_port->buffer_num, still_encoder_output_port->buffer_size );
     if ( ! ( still_encoder_pool ) ) {
         cerr  << "Failed to create buffer header pool for still_encoder output port.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
     encoder_callback_data.encoder_pool = still_encoder_pool;
 
@@ -1099,7 +2325,7 @@ void VideoMMALObject::createStillEncoderComponent() {
     {
         cerr  << "Could not connect record resizer output port to still_encoder input port.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
 
@@ -1107,7 +2333,7 @@ void VideoMMALObject::createStillEncoderComponent() {
     if ( mmal_component_enable(still_encoder_component)) {
         cerr << "Could not enable still_encoder component.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
 
@@ -1119,10 +2345,11 @@ void VideoMMALObject::createStillEncoderComponent() {
     {
         cout << "Failed to enable still_encoder output port.\n";
         destroyStillEncoderComponent();
-        return;
+        return false;
     }
 
-    for (unsigned int q=0; q < mmal_queue_length ( still_encoder_pool->queue ); q++ ) {
+    unsigned int num = mmal_queue_length ( still_encoder_pool->queue );
+    for (unsigned int q=0; q < num; q++ ) {
         MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get ( still_encoder_pool->queue );
 
         if ( !buffer )
@@ -1132,6 +2359,7 @@ void VideoMMALObject::createStillEncoderComponent() {
             cerr<<"Unable to send a buffer to still_encoder output port "<< q<<endl;
     }
 
+    return true;
 }
 
 void VideoMMALObject::preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
@@ -1140,20 +2368,41 @@ void VideoMMALObject::preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEA
     PORT_PREVIEW_USERDATA *pData = ( PORT_PREVIEW_USERDATA * ) port->userdata;
 
     bool hasGrabbed=false;
+    bool hasStored=false;
+    if ( pData && buffer->length ) pData->sampleStc ( port );
     std::unique_lock<std::mutex> lck ( pData->_mutex );
     if ( pData ) {
-        if ( pData->wantToGrab &&  buffer->length ) {
-            pData->buffer_data = new unsigned char[buffer->length]();
-            mmal_buffer_header_mem_lock ( buffer );
-            pData->buffer_length = buffer->length;
-            memcpy ( pData->buffer_data,buffer->data,buffer->length );
+        if ( buffer->length ) pData->stampFrame ( buffer );
+
+        if ( pData->wantToGrab &&  buffer->length && pData->ring.isAllocated() ) {
+            pData->storeInRing ( buffer );
             pData->wantToGrab = false;
             hasGrabbed=true;
-            mmal_buffer_header_mem_unlock ( buffer );
+            hasStored=true;
+        }
+        // keep the buffer out of the pool for a lease, released by FrameLease
+        if ( pData->lease_waiters && !pData->lease_buffer && buffer->length ) {
+            mmal_buffer_header_acquire ( buffer );
+            pData->lease_buffer = buffer;
+            hasGrabbed=true;
+        }
+        if ( pData->batch_active && buffer->length && port->is_enabled ) {
+            pData->pushBatch ( buffer );
+            hasGrabbed=true;
+        }
+        // publish the newest frame in the mailbox, the previous one goes back to the pool
+        if ( pData->mailbox_mode && buffer->length && port->is_enabled ) {
+            mmal_buffer_header_acquire ( buffer );
+            MMAL_BUFFER_HEADER_T *previous = pData->mailbox.exchange ( buffer );
+            if ( previous ) mmal_buffer_header_release ( previous );
+            hasGrabbed=true;
         }
     }
-    //pData->_mutex.unlock();
-    // if ( hasGrabbed ) pData->Thcond.BroadCast(); //wake up waiting client
+    lck.unlock();
+    // subscribers get their own reference on the buffer, outside of the grab lock
+    // because a dropped frame gives its buffer back through the lease
+    if ( buffer->length && port->is_enabled ) pData->deliverToSubscribers ( buffer );
+
     // release buffer back to the pool
     mmal_buffer_header_release ( buffer );
     // and send one back to the port (if still open)
@@ -1169,14 +2418,35 @@ void VideoMMALObject::preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEA
             printf ( "Unable to return a buffer to the preview port" );
     }
 
-    if ( hasGrabbed ) pData->Broadcast(); //wake up waiting client
+    if ( hasGrabbed ) {
+        lck.lock();
+        pData->Broadcast(hasStored); //wake up waiting client
+    }
+
+}
 
+/**
+ * @brief VideoMMALObject::video_encoder_buffer_callback
+ * Buffer header callback of the video encoder. The buffer is handed to the record writer,
+ * which writes it on its own thread and sends it back to the port.
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+void VideoMMALObject::video_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    RecordWriter *writer = (RecordWriter *)port->userdata;
+    if (!writer) {
+        mmal_buffer_header_release(buffer);
+        return;
+    }
+    writer->push(buffer);
+    writer->refillPort();
 }
 
 /**
    *  buffer header callback function for encoder
    *
-   *  Callback will dump buffer data to the specific file.
+   *  Callback will give the buffer data to the sink of the still record.
    *  (Doesn't handle segmented mp4 files yet)
    *
    * @param port Pointer to port from which callback originated
@@ -1190,29 +2460,31 @@ void VideoMMALObject::encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEA
   // We pass our file handle and other stuff in via the userdata field.
 
   PORT_ENCODER_USERDATA *pData = (PORT_ENCODER_USERDATA *)port->userdata;
-  pData->encode_completed = false;
-  cerr << "encoder buffer called" << endl;
 
   if (pData)
   {
-      if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) ) {
-          pData->file->write((char *)buffer->data, buffer->length);
+      std::unique_lock<std::mutex> lck ( pData->capture_mutex );
+      if (pData->capture_pending && pData->sink) {
+          if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) && pData->sink && buffer->length) {
+              ENCODED_CHUNK chunk = { buffer->data + buffer->offset, buffer->length, buffer->flags, buffer->pts };
+              pData->sink->write(chunk);
+              pData->capture_result.size += buffer->length;
+              if (pData->capture_result.pts == MMAL_TIME_UNKNOWN) pData->capture_result.pts = buffer->pts;
+          }
+
+          // Now flag if we have completed
+          if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
+              pData->completeCapture(STILL_CAPTURE_FAILED);
+          else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+              pData->completeCapture(STILL_CAPTURE_SUCCESS);
       }
   }
 
-  // Now flag if we have completed
-  if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
-  {
-     cerr << "encode completed" << endl;
-     pData->encode_completed = true;
-  }
-
-
   // release buffer back to the pool
   mmal_buffer_header_release(buffer);
 
   // and send one back to the port (if still open)
-  if (port->is_enabled)
+  if (pData && port->is_enabled)
   {
      MMAL_STATUS_T status;
 
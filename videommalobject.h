@@ -12,8 +12,23 @@
 #include "mmal/util/mmal_connection.h"
 #include "mmal/mmal_buffer.h"
 #include <condition_variable>
+#include <chrono>
 #include "interface/vcos/vcos.h"
 
+#include "framelease.h"
+#include "framering.h"
+#include "framesubscriber.h"
+#include "colorconverter.h"
+#include "recordwriter.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <vector>
+
 
 
 using namespace std;
@@ -24,6 +39,33 @@ using namespace std;
 
 #define VIDEO_FRAME_RATE_DEN 1
 #define VIDEO_OUTPUT_BUFFERS_NUM 3
+#define PREVIEW_LEASE_BUFFERS_NUM 4   /// Extra preview buffers so leases and subscribers don't starve the port
+#define PREVIEW_LEASE_TIMEOUT_MS 1000   /// A stopping preview warns when its leases are held longer, then keeps waiting
+#define PREVIEW_STC_SAMPLE_MS 1000      /// Period of the camera clock reads giving the frame latency
+#define SPLITTER_OUTPUTS_NUM 4            /// Outputs of the video splitter
+#define SPLITTER_RESERVED_OUTPUTS_NUM 2   /// Output 0 feeds the video preview, output 1 the video encoder
+
+/** Result of grab(), tryGrab(), grabLease() and retrieveBatch()
+*/
+enum GRAB_STATUS_T
+{
+    GRAB_SUCCESS,       /// A frame is available
+    GRAB_TIMEOUT,       /// No frame arrived before the timeout
+    GRAB_NO_FRAME,      /// No frame is ready yet (non-blocking grab)
+    GRAB_CANCELLED,     /// cancelGrab() was called or the preview was stopped
+    GRAB_NOT_OPENED,    /// No preview is opened
+    GRAB_FRAMES_LOST    /// retrieveBatch collected all its frames, but frames were lost between them
+};
+
+#define GRAB_INFINITE std::chrono::milliseconds(-1)
+
+/** How grab() and grabLease() select the preview frame
+*/
+enum PREVIEW_GRAB_MODE_T
+{
+    PREVIEW_GRAB_NEXT_FRAME,     /// Wait for the next frame produced after the call
+    PREVIEW_GRAB_LATEST_FRAME    /// Take the newest frame already produced (mailbox)
+};
 
 #define MAX_VIDEO_WIDTH 1920
 #define MAX_VIDEO_HEIGHT 1080
@@ -84,6 +126,55 @@ struct CAMERA_PARAMETERS
     float awbg_blue;
 };
 
+#define H264_LEVEL4_MAX_BITRATE 25000000   /// Maximum bitrate of the H.264 levels up to 4
+#define VIDEO_SUBSTREAM_DEFAULT_BITRATE 2000000   /// Bitrate of the video substream encoder by default
+
+/** Configuration of the H.264 video encoder, applied when the video record starts
+*/
+struct H264_ENCODER_CONFIG
+{
+    unsigned int bitrate;                  /// bits per second, 0 lets the quantisation drive the size
+    MMAL_VIDEO_PROFILE_T profile;
+    MMAL_VIDEO_LEVEL_T level;
+    unsigned int intraPeriod;              /// frames between two IDR frames, 0 for the encoder default
+    MMAL_VIDEO_RATECONTROL_T rateControl;
+    unsigned int initialQuant;             /// 0 for the encoder default, else 1 to 51
+    unsigned int minQuant;                 /// 0 for the encoder default, else 1 to 51
+    unsigned int maxQuant;                 /// 0 for the encoder default, else 1 to 51
+    bool inlineHeaders;                    /// Repeat SPS/PPS before every IDR frame
+    bool lowLatency;                       /// Output each frame as soon as possible
+    bool separateNalBuffers;               /// One NAL unit per buffer
+    unsigned int mbRowsPerSlice;           /// Macroblock rows of a slice, 0 for one slice per frame
+};
+
+
+/** Result of a still capture
+*/
+enum STILL_CAPTURE_STATUS_T
+{
+    STILL_CAPTURE_SUCCESS,       /// The image is complete in the sink
+    STILL_CAPTURE_FAILED,        /// The still pipeline couldn't be built or the camera failed the capture
+    STILL_CAPTURE_SINK_ERROR,    /// The sink couldn't be opened
+    STILL_CAPTURE_BUSY,          /// Another capture is pending
+    STILL_CAPTURE_CANCELLED,     /// The still pipeline was destroyed during the capture
+    STILL_CAPTURE_MISSED         /// The trigger given to captureStillAt is older than its look-back
+};
+
+struct STILL_CAPTURE_RESULT
+{
+    STILL_CAPTURE_STATUS_T status;
+    size_t size;                                        /// Bytes given to the sink
+    int64_t pts;                                        /// MMAL pts of the image in microseconds, or MMAL_TIME_UNKNOWN
+    int64_t trigger;                                    /// Trigger given to captureStillAt, same clock as the pts, or MMAL_TIME_UNKNOWN
+    std::chrono::steady_clock::time_point requested;    /// Call of captureStillAsync
+    std::chrono::steady_clock::time_point completed;    /// Last buffer of the image received
+};
+
+#define STILL_BURST_QUEUE_SIZE 4   /// Encoded images of a burst waiting for the background writer
+
+/** Gives the sink of the image 'index' of a burst
+*/
+typedef std::function<std::unique_ptr<EncodedSink>(unsigned int index)> STILL_SINK_FACTORY_T;
 
 /** Struct used to pass information in encoder port userdata to callback
 */
@@ -92,35 +183,397 @@ struct PORT_PREVIEW_USERDATA
 {
     PORT_PREVIEW_USERDATA() {
         wantToGrab=false;
+        port=NULL;
+        pool=NULL;
+        lease_waiters=0;
+        lease_buffer=NULL;
+        leases_out=0;
+        next_subscriber_id=1;
+        mailbox_mode=false;
+        mailbox=NULL;
+        ready=false;
+        frame_pending=false;
+        cancel_generation=0;
+        batch_active=false;
+        batch_head=0;
+        batch_count=0;
+        output_format=0;
+        resetSequence(0);
+        grabbed_info=FRAME_INFO();
     }
-    void waitForFrame() {
-        //_mutex.lock();
+    template <class Predicate>
+    GRAB_STATUS_T waitGrab(std::unique_lock<std::mutex> &lck, std::chrono::milliseconds timeout, Predicate grabbed) {
+        // called with _mutex locked, a negative timeout waits forever
+        unsigned long generation = cancel_generation;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + ( timeout.count() > 0 ? timeout : std::chrono::milliseconds(0) );
+        while ( !grabbed() ) {
+            if ( cancel_generation != generation ) return GRAB_CANCELLED;
+            if ( timeout.count() < 0 ) cv.wait ( lck ); //this will unlock the mutex and wait atomically
+            else if ( cv.wait_until ( lck, deadline ) == std::cv_status::timeout && !grabbed() )
+                return cancel_generation != generation ? GRAB_CANCELLED : GRAB_TIMEOUT;
+        }
+        return GRAB_SUCCESS;
+    };
+    GRAB_STATUS_T waitForFrame(std::chrono::milliseconds timeout) {
         std::unique_lock<std::mutex> lck ( _mutex );
 
         wantToGrab=true;
         ready = false;
-        while ( !ready ) cv.wait ( lck ); //this will unlock the mutex and wait atomically
+        GRAB_STATUS_T status = waitGrab ( lck, timeout, [this]{ return ready; } );
+        if ( status == GRAB_SUCCESS ) frame_pending = false;
+        return status;
+    };
+    GRAB_STATUS_T tryFrame() {
+        std::unique_lock<std::mutex> lck ( _mutex );
+
+        if ( frame_pending ) {
+            frame_pending = false;
+            return GRAB_SUCCESS;
+        }
+        // the next frame will be waiting for the next try
+        wantToGrab=true;
+        return GRAB_NO_FRAME;
+    };
+    GRAB_STATUS_T waitForLease(std::chrono::milliseconds timeout, MMAL_BUFFER_HEADER_T **buffer) {
+        std::unique_lock<std::mutex> lck ( _mutex );
+
+        lease_waiters++;
+        GRAB_STATUS_T status = waitGrab ( lck, timeout, [this]{ return lease_buffer != NULL; } );
+        lease_waiters--;
+        if ( status != GRAB_SUCCESS ) {
+            // nobody is left to take the buffer acquired for the lease
+            if ( lease_waiters == 0 && lease_buffer ) {
+                recycleBuffer ( lease_buffer );
+                lease_buffer = NULL;
+            }
+            return status;
+        }
+        *buffer = lease_buffer;
+        lease_buffer = NULL;
+        leases_out++;
+        return GRAB_SUCCESS;
     };
-    void Broadcast() {
-        ready = true;
+    GRAB_STATUS_T takeLatest(std::chrono::milliseconds timeout, MMAL_BUFFER_HEADER_T **buffer) {
+        // fast path, the mailbox already holds a frame
+        *buffer = mailbox.exchange ( NULL );
+        if ( !*buffer ) {
+            if ( timeout.count() == 0 ) return GRAB_NO_FRAME;
+            std::unique_lock<std::mutex> lck ( _mutex );
+            GRAB_STATUS_T status = waitGrab ( lck, timeout, [this, buffer]{ return ( *buffer = mailbox.exchange ( NULL ) ) != NULL; } );
+            if ( status != GRAB_SUCCESS ) return status;
+        }
+        leases_out++;
+        return GRAB_SUCCESS;
+    };
+    void pushBatch(MMAL_BUFFER_HEADER_T *buffer) {
+        // called with _mutex locked from the preview callback
+        // a full ring drops the frame, retrieveBatch sees the gap in the sequence
+        if ( batch_count == batch_ring.size() ) return;
+        mmal_buffer_header_acquire ( buffer );
+        leases_out++;
+        batch_ring[( batch_head + batch_count ) % batch_ring.size()] = buffer;
+        batch_count++;
+    };
+    MMAL_BUFFER_HEADER_T * popBatch() {
+        // called with _mutex locked
+        MMAL_BUFFER_HEADER_T *buffer = batch_ring[batch_head];
+        batch_head = ( batch_head + 1 ) % batch_ring.size();
+        batch_count--;
+        return buffer;
+    };
+    void resetBatch(unsigned int count) {
+        // called with _mutex locked, the ring may take the pool buffers the port can spare
+        unsigned int spare = PREVIEW_LEASE_BUFFERS_NUM;
+        if ( pool && port && pool->headers_num > port->buffer_num_min ) spare = pool->headers_num - port->buffer_num_min;
+        batch_ring.assign ( std::max ( std::min ( count, spare ), 1u ), NULL );
+        batch_head = 0;
+        batch_count = 0;
+    };
+    void cancelWaiters() {
+        std::unique_lock<std::mutex> lck ( _mutex );
+
+        cancel_generation++;
         cv.notify_all();
     };
+    void drainMailbox() {
+        MMAL_BUFFER_HEADER_T *buffer = mailbox.exchange ( NULL );
+        if ( !buffer ) return;
+        std::unique_lock<std::mutex> lck ( _mutex );
+        recycleBuffer ( buffer );
+    };
+    void recycleBuffer(MMAL_BUFFER_HEADER_T *buffer) {
+        // called with _mutex locked, so the port and the pool can't be detached meanwhile
+        mmal_buffer_header_release ( buffer );
+        // the port may have starved while the buffer was held
+        if ( port && port->is_enabled && pool ) {
+            MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get ( pool->queue );
+            if ( new_buffer && mmal_port_send_buffer ( port, new_buffer ) != MMAL_SUCCESS )
+                cerr << "Unable to return a leased buffer to the preview port" << endl;
+        }
+    };
+    void releaseLease(MMAL_BUFFER_HEADER_T *buffer) {
+        std::unique_lock<std::mutex> lck ( _mutex );
+        recycleBuffer ( buffer );
+        leases_out--;
+        cv.notify_all();
+    };
+    void storeInRing(MMAL_BUFFER_HEADER_T *buffer) {
+        // called with _mutex locked
+        unsigned char *slot = ring.nextSlot();
+        if ( !slot ) return;
+        FRAME_LAYOUT buffer_layout = layout;
+        applyBufferLayout ( buffer_layout, buffer );
+        // only the planes of the layout are copied (the Y plane for GREY previews)
+        size_t length = vcos_min ( vcos_min ( buffer->length, frameExtent ( buffer_layout ) ), ring.getSlotSize() );
+        mmal_buffer_header_mem_lock ( buffer );
+        memcpy ( slot,buffer->data + buffer->offset,length );
+        mmal_buffer_header_mem_unlock ( buffer );
+        ring.commit ( length );
+        grabbed_layout = buffer_layout;
+        if ( buffer->user_data ) grabbed_stamp = *( FRAME_STAMP * ) buffer->user_data;
+        grabbed_info = makeFrameInfo ( grabbed_stamp, grabDrops ( grabbed_stamp ) );
+    };
+    void resetSequence(int64_t period) {
+        frame_period = period;
+        pts_origin = MMAL_TIME_UNKNOWN;
+        last_pts = MMAL_TIME_UNKNOWN;
+        next_sequence = 0;
+        next_grab_sequence = 0;
+        stc_sample = MMAL_TIME_UNKNOWN;
+        stc_sample_time = std::chrono::steady_clock::time_point();
+    };
+    void sampleStc(MMAL_PORT_T *stamp_port) {
+        // called from the preview callback without _mutex, the STC is a VideoCore round trip so it is
+        // read once per PREVIEW_STC_SAMPLE_MS and followed with the host clock in between
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if ( stc_sample_time != std::chrono::steady_clock::time_point() &&
+             now - stc_sample_time < std::chrono::milliseconds ( PREVIEW_STC_SAMPLE_MS ) ) return;
+        uint64_t stc;
+        stc_sample_time = now;
+        if ( mmal_port_parameter_get_uint64 ( stamp_port, MMAL_PARAMETER_SYSTEM_TIME, &stc ) == MMAL_SUCCESS ) {
+            stc_sample = ( int64_t ) stc;
+            stc_sample_time = std::chrono::steady_clock::now();
+        }
+    };
+    void stampFrame(MMAL_BUFFER_HEADER_T *buffer) {
+        // called with _mutex locked from the preview callback
+        FRAME_STAMP *stamp = ( FRAME_STAMP * ) buffer->user_data;
+        if ( !stamp ) return;
+        stamp->receive_time = std::chrono::steady_clock::now();
+        stamp->flags = buffer->flags;
+        stamp->latency = -1;
+        stamp->pts = stamp->dts = MMAL_TIME_UNKNOWN;
+        if ( buffer->pts == MMAL_TIME_UNKNOWN ) {
+            stamp->sequence = next_sequence++;
+            return;
+        }
+        // the camera timestamps with the raw STC, made zero based on the first frame
+        if ( stc_sample != MMAL_TIME_UNKNOWN ) {
+            int64_t stc = stc_sample + std::chrono::duration_cast<std::chrono::microseconds> ( stamp->receive_time - stc_sample_time ).count();
+            if ( stc >= buffer->pts ) stamp->latency = stc - buffer->pts;
+        }
+        if ( pts_origin == MMAL_TIME_UNKNOWN ) pts_origin = buffer->pts;
+        stamp->pts = buffer->pts - pts_origin;
+        if ( buffer->dts != MMAL_TIME_UNKNOWN ) stamp->dts = buffer->dts - pts_origin;
+        // frames lost before the callback show up as a gap in the pts
+        if ( last_pts != MMAL_TIME_UNKNOWN && frame_period > 0 ) {
+            int64_t missed = ( buffer->pts - last_pts + frame_period/2 ) / frame_period - 1;
+            if ( missed > 0 ) next_sequence += missed;
+        }
+        last_pts = buffer->pts;
+        stamp->sequence = next_sequence++;
+    };
+    uint64_t grabDrops(const FRAME_STAMP &stamp) {
+        // called with _mutex locked, frames skipped since the previous grab
+        uint64_t dropped = stamp.sequence > next_grab_sequence ? stamp.sequence - next_grab_sequence : 0;
+        next_grab_sequence = stamp.sequence + 1;
+        return dropped;
+    };
+    void attachStamps(MMAL_POOL_T *stamped_pool) {
+        stamps.assign ( stamped_pool->headers_num, FRAME_STAMP() );
+        for ( unsigned int i = 0; i < stamped_pool->headers_num; i++ )
+            stamped_pool->header[i]->user_data = &stamps[i];
+    };
+    void deliverToSubscribers(MMAL_BUFFER_HEADER_T *buffer) {
+        // pushed outside of the lock, a blocking subscriber must not hold up (un)subscribing, and
+        // after the others so its bounded wait doesn't delay them
+        std::vector<std::shared_ptr<FrameSubscriber> > targets;
+        {
+            std::unique_lock<std::mutex> lck ( subscribers_mutex );
+            targets.reserve ( subscribers.size() );
+            for ( auto &subscriber : subscribers )
+                if ( subscriber.second->getPolicy() != FRAME_DELIVERY_BLOCK ) targets.push_back ( subscriber.second );
+            for ( auto &subscriber : subscribers )
+                if ( subscriber.second->getPolicy() == FRAME_DELIVERY_BLOCK ) targets.push_back ( subscriber.second );
+        }
+        for ( auto &subscriber : targets ) {
+            mmal_buffer_header_acquire ( buffer );
+            leases_out++;
+            subscriber->push ( FrameLease ( buffer, this, layout ) );
+        }
+    };
+    void flushSubscribers() {
+        std::unique_lock<std::mutex> lck ( subscribers_mutex );
+
+        for ( auto &subscriber : subscribers ) subscriber.second->flush();
+    };
+    void detachPort() {
+        // the released leases stop feeding the port, which is being destroyed
+        std::unique_lock<std::mutex> lck ( _mutex );
 
+        port = NULL;
+        pool = NULL;
+    };
+    void waitLeasesReleased(unsigned int warning_ms) {
+        // the pool can't be destroyed while a lease holds one of its buffers, whatever the time it takes
+        std::unique_lock<std::mutex> lck ( _mutex );
+
+        if ( cv.wait_for ( lck, std::chrono::milliseconds(warning_ms), [this]{ return leases_out == 0; } ) ) return;
+        cerr << "Waiting for " << leases_out << " frame leases to be released" << endl;
+        cv.wait ( lck, [this]{ return leases_out == 0; } );
+    };
+    void Broadcast(bool stored) {
+        // only a frame copied in the ring completes a grab or a try, the other deliveries just wake their waiters
+        if ( stored ) {
+            ready = true;
+            frame_pending = true;
+        }
+        cv.notify_all();
+    };
 
+
+    MMAL_PORT_T *port;
     MMAL_POOL_T *pool;
     std::mutex _mutex;
     bool ready;
     condition_variable cv;
     bool wantToGrab;
-    unsigned int buffer_length;
-    unsigned char * buffer_data;
+    bool frame_pending;                   /// A grabbed frame has not been consumed by a grab yet
+    unsigned long cancel_generation;      /// Incremented to wake up and cancel all the waiters
+    FrameRing ring;                       /// Preallocated copies of the grabbed frames
+    FRAME_STAMP grabbed_stamp;            /// Stamp of the latest frame copied in the ring
+    FRAME_LAYOUT grabbed_layout;          /// Layout of the latest frame copied in the ring
+    FRAME_INFO grabbed_info;              /// Metadata of the latest frame copied in the ring
+
+    int64_t frame_period;                 /// Expected time between two frames (us), 0 if unknown
+    int64_t pts_origin;                   /// Raw pts of the first frame of the preview
+    int64_t last_pts;                     /// Raw pts of the previous frame
+    int64_t stc_sample;                   /// Last STC read by sampleStc, MMAL_TIME_UNKNOWN if none
+    std::chrono::steady_clock::time_point stc_sample_time;   /// Host time of stc_sample, only used by the callback
+    uint64_t next_sequence;               /// Sequence number of the next frame
+    uint64_t next_grab_sequence;          /// Sequence number following the last grabbed frame
+
+    FRAME_LAYOUT layout;                  /// Layout of the frames of the port
+    int output_format;                    /// Format retrieve() converts the frames to, 0 to copy them as they are
+    unsigned int lease_waiters;           /// Number of threads waiting in waitForLease
+    MMAL_BUFFER_HEADER_T *lease_buffer;   /// Buffer acquired by the callback for the next lease
+    std::atomic<unsigned int> leases_out; /// Number of leases not yet released
+
+    std::mutex subscribers_mutex;
+    std::map<int, std::shared_ptr<FrameSubscriber> > subscribers;   /// Push consumers of the frames, shared with a delivery in progress
+    int next_subscriber_id;
+
+    std::atomic<bool> mailbox_mode;                   /// Keep the newest frame in the mailbox
+    std::atomic<MMAL_BUFFER_HEADER_T *> mailbox;      /// Newest frame, owned by the mailbox
+    std::vector<FRAME_STAMP> stamps;                  /// One stamp per buffer header of the pool
+
+    std::mutex batch_mutex;                                     /// One retrieveBatch at a time
+    bool batch_active;                                          /// Callback feeds the batch ring
+    std::vector<MMAL_BUFFER_HEADER_T *> batch_ring;             /// Frames waiting for retrieveBatch, sized by resetBatch
+    unsigned int batch_head;
+    unsigned int batch_count;
 
 };
 struct PORT_ENCODER_USERDATA
 {
-   std::ofstream * file;
-   MMAL_POOL_T * encoder_pool;
-   bool encode_completed;/// Pointer to the pool of buffers used by encoder output port
+   EncodedSink * sink;
+   MMAL_POOL_T * encoder_pool;/// Pointer to the pool of buffers used by encoder output port
+
+   std::mutex capture_mutex;                        /// Protects the capture, taken by the encoder callback
+   std::atomic<bool> capture_pending;               /// A capture waits for its image
+   STILL_CAPTURE_RESULT capture_result;
+   std::promise<STILL_CAPTURE_RESULT> capture_promise;
+
+   // called with capture_mutex locked: the sink is closed before the future is ready
+   void completeCapture(STILL_CAPTURE_STATUS_T status) {
+       if ( !capture_pending ) return;
+       if ( sink ) sink->close();
+       sink = NULL;
+       capture_result.status = status;
+       capture_result.completed = std::chrono::steady_clock::now();
+       capture_pending = false;
+       capture_promise.set_value(capture_result);
+   }
+};
+
+/** Components of a video preview made by an ISP on a splitter output
+*/
+struct PREVIEW_RESIZER
+{
+    PREVIEW_RESIZER() {
+        component=NULL;
+        input_port=NULL;
+        output_port=NULL;
+        connection=NULL;
+        pool=NULL;
+        splitter_port=NULL;
+    }
+    MMAL_COMPONENT_T *component;      /// vc.ril.isp
+    MMAL_PORT_T *input_port;
+    MMAL_PORT_T *output_port;
+    MMAL_CONNECTION_T *connection;    /// Connection from the splitter to the ISP
+    MMAL_POOL_T *pool;                /// Buffers of the ISP output port
+    MMAL_PORT_T *splitter_port;       /// Splitter output feeding the ISP
+};
+
+/** Components of a H.264 encoder fed by a splitter or ISP output
+*/
+struct VIDEO_ENCODER
+{
+    VIDEO_ENCODER() {
+        component=NULL;
+        input_port=NULL;
+        output_port=NULL;
+        connection=NULL;
+        pool=NULL;
+    }
+    MMAL_COMPONENT_T *component;      /// vc.ril.video_encode
+    MMAL_PORT_T *input_port;
+    MMAL_PORT_T *output_port;
+    MMAL_CONNECTION_T *connection;    /// Connection from the source port to the encoder
+    MMAL_POOL_T *pool;                /// Buffers of the encoder output port
+};
+
+/** Low resolution video record encoded in parallel of the main one: splitter output -> ISP -> encoder
+*/
+struct VIDEO_SUBSTREAM
+{
+    VIDEO_SUBSTREAM() {
+        width=0;
+        height=0;
+        splitter_port=NULL;
+        isp_component=NULL;
+        isp_connection=NULL;
+    }
+    unsigned int width;
+    unsigned int height;
+    H264_ENCODER_CONFIG config;
+    MMAL_PORT_T *splitter_port;       /// Splitter output feeding the ISP
+    MMAL_COMPONENT_T *isp_component;  /// vc.ril.isp downscaling to the substream size
+    MMAL_CONNECTION_T *isp_connection;/// Connection from the splitter to the ISP
+    VIDEO_ENCODER encoder;
+    RecordWriter writer;
+};
+
+/** Named preview stream, resized in parallel of the video preview on its own splitter output
+*/
+struct PREVIEW_STREAM
+{
+    unsigned int width;
+    unsigned int height;
+    int format;
+    PREVIEW_RESIZER resizer;
+    PORT_PREVIEW_USERDATA callback_data;
 };
 
 class VideoMMALObject
@@ -148,19 +601,86 @@ public:
     unsigned int getVideoPreviewHeight(){ return m_video_preview_height;};
     bool isVideoPreviewOpened(){ return m_is_video_preview_opened;}
     bool grab();
+    GRAB_STATUS_T grab(std::chrono::milliseconds timeout);
+    GRAB_STATUS_T tryGrab();
+    void cancelGrab();
     void retrieve(unsigned char *data);
+    void retrieve(unsigned char *data, unsigned int stride);
+    FrameLease grabLease();
+    GRAB_STATUS_T grabLease(FrameLease &lease, std::chrono::milliseconds timeout);
+    GRAB_STATUS_T retrieveBatch(unsigned int count, unsigned char *data, BATCH_LAYOUT_T layout,
+                                std::vector<int64_t> *timestamps = NULL, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    void setPreviewGrabMode(PREVIEW_GRAB_MODE_T mode);
+    PREVIEW_GRAB_MODE_T getPreviewGrabMode() { return m_preview_grab_mode;}
+    std::chrono::microseconds getGrabbedFrameAge();
+    FRAME_INFO getFrameInfo();
+    int subscribeFrames(FRAME_CALLBACK_T callback, FRAME_DELIVERY_POLICY_T policy, unsigned int queue_depth = FRAME_SUBSCRIBER_QUEUE_DEPTH);
+    void unsubscribeFrames(int subscriber_id);
+    void setCpuColorConversion(bool enable, COLOR_MATRIX_T matrix = COLOR_MATRIX_BT601, COLOR_RANGE_T range = COLOR_RANGE_FULL);
+    bool isCpuColorConversionEnabled() { return m_cpu_color_conversion;}
+
+    bool startPreviewStream(const std::string &name, unsigned int width, unsigned int height, int mmal_image_format);
+    void stopPreviewStream(const std::string &name);
+    bool isPreviewStreamOpened(const std::string &name) { return m_preview_streams.count(name) != 0;}
+    bool hasPreviewStreams() { return !m_preview_streams.empty();}
+    GRAB_STATUS_T grabStream(const std::string &name, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    void retrieveStream(const std::string &name, unsigned char *data, unsigned int stride = 0);
+    GRAB_STATUS_T grabStreamLease(const std::string &name, FrameLease &lease, std::chrono::milliseconds timeout = GRAB_INFINITE);
+    FRAME_INFO getStreamFrameInfo(const std::string &name);
 
 
     void setVideoRecordSize(unsigned int record_width, unsigned int record_height);
+    void setH264EncoderConfig(const H264_ENCODER_CONFIG &config) { m_h264_config = config;}
+    H264_ENCODER_CONFIG getH264EncoderConfig() { return m_h264_config;}
+    bool setVideoBitrate(unsigned int bitrate);
+    void setRecordOverflowPolicy(RECORD_OVERFLOW_POLICY_T policy) { m_record_writer.setOverflowPolicy(policy);}
+    RECORD_OVERFLOW_POLICY_T getRecordOverflowPolicy() { return m_record_writer.getOverflowPolicy();}
+    RECORD_WRITER_STATS getRecordWriterStats() { return m_record_writer.getStats();}
+    void setRecordContainer(RECORD_CONTAINER_T container) { m_record_writer.setContainer(container);}
+    RECORD_CONTAINER_T getRecordContainer() { return m_record_writer.getContainer();}
+    void setRecordSegmentPolicy(const RECORD_SEGMENT_POLICY &policy) { m_record_writer.setSegmentPolicy(policy);}
+    RECORD_SEGMENT_POLICY getRecordSegmentPolicy() { return m_record_writer.getSegmentPolicy();}
+    void setRecordFileMode(RECORD_FILE_MODE_T mode) { m_record_writer.setFileMode(mode);}
+    RECORD_FILE_MODE_T getRecordFileMode() { return m_record_writer.getFileMode();}
+    void setVideoMotionCallback(MOTION_CALLBACK_T callback) { m_record_writer.setMotionCallback(callback);}
     unsigned int getVideoRecordWidth(){ return m_video_record_width;};
     unsigned int getVideoRecordHeight(){ return m_video_record_height;};
     void startVideoRecord(std::string filename);
+    void startVideoRecord(EncodedSink *sink);
+    void startVideoRecord(std::string filename, EncodedSink *sink);
     void stopVideoRecord();
+    void startEventRing(std::chrono::milliseconds duration, size_t max_bytes = 0);
+    bool triggerEventRecord(const std::string &filename, std::chrono::milliseconds pre, std::chrono::milliseconds post);
+    bool isEventRecording() { return m_record_writer.isEventRecording();}
+
+    bool startVideoSubstream(const std::string &filename, unsigned int width, unsigned int height);
+    bool startVideoSubstream(EncodedSink *sink, unsigned int width, unsigned int height);
+    void stopVideoSubstream();
+    bool isVideoSubstreamRecording(){ return m_is_video_substream_recording;}
+    unsigned int getVideoSubstreamWidth(){ return m_video_substream.width;}
+    unsigned int getVideoSubstreamHeight(){ return m_video_substream.height;}
+    void setVideoSubstreamEncoderConfig(const H264_ENCODER_CONFIG &config) { m_video_substream.config = config;}
+    H264_ENCODER_CONFIG getVideoSubstreamEncoderConfig() { return m_video_substream.config;}
+    bool setVideoSubstreamBitrate(unsigned int bitrate);
+    void setVideoSubstreamContainer(RECORD_CONTAINER_T container) { m_video_substream.writer.setContainer(container);}
+    RECORD_CONTAINER_T getVideoSubstreamContainer() { return m_video_substream.writer.getContainer();}
+    void setVideoSubstreamSegmentPolicy(const RECORD_SEGMENT_POLICY &policy) { m_video_substream.writer.setSegmentPolicy(policy);}
+    RECORD_SEGMENT_POLICY getVideoSubstreamSegmentPolicy() { return m_video_substream.writer.getSegmentPolicy();}
+    void setVideoSubstreamMotionCallback(MOTION_CALLBACK_T callback) { m_video_substream.writer.setMotionCallback(callback);}
+    RECORD_WRITER_STATS getVideoSubstreamWriterStats() { return m_video_substream.writer.getStats();}
 
     void setStillRecordSize(unsigned int record_width, unsigned int record_height);
     unsigned int getStillRecordWidth(){ return m_still_record_width;};
     unsigned int getStillRecordHeight(){ return m_still_record_height;};
     void startStillRecord(std::string filename);
+    void startStillRecord(EncodedSink *sink);
+    std::future<STILL_CAPTURE_RESULT> captureStillAsync(EncodedSink *sink);
+    std::future<STILL_CAPTURE_RESULT> captureStillAt(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back);
+    void setZeroShutterLag(bool enable);
+    bool isZeroShutterLag(){ return m_zero_shutter_lag;}
+    int64_t getCameraTime();
+    std::vector<STILL_CAPTURE_RESULT> captureBurst(unsigned int count, std::chrono::milliseconds interval, STILL_SINK_FACTORY_T sink_factory);
+    void setStillPipelinePersistent(bool persistent);
     //void stopStillRecord();
 
 
@@ -168,7 +688,9 @@ public:
     VideoMMALObject(const VideoMMALObject&) = delete;
     VideoMMALObject& operator=(const VideoMMALObject&) = delete;
 
-    bool isStillRecording(){ return m_is_still_recording;}
+    bool isStillRecording(){ return encoder_callback_data.capture_pending;}
+    bool isStillPipelinePersistent(){ return m_still_pipeline_persistent;}
+    bool isStillPipelineReady(){ return still_encoder_component != NULL;}
     bool isVideoRecording(){ return m_is_video_recording;}
     bool areVideoComponentsReady(){ return m_are_video_components_ready;}
     bool isOpened(){ return m_is_opened;}
@@ -219,17 +741,24 @@ private:
     unsigned int m_video_record_width;
     unsigned int m_video_record_height;
     bool m_is_video_recording;
+    bool m_is_video_substream_recording;
 
     unsigned int m_still_record_width;
     unsigned int m_still_record_height;
-    bool m_is_still_recording;
+    bool m_still_pipeline_persistent;     /// The still encoder is kept between the captures
+    bool m_zero_shutter_lag;              /// Camera created in zero shutter lag mode
 
 
     bool m_is_opened;
     bool m_are_video_components_ready;
 
+    PREVIEW_GRAB_MODE_T m_preview_grab_mode;
+    bool m_cpu_color_conversion;
+    ColorConverter m_color_converter;
+
 
     CAMERA_PARAMETERS m_cam_params;
+    H264_ENCODER_CONFIG m_h264_config;
 
     void setDefaultsCamParams();
     void commitParameters();
@@ -240,23 +769,50 @@ private:
     void destroyVideoComponents();
     void createVideoComponents();
 
-    void createStillEncoderComponent();
+    bool createStillEncoderComponent();
+    std::future<STILL_CAPTURE_RESULT> startStillCapture(EncodedSink *sink, int64_t trigger, std::chrono::microseconds look_back);
+    void finishStillCapture();
     void destroyStillEncoderComponent();
 
     void createVideoEncoderComponent();
     void destroyVideoEncoderComponent();
+    bool createEncoder(VIDEO_ENCODER &encoder, RecordWriter &writer, MMAL_PORT_T *source_port,
+                       const H264_ENCODER_CONFIG &config, const std::string &filename);
+    void destroyEncoder(VIDEO_ENCODER &encoder, RecordWriter &writer);
+    void commitH264EncoderConfig(MMAL_PORT_T *port, const H264_ENCODER_CONFIG &config);
+    bool setEncoderBitrate(VIDEO_ENCODER &encoder, H264_ENCODER_CONFIG &config, unsigned int bitrate);
+
+    void openVideoRecord(const std::string &filename, EncodedSink *sink);
+    bool openVideoSubstream(const std::string &filename, EncodedSink *sink, unsigned int width, unsigned int height);
+    bool createVideoSubstreamComponents(const std::string &filename);
+    void destroyVideoSubstreamComponents();
 
     void destroyVideoPreviewComponent();
     void createVideoPreviewComponent();
 
     void destroyStillPreviewComponent();
     void createStillPreviewComponent();
+    int previewPortFormat(int preview_format);
+    void setPreviewLayout(PORT_PREVIEW_USERDATA &pData, MMAL_PORT_T *port, int preview_format);
+
+    bool createResizer(PREVIEW_RESIZER &resizer, PORT_PREVIEW_USERDATA &pData, MMAL_PORT_T *splitter_port,
+                       unsigned int width, unsigned int height, int preview_format);
+    void destroyResizer(PREVIEW_RESIZER &resizer, PORT_PREVIEW_USERDATA &pData);
+
+    MMAL_PORT_T *acquireSplitterOutput();
+    void releaseSplitterOutput(MMAL_PORT_T *port);
+
+    GRAB_STATUS_T grabFrom(PORT_PREVIEW_USERDATA &pData, std::chrono::milliseconds timeout);
+    void retrieveFrom(PORT_PREVIEW_USERDATA &pData, unsigned char *data, unsigned int stride);
+    GRAB_STATUS_T grabLeaseFrom(PORT_PREVIEW_USERDATA &pData, FrameLease &lease, std::chrono::milliseconds timeout);
+    PREVIEW_STREAM *findPreviewStream(const std::string &name);
 
 
     MMAL_STATUS_T connectPorts ( MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection );
     void destroyConnection(MMAL_CONNECTION_T *connection);
 
     static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+    static void video_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
     static void preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 
 
@@ -275,11 +831,12 @@ private:
 
 
     /* Used in Video record */
-    MMAL_COMPONENT_T *video_encoder_component;	/// Pointer to the video_encoder component
-    MMAL_CONNECTION_T *video_encoder_connection; // Connection from the splitter to the video_encoder
-    MMAL_PORT_T *video_encoder_input_port;
-    MMAL_PORT_T *video_encoder_output_port;
-    MMAL_POOL_T *video_encoder_pool;
+    VIDEO_ENCODER video_encoder;       /// Encoder on the splitter record output
+    std::string m_video_record_filename;
+    RecordWriter m_record_writer;      /// Writes the video encoder output on its own thread
+
+    /* Used in Video substream */
+    VIDEO_SUBSTREAM m_video_substream;
 
     /* Used in Still record */
     MMAL_COMPONENT_T *still_encoder_component;	/// Pointer to the video_encoder component
@@ -292,11 +849,11 @@ private:
     PORT_ENCODER_USERDATA encoder_callback_data;
 
     /* Used in preview video*/
-    MMAL_PORT_T *resizer_output_port;
-    MMAL_PORT_T *resizer_input_port;
-    MMAL_COMPONENT_T *resizer_component;
-    MMAL_CONNECTION_T *resizer_connection; // Connection from the splitter to the resizer
-    MMAL_POOL_T *resize_pool;
+    PREVIEW_RESIZER video_preview_resizer;
+
+    /* Named preview streams on the free splitter outputs */
+    std::map<std::string, std::unique_ptr<PREVIEW_STREAM> > m_preview_streams;
+    bool m_splitter_output_used[SPLITTER_OUTPUTS_NUM];
 
 
     /* Used in preview Still*/